@@ -10,4 +10,30 @@
 #define STEPPER_COUNT 5
 #endif
 
+// Merge short collinear moves, as the firmware does
+#define COALESCE_SEGMENTS
+
+// Settings from the MightyBoard's Configuration.hh used by the motion code
+
+#ifndef EXTRUDERS
+#define EXTRUDERS 2
+#endif
+
+// Extruder advance, as the MightyBoard builds, and its 1/16 microstepping
+#define JKN_ADVANCE
+#define MICROSTEPPING 4
+
+// Input shaping, as the Replicator 2 builds.  It's off unless stepsim -r turns it on
+#define INPUT_SHAPING
+
+// Next block setup from the main loop, and the counters which show how often
+// it's ready in time, as the MightyBoard builds
+#define BLOCK_PREFETCH
+#define MOTION_STATS
+
+#define ACCELERATION_MIN_SEGMENT_TIME 0.0125
+#define ACCELERATION_MIN_PLANNER_SPEED 2
+#define ACCELERATION_EXTRUDE_WHEN_NEGATIVE_A true
+#define ACCELERATION_EXTRUDE_WHEN_NEGATIVE_B true
+
 #endif
@@ -8,6 +8,7 @@
 #ifdef SIMULATOR
 
 #include <inttypes.h>
+#include <stddef.h>
 #include "avrfix.h"
 
 #define FPTYPE _Accum
@@ -15,6 +16,12 @@
 // avr-gcc makes double the same as float
 #define double float
 
+// From avr-libc and the firmware's StepperAxis.hh
+#ifndef _BV
+#define _BV(bit) (1 << (bit))
+#endif
+#define FORCE_INLINE inline
+
 // Maybe at some point in the future, we'll want to replace these
 // with pthread mutices.  That, if it becomes desirable to simulate
 // interrupts pulling information out of the pipeline: use a thread
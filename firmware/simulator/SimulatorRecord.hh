@@ -9,6 +9,10 @@
 #define RECORD_SQRT   4  // Record a square root op
 #define RECORD_CALC   5  // Record a calculation op
 #define RECORD_RECALC 6  // Record a re-calculation op
+#define RECORD_QUEUED_TIME 7  // Record the queued time seen by plan_buffer_line()
+#define RECORD_SLOWDOWN 8  // Record a block slowed down by the SLOWDOWN logic
+#define RECORD_COALESCE_MOVES  9  // Record a move passed to setTargetNewExt()
+#define RECORD_COALESCE_MERGED 10 // Record a move merged into the held segment
 
 // This macro is used in StepperAccelPlanner.cc to record
 // operations.  When SIMULATOR is defined, it actually calls
@@ -0,0 +1,24 @@
+// SimulatorRegisters.hh
+// Mock of the AVR registers and pins used by the stepper interrupt, so that
+// StepperAccel.cc builds and runs on the host.  stepsim defines them, the
+// planner never runs the interrupt and doesn't need them.
+
+#ifndef SIMULATOR_REGISTERS_HH_
+
+#define SIMULATOR_REGISTERS_HH_
+
+#include <inttypes.h>
+
+// Timer 5, the stepper interrupt.  The interrupt sets OCR5A to the ticks
+// until it's to be called again.
+extern volatile uint16_t OCR5A;
+extern volatile uint16_t TCNT5;
+extern volatile uint8_t  TIMSK5;
+#define OCIE5A 1
+
+// Called for every write to the step pins, with the bit mask of the axes
+// written, and for every write to an axis's direction pin
+extern void simulator_step_pins(uint8_t axes, bool value);
+extern void simulator_direction_pin(uint8_t axis, bool value);
+
+#endif
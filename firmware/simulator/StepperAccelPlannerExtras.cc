@@ -17,6 +17,13 @@
 #include "StepperAccelPlanner.hh"
 #include "StepperAccelPlannerExtras.hh"
 #include "avrfix.h"
+#ifdef SCURVE
+#include "StepperAccelSCurve.hh"
+#elif defined(INPUT_SHAPING)
+#include "StepperAccelShaper.hh"
+#else
+#include "StepperAccelRamp.hh"
+#endif
 
 #define min(a,b) (((a)<=(b))?(a):(b))
 #define max(a,b) (((a)>=(b))?(a):(b))
@@ -26,26 +33,13 @@ bool     simulator_use_max_feed_rate  = false;
 FPTYPE   simulator_max_feed_rate      = 0;
 bool     simulator_dump_speeds        = false;
 bool     simulator_show_alt_feed_rate = false;
+bool     simulator_quiet              = false;
+FILE    *simulator_velocity_file      = NULL;
 
 uint32_t z1[100000];
 uint32_t z2[100000];
 int iz = 0;
 
-// From StepperAccel.cc
-static bool deprime_enabled = true;
-static bool deprimed[EXTRUDERS];
-int16_t extruder_deprime_steps[EXTRUDERS];
-bool extrude_when_negative[EXTRUDERS];
-
-// From Steppers.cc
-float extruder_only_max_feedrate[EXTRUDERS];
-volatile int32_t starting_e_position[2];
-
-// From StepperAxis.hh
-volatile int32_t dda_position[STEPPER_COUNT];
-volatile int32_t e_steps[EXTRUDERS];
-volatile uint8_t axesEnabled;
-
 // From time to time, StepperAccelPlanner.cc wants these for debugging
 volatile float zadvance, zadvance2;
 
@@ -53,6 +47,10 @@ volatile float zadvance, zadvance2;
 // A block cannot be planned more time than there are blocks in the pipe line
 static int planner_counts[BLOCK_BUFFER_SIZE+1];
 
+// Bins for tallying up how many times blocks are visited by the reverse and forward passes
+// Each pass visits a block at most once per block added behind it
+static int planner_pass_counts[2*BLOCK_BUFFER_SIZE+1];
+
 // Track total time required to print
 static float total_time = 0.0;
 
@@ -64,6 +62,16 @@ static int record_sqrt   = 0;
 static int record_calc   = 0;
 static int record_recalc = 0;
 
+// Queued time statistics, in PLAN_TIME_UNITS
+static int record_queued_min   = -1;
+static int record_queued_count = 0;
+static double record_queued_total = 0.0;
+static int record_slowdown     = 0;
+
+// Coalescing statistics
+static int record_coalesce_moves  = 0;
+static int record_coalesce_merged = 0;
+
 void plan_record(void *ctx, int item_code, ...)
 {
      va_list ap;
@@ -99,6 +107,28 @@ void plan_record(void *ctx, int item_code, ...)
 	       record_recalc += va_arg(ap, int);
 	       break;
 
+	  case RECORD_QUEUED_TIME:
+	  {
+	       int queued = va_arg(ap, int);
+	       if (record_queued_min < 0 || queued < record_queued_min)
+		    record_queued_min = queued;
+	       record_queued_total += (double)queued;
+	       record_queued_count++;
+	       break;
+	  }
+
+	  case RECORD_SLOWDOWN:
+	       record_slowdown += va_arg(ap, int);
+	       break;
+
+	  case RECORD_COALESCE_MOVES:
+	       record_coalesce_moves += va_arg(ap, int);
+	       break;
+
+	  case RECORD_COALESCE_MERGED:
+	       record_coalesce_merged += va_arg(ap, int);
+	       break;
+
 	  default :
 	       goto badness;
 	  }
@@ -112,33 +142,6 @@ extern volatile unsigned char block_buffer_head;           // Index of the next
 extern volatile unsigned char block_buffer_tail;           // Index of the block to process now
 
 
-void st_set_position(const int32_t &x, const int32_t &y, const int32_t &z, const int32_t &a, const int32_t &b)
-{
-  CRITICAL_SECTION_START;
-  dda_position[X_AXIS] = x;
-  dda_position[Y_AXIS] = y;
-  dda_position[Z_AXIS] = z;
-  dda_position[A_AXIS] = a;
-  dda_position[B_AXIS] = b;
-#ifdef JKN_ADVANCE
-  starting_e_position[0] = dda_position[A_AXIS]; 
-  starting_e_position[1] = dda_position[B_AXIS]; 
-#endif
-  CRITICAL_SECTION_END;
-}
-
-void st_set_e_position(const int32_t &a, const int32_t &b)
-{
-  CRITICAL_SECTION_START;
-  dda_position[A_AXIS] = a;
-  dda_position[B_AXIS] = b;
-#ifdef JKN_ADVANCE
-  starting_e_position[0] = dda_position[A_AXIS]; 
-  starting_e_position[1] = dda_position[B_AXIS]; 
-#endif
-  CRITICAL_SECTION_END;
-}
-
 int32_t st_get_position(uint8_t axis)
 {
   int32_t count_pos;
@@ -148,15 +151,6 @@ int32_t st_get_position(uint8_t axis)
   return count_pos;
 }
 
-void st_deprime_enable(bool enable)
-{
-    deprime_enabled = enable;
-
-    for ( uint8_t i = 0; i < EXTRUDERS; i++ ) {
-	deprimed[i] = true;
-    }  
-}
-
 static uint16_t calc_timer(uint16_t step_rate, int *step_loops)
 {
      if (step_rate > MAX_STEP_FREQUENCY)
@@ -183,10 +177,22 @@ static uint16_t calc_timer(uint16_t step_rate, int *step_loops)
      return (uint16_t)((uint32_t)2000000 / (uint32_t)step_rate);
 }
 
+// Append a "time step-rate" sample to the velocity curve file.  ticks is the
+// 2 MHz time since the start of the current block.
+
+static void velocity_sample(int32_t ticks, uint16_t rate)
+{
+     if (simulator_velocity_file)
+	  fprintf(simulator_velocity_file, "%.6f %u\n",
+		  total_time + (float)ticks / 2000000.0, rate);
+}
+
 void init_extras(bool accel)
 {
      steppers::acceleration = (accel & 0x01) ? true : false;
      steppers::setSegmentAccelState(steppers::acceleration);
+     // reset() enabled deprime with acceleration off
+     steppers::deprimeEnable(true);
 }
 
 void plan_dump_current_block(int discard)
@@ -201,12 +207,24 @@ void plan_dump_current_block(int discard)
      uint8_t out_bits;
      static float z_height = 10.0;  // figure z-offset is around 10
      uint16_t timer;
+     int32_t ramp_ticks;
+#ifdef SCURVE
+     scurve_t scurve;
+#elif defined(INPUT_SHAPING)
+     shaper_ramp_t shaper;
+#else
+     ramp_t ramp;
+#endif
 
      block = plan_get_current_block();
      if (!block)
 	  return;
 
-     if (block->message[0] != '\0')
+     // Starting the block consumes any absolute position it carries
+     if (block->position_resync)
+	  plan_position_resync_state = PLAN_RESYNC_FREE;
+
+     if (block->message[0] != '\0' && !simulator_quiet)
 	  printf("%s", block->message);
 
      action[0] = (block->steps[X_AXIS] != 0) ?
@@ -231,6 +249,8 @@ void plan_dump_current_block(int discard)
 	     deceleration_time = 0;
 	     coast_time        = 0;
 	     step_events_completed = block->step_event_count;
+	     velocity_sample(0, acc_step_rate);
+	     velocity_sample(acceleration_time, acc_step_rate);
      }
      else
      {
@@ -244,6 +264,15 @@ void plan_dump_current_block(int discard)
 	     coast_time        = 0;
 	     step_events_completed = 0;
 	     intermed          = 0;
+	     velocity_sample(0, acc_step_rate);
+	     ramp_ticks = acceleration_time;
+#ifdef SCURVE
+	     scurve_start(&scurve, block->scurve_accel_jerk, block->scurve_accel_updates);
+#elif defined(INPUT_SHAPING)
+	     shaper_start(&shaper, block->shaper_accel_rate, block->shaper_accel_box);
+#else
+	     ramp_start(&ramp, block->acceleration_rate);
+#endif
 
 	     for (step_events_completed = step_loops;
 		  step_events_completed <= block->step_event_count; )
@@ -254,9 +283,13 @@ void plan_dump_current_block(int discard)
 			     step_events_completed += step_loops;
 			     uint16_t old_acc_step_rate = acc_step_rate;
 			     uint16_t intermed_a;
-			     acc_step_rate = intermed_a =
-				     (uint16_t)((0xffffffffff & ((uint64_t)(0x00ffffff & acceleration_time) * 
-								 (uint64_t)(0x00ffffff & block->acceleration_rate))) >> 24);
+#ifdef SCURVE
+			     acc_step_rate = intermed_a = scurve_delta(&scurve, &ramp_ticks);
+#elif defined(INPUT_SHAPING)
+			     acc_step_rate = intermed_a = shaper_delta(&shaper, &ramp_ticks);
+#else
+			     acc_step_rate = intermed_a = ramp_delta(&ramp, &ramp_ticks);
+#endif
 			     acc_step_rate += block->initial_rate;
 			     if (acc_step_rate < old_acc_step_rate)
 				     printf("*** While accelerating, the step rate overflowed: "
@@ -267,7 +300,9 @@ void plan_dump_current_block(int discard)
 					    acceleration_time);
 			     if (acc_step_rate > block->nominal_rate)
 				     acc_step_rate = block->nominal_rate;
+			     velocity_sample(acceleration_time, acc_step_rate);
 			     acceleration_time += timer = calc_timer(acc_step_rate, &step_loops);
+			     ramp_ticks += timer;
 			     dec_step_rate = acc_step_rate;
 		     }
 		     else if (step_events_completed > (uint32_t)(0x7fffffff & block->decelerate_after))
@@ -275,9 +310,24 @@ void plan_dump_current_block(int discard)
 			     // speed(t) = speed(0) - deceleration * t
 			     step_events_completed += step_loops;
 			     uint16_t old_intermed = intermed;
-			     intermed =
-				     (uint16_t)((0xffffffffff & ((uint64_t)(0x00ffffff & deceleration_time) * 
-								 (uint64_t)(0x00ffffff & block->acceleration_rate))) >> 24);
+			     if (deceleration_time == 0)
+			     {
+#ifdef SCURVE
+				  scurve_start(&scurve, block->scurve_decel_jerk, block->scurve_decel_updates);
+#elif defined(INPUT_SHAPING)
+				  shaper_start(&shaper, block->shaper_decel_rate, block->shaper_decel_box);
+#else
+				  ramp_start(&ramp, block->acceleration_rate);
+#endif
+				  ramp_ticks = 0;
+			     }
+#ifdef SCURVE
+			     intermed = scurve_delta(&scurve, &ramp_ticks);
+#elif defined(INPUT_SHAPING)
+			     intermed = shaper_delta(&shaper, &ramp_ticks);
+#else
+			     intermed = ramp_delta(&ramp, &ramp_ticks);
+#endif
 			     if (intermed > acc_step_rate)
 				     dec_step_rate = block->final_rate;
 			     else
@@ -290,12 +340,15 @@ void plan_dump_current_block(int discard)
 					    dec_step_rate, acc_step_rate, intermed,
 					    acc_step_rate, block->acceleration_rate,
 					    deceleration_time);
-			     deceleration_time += calc_timer(dec_step_rate, &step_loops);
+			     velocity_sample(acceleration_time + coast_time + deceleration_time, dec_step_rate);
+			     deceleration_time += timer = calc_timer(dec_step_rate, &step_loops);
+			     ramp_ticks += timer;
 		     }
 		     else
 		     {
 			     // Must make this call as it has side effects
 			     step_events_completed += step_loops;
+			     velocity_sample(acceleration_time + coast_time, acc_step_rate);
 			     coast_time += calc_timer(acc_step_rate, &step_loops);
 			     dec_step_rate = acc_step_rate;
 		     }
@@ -321,7 +374,9 @@ void plan_dump_current_block(int discard)
      }
 
      i++;
-     if (simulator_dump_speeds)
+     if (simulator_quiet)
+	  ;
+     else if (simulator_dump_speeds)
      {
 	  float total_time = (float)(acceleration_time + coast_time + deceleration_time /*- last_time */) / 2000000.0;
 	  float speed_xyze = FPTOF(block->millimeters)/total_time;
@@ -347,6 +402,7 @@ void plan_dump_current_block(int discard)
 		 count_direction[B_AXIS]*block->steps[B_AXIS]);
 
      planner_counts[max(0, min(block->planned, BLOCK_BUFFER_SIZE))] += 1;
+     planner_pass_counts[max(0, min(block->passes, 2*BLOCK_BUFFER_SIZE))] += 1;
      total_time += (float)(acceleration_time + coast_time + deceleration_time) / 2000000.0;
 
      if (discard)
@@ -372,11 +428,53 @@ void plan_dump_run_data(void)
 	    ihours, imins, isecs, idsecs, total_time);
 
      printf("Planner counts:\n");
+     cnt = 0;
+     ztot1 = 0;
      for (i = 0; i <= BLOCK_BUFFER_SIZE; i++)
 	  if (planner_counts[i])
+	  {
 	       printf("    %d: %d\n", i, planner_counts[i]);
+	       cnt   += planner_counts[i];
+	       ztot1 += i * planner_counts[i];
+	  }
+     if (cnt)
+	  printf("Average plans per block = %f\n", (float)ztot1 / (float)cnt);
+
+     printf("Planner pass visits:\n");
+     cnt = 0;
+     ztot1 = 0;
+     for (i = 0; i <= 2*BLOCK_BUFFER_SIZE; i++)
+	  if (planner_pass_counts[i])
+	  {
+	       printf("    %d: %d\n", i, planner_pass_counts[i]);
+	       cnt   += planner_pass_counts[i];
+	       ztot1 += i * planner_pass_counts[i];
+	  }
+     if (cnt)
+	  printf("Average pass visits per block = %f\n", (float)ztot1 / (float)cnt);
+     if (cnt)
+	  printf("Average square roots per block = %f\n", (float)record_sqrt / (float)cnt);
+
+     if (record_queued_count)
+	  printf("Min/Average queued time = %.1f / %.1f ms; blocks slowed down = %d\n",
+		 1000.0 * (float)record_queued_min / (float)PLAN_TIME_UNITS_PER_SEC,
+		 1000.0 * (float)(record_queued_total / (double)record_queued_count) / (float)PLAN_TIME_UNITS_PER_SEC,
+		 record_slowdown);
+
+     if (record_coalesce_moves)
+	  printf("Moves coalesced = %d of %d; merge ratio = %f moves per block\n",
+		 record_coalesce_merged, record_coalesce_moves,
+		 (float)record_coalesce_moves / (float)(record_coalesce_moves - record_coalesce_merged));
 
      memset(planner_counts, 0, sizeof(planner_counts));
+     memset(planner_pass_counts, 0, sizeof(planner_pass_counts));
+     record_sqrt = 0;
+     record_queued_min   = -1;
+     record_queued_count = 0;
+     record_queued_total = 0.0;
+     record_slowdown     = 0;
+     record_coalesce_moves  = 0;
+     record_coalesce_merged = 0;
 
      ztot1 = 0.0;
      ztot2 = 0.0;
@@ -403,6 +501,25 @@ void plan_dump_run_data(void)
 	    zavg_min2, zavg_max2, zavg2);
 }
 
+float plan_reset_run_data(void)
+{
+     float ttime = total_time;
+
+     total_time = 0.0;
+     iz = 0;
+     record_sqrt = 0;
+     record_queued_min   = -1;
+     record_queued_count = 0;
+     record_queued_total = 0.0;
+     record_slowdown     = 0;
+     record_coalesce_moves  = 0;
+     record_coalesce_merged = 0;
+     memset(planner_counts, 0, sizeof(planner_counts));
+     memset(planner_pass_counts, 0, sizeof(planner_pass_counts));
+
+     return(ttime);
+}
+
 void plan_block_notice(const char *fmt, ...)
 {
      va_list ap;
@@ -17,6 +17,8 @@ extern uint32_t simulator_debug;
 extern bool   simulator_dump_speeds;
 extern bool   simulator_use_max_feed_rate;
 extern bool   simulator_show_alt_feed_rate;
+extern bool   simulator_quiet;
+extern FILE  *simulator_velocity_file;
 extern FPTYPE simulator_max_feed_rate;
 
 extern void init_extras(bool acceleration);
@@ -27,6 +29,7 @@ extern void st_deprime_enable(bool enable);
 extern void plan_dump(int chart);
 extern void plan_dump_current_block(int discard);
 extern void plan_dump_run_data(void);
+extern float plan_reset_run_data(void);
 void plan_block_notice(const char *fmt, ...);
 
 #endif
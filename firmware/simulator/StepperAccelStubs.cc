@@ -0,0 +1,66 @@
+// StepperAccelStubs.cc
+//
+// Stand-ins for StepperAccel.cc for the planner, which plans blocks and dumps
+// them but never runs the stepper interrupt.  stepsim links the real
+// StepperAccel.cc instead.
+
+#include <stdio.h>
+
+#include "Simulator.hh"
+#include "StepperAccel.hh"
+
+static bool deprime_enabled = true;
+static bool deprimed[EXTRUDERS];
+int16_t extruder_deprime_steps[EXTRUDERS];
+bool extrude_when_negative[EXTRUDERS];
+float extruder_only_max_feedrate[EXTRUDERS];
+
+// Timer 5, read by the MOTION_STATS interrupt timing in Steppers.cc
+volatile uint16_t TCNT5;
+
+void st_init()
+{
+}
+
+bool st_interrupt()
+{
+     return false;
+}
+
+#ifdef BLOCK_PREFETCH
+void st_prefetch_next_block()
+{
+}
+#endif
+
+void quickStop()
+{
+}
+
+void st_set_position(const int32_t &x, const int32_t &y, const int32_t &z, const int32_t &a, const int32_t &b)
+{
+  CRITICAL_SECTION_START;
+  dda_position[X_AXIS] = x;
+  dda_position[Y_AXIS] = y;
+  dda_position[Z_AXIS] = z;
+  dda_position[A_AXIS] = a;
+  dda_position[B_AXIS] = b;
+  CRITICAL_SECTION_END;
+}
+
+void st_set_e_position(const int32_t &a, const int32_t &b)
+{
+  CRITICAL_SECTION_START;
+  dda_position[A_AXIS] = a;
+  dda_position[B_AXIS] = b;
+  CRITICAL_SECTION_END;
+}
+
+void st_deprime_enable(bool enable)
+{
+    deprime_enabled = enable;
+
+    for ( uint8_t i = 0; i < EXTRUDERS; i++ ) {
+	deprimed[i] = true;
+    }
+}
@@ -0,0 +1,109 @@
+// Check of queuePacketCommands() from HostBatch.hh, which Host.cc uses to queue
+// the commands of a host packet, one or a HOST_CMD_QUEUE_BATCH of them, into the
+// command buffer.  They must go in all or none, in order, without the batch's
+// command code.
+//
+//     batchtest
+//
+// The exit status is 1 if any check fails.  "make check" runs it.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "CircularBuffer.hh"
+#include "Commands.hh"
+#include "HostBatch.hh"
+
+#define QUEUE_SIZE 64
+
+static CircularBufferTempl<uint8_t, QUEUE_SIZE> queue;
+
+static uint16_t queue_remaining()
+{
+     return queue.getRemainingCapacity();
+}
+
+static void queue_push(uint8_t b)
+{
+     queue.push(b);
+}
+
+// Stands in for the InPacket from the host
+struct test_packet {
+     uint8_t length;
+     uint8_t data[255];
+
+     uint8_t getLength() const { return length; }
+     uint8_t read8(uint8_t idx) const { return data[idx]; }
+};
+
+// A packet of count bytes, numbered from first, after the command code cmd
+static void make_packet(test_packet &p, uint8_t cmd, uint8_t count, uint8_t first)
+{
+     p.length = 1 + count;
+     p.data[0] = cmd;
+     for (uint8_t i = 0; i < count; i++)
+	  p.data[1 + i] = first + i;
+}
+
+// Queue p from start with free bytes of room in a queue that already holds used
+// bytes, and check it went in whole, or not at all when expect_queued is false
+static int check(const char *what, const test_packet &p, uint8_t start,
+		 uint16_t used, bool expect_queued)
+{
+     int failed = 0;
+
+     // Start the queue part way round, so that longer packets wrap
+     queue.reset();
+     for (uint16_t i = 0; i < QUEUE_SIZE - 5; i++)
+	  queue.push(0xee);
+     queue.pop(QUEUE_SIZE - 5);
+     for (uint16_t i = 0; i < used; i++)
+	  queue.push(0xaa);
+
+     bool queued = queuePacketCommands<queue_remaining, queue_push>(p, start);
+     uint16_t expect_length = used + (expect_queued ? p.getLength() - start : 0);
+
+     if (queued != expect_queued || queue.getLength() != expect_length)
+	  failed = 1;
+     for (uint16_t i = 0; !failed && i < queue.getLength(); i++)
+     {
+	  uint8_t expect = (i < used) ? 0xaa : p.read8(start + i - used);
+	  if (queue[i] != expect)
+	       failed = 1;
+     }
+
+     printf("%s: %s, %u bytes queued%s\n", what, queued ? "queued" : "overflow",
+	    queue.getLength() - used, failed ? " *** FAILED ***" : "");
+     return failed;
+}
+
+int main(int argc, const char *argv[])
+{
+     test_packet p;
+     int failed = 0;
+
+     // A command of its own is queued with its command code
+     make_packet(p, HOST_CMD_DELAY, 4, 1);
+     failed += check("Single command", p, 0, 0, true);
+
+     // A batch's commands are queued without the batch code, more than
+     // BATCH_PUSH_CHUNK of them and across the wrap of the queue
+     make_packet(p, HOST_CMD_QUEUE_BATCH, 3 * BATCH_PUSH_CHUNK + 3, 1);
+     failed += check("Batch", p, 1, 0, true);
+
+     // Exactly filling the queue
+     make_packet(p, HOST_CMD_QUEUE_BATCH, 20, 1);
+     failed += check("Batch filling the queue", p, 1, QUEUE_SIZE - 20, true);
+
+     // One byte too many, so none of them
+     failed += check("Batch a byte too long", p, 1, QUEUE_SIZE - 19, false);
+     make_packet(p, HOST_CMD_DELAY, 4, 1);
+     failed += check("Single command a byte too long", p, 0, QUEUE_SIZE - 4, false);
+
+     // A batch of nothing queues nothing
+     make_packet(p, HOST_CMD_QUEUE_BATCH, 0, 1);
+     failed += check("Empty batch", p, 1, QUEUE_SIZE, true);
+
+     return(failed ? 1 : 0);
+}
@@ -0,0 +1,58 @@
+// Check of the endstop inversion mask stepperAxisInit() builds from the
+// ENDSTOP_INVERSION EEPROM byte, which stepperAxisReadEndstops() XORs the
+// endstop pins with.  Each axis has 2 bits, min then max, X in bits 0-1.
+//
+//     endstoptest
+//
+// The exit status is 1 if any mask is wrong.  "make check" runs it.
+
+#include <stdio.h>
+
+#include "StepperAxis.hh"
+#include "EepromMap.hh"
+#include "Eeprom.hh"
+
+static uint8_t endstop_inversion;
+
+static uint8_t eeprom_read8(const uint16_t location)
+{
+     return (location == eeprom_offsets::ENDSTOP_INVERSION) ? endstop_inversion : 0xff;
+}
+
+static int check(uint8_t eeprom_byte, uint8_t expected, const char *what)
+{
+     endstop_inversion = eeprom_byte;
+     stepperAxisInit(true);
+     printf("ENDSTOP_INVERSION 0x%02x (%s): mask 0x%02x, expected 0x%02x%s\n",
+	    eeprom_byte, what, endstops_invert, expected,
+	    (endstops_invert == expected) ? "" : " *** FAILED ***");
+     return (endstops_invert == expected) ? 0 : 1;
+}
+
+int main(int argc, const char *argv[])
+{
+     int failed = 0;
+
+     eeprom::simulator_eeprom_read8 = eeprom_read8;
+
+     // The factory default in EepromMap.cc: endstops present, all inverted
+     failed += check(0x9f, 0x3f, "factory default");
+     failed += check(0x80, 0x00, "present, none inverted");
+     failed += check(0x81, 0x03, "present, X inverted");
+     failed += check(0x84, 0x30, "present, Z inverted");
+     // Not present, so all read as inverted whatever the axis bits say
+     failed += check(0x00, 0x3f, "not present");
+
+     // stepperAxisInit(false) keeps the hard reset's settings
+     endstop_inversion = 0x82;
+     stepperAxisInit(true);
+     stepperAxisInit(false);
+     if (endstops_invert != 0x0c)
+     {
+	  printf("Soft reset changed the mask to 0x%02x from 0x0c *** FAILED ***\n",
+		 endstops_invert);
+	  failed++;
+     }
+
+     return(failed ? 1 : 0);
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <stdarg.h>
 
 #include "Simulator.hh"
@@ -10,6 +11,7 @@
 #include "EepromMap.hh"
 #include "Point.hh"
 #include "Steppers.hh"
+#include "Arc.hh"
 #include "s3g.h"
 
 static char pending_notices[10240];
@@ -59,26 +61,181 @@ static void usage(FILE *f, const char *prog)
 	  f = stderr;
 
      fprintf(f,
-"Usage: %s [? | -h] [-m] [-s] [-d mask] [-r rate] [-u] [file]\n"
+"Usage: %s [? | -h] [-m] [-s] [-d mask] [-j deviation] [-r rate] [-u] [-v vfile] [file]\n"
 "     file -- The name of the .s3g file to dump.  If not supplied then stdin is dumped\n"
 "  -d mask -- Selectively enable debugging with a bit mask \"mask\"\n"
+"  -j deviation -- Corner using a junction deviation of \"deviation\" mm and also report\n"
+"             the print time when cornering with the max speed changes\n"
 "       -m -- Display actual s3g move commands and\n"
 "  -r rate -- Flag feed rates which exceed \"rate\"\n"
 "       -s -- Display block initial, peak and final speeds (mm/s) along with rates\n"
 "       -u -- Display significant differences between interval based and us based feed rates\n"
+"  -v vfile -- Write the step rate of the dominant axis over time to \"vfile\" as\n"
+"             \"seconds steps/s\" lines, suitable for plotting\n"
 "    ?, -h -- This help message\n",
 	     prog ? prog : "s3gdump");
 }
 
 
-int main(int argc, const char *argv[])
+// Run the planner over the .s3g file "fname", or stdin when fname is NULL
+
+static int simulate(const char *fname, int show_moves)
 {
-     char c;
      s3g_command_t cmd;
      s3g_context_t *ctx;
      myctx_t myctx;
+
+     if (fname == NULL)
+	  // Open stdin
+	  ctx = s3g_open(0, NULL);
+     else
+	  // Open the specified file
+	  ctx = s3g_open(0, (void *)fname);
+
+     if (!ctx)
+	  // Assume that s3g_open() has complained
+	  return(1);
+
+     // Add a writer to use when converting an .s3g packet to 
+     // human readable text
+     s3g_add_writer(ctx, &display, &myctx);
+
+     // Now loop over the input .s3g stream | file
+
+     while (!s3g_command_read(ctx, &cmd))
+     {
+	  // Convert the command to human readable text
+	  myctx.buf[0] = '\0';
+	  s3g_command_display(ctx, &cmd);
+
+	  // As Command.cc does, plan any held back move before a command it can't be merged with
+	  if (cmd.cmd_id != HOST_CMD_QUEUE_POINT_NEW_EXT && cmd.cmd_id != HOST_CMD_QUEUE_POINT_DELTA &&
+	      steppers::segmentPending())
+	  {
+	       steppers::flushSegment();
+	       handle_pending_notices();
+	  }
+
+	  if (cmd.cmd_id == HOST_CMD_QUEUE_POINT_NEW)
+	  {
+	       Point target = Point(cmd.t.queue_point_new.x, cmd.t.queue_point_new.y,
+				    cmd.t.queue_point_new.z, cmd.t.queue_point_new.a, 
+				    cmd.t.queue_point_new.b);
+	       steppers::setTargetNew(target, cmd.t.queue_point_new.us, cmd.t.queue_point_new.rel);
+	       if (show_moves && myctx.buf[0]) pending_notice("%s\n", myctx.buf);
+	       handle_pending_notices();
+	       if (movesplanned() >= (BLOCK_BUFFER_SIZE >> 1)) plan_dump_current_block(1);
+	  }
+	  else if (cmd.cmd_id == HOST_CMD_QUEUE_POINT_NEW_EXT ||
+		   cmd.cmd_id == HOST_CMD_QUEUE_POINT_DELTA)
+	  {
+	       const s3g_queue_point_new_ext *move = (cmd.cmd_id == HOST_CMD_QUEUE_POINT_DELTA) ?
+		    &cmd.t.queue_point_delta.move : &cmd.t.queue_point_new_ext;
+	       Point target = Point(move->x, move->y, move->z, move->a, move->b);
+	       uint8_t planned = movesplanned();
+	       steppers::setTargetNewExt(target, move->dda_rate, move->rel, move->distance,
+					 move->feedrate_mult_64);
+	       // Notices for moves held back for coalescing go with the block they're merged into
+	       if (movesplanned() != planned) handle_pending_notices();
+	       if (show_moves && myctx.buf[0]) pending_notice("%s\n", myctx.buf);
+	       if (!steppers::segmentPending()) handle_pending_notices();
+	       if (movesplanned() >= (BLOCK_BUFFER_SIZE >> 1)) plan_dump_current_block(1);
+    }
+	  else if (cmd.cmd_id == HOST_CMD_QUEUE_ARC)
+	  {
+	       Point target = Point(cmd.t.queue_arc.x, cmd.t.queue_arc.y,
+				    cmd.t.queue_arc.z, cmd.t.queue_arc.a,
+				    cmd.t.queue_arc.b);
+	       arc::begin(target, cmd.t.queue_arc.i, cmd.t.queue_arc.j,
+			  cmd.t.queue_arc.rel, cmd.t.queue_arc.feedrate_mult_64,
+			  cmd.t.queue_arc.flags);
+	       if (show_moves && myctx.buf[0]) pending_notice("%s\n", myctx.buf);
+	       handle_pending_notices();
+	       // Expand the arc the way Command.cc does, a segment at a time as the planner has room
+	       while (arc::isActive())
+	       {
+		    arc::queueNextSegment();
+		    if (movesplanned() >= (BLOCK_BUFFER_SIZE >> 1)) plan_dump_current_block(1);
+	       }
+	  }
+	  else if (cmd.cmd_id == HOST_CMD_QUEUE_POINT_EXT)
+	  {
+	       Point target = Point(cmd.t.queue_point_ext.x, cmd.t.queue_point_ext.y,
+				    cmd.t.queue_point_ext.z, cmd.t.queue_point_ext.a,
+				    cmd.t.queue_point_ext.b);
+	       steppers::setTarget(target, cmd.t.queue_point_ext.dda);
+	       if (show_moves && myctx.buf[0]) pending_notice("%s\n", myctx.buf);
+	       handle_pending_notices();
+	       if (movesplanned() >= (BLOCK_BUFFER_SIZE >> 1)) plan_dump_current_block(1);
+	  }
+	  else if (cmd.cmd_id == HOST_CMD_SET_POSITION_EXT)
+	  {
+	       Point target = Point(cmd.t.set_position_ext.x, cmd.t.set_position_ext.y,
+				    cmd.t.set_position_ext.z, cmd.t.set_position_ext.a,
+				    cmd.t.set_position_ext.b);
+	       while (plan_position_resync_busy()) plan_dump_current_block(1);
+	       steppers::definePosition(target);
+	       if (myctx.buf[0]) pending_notice("%s\n", myctx.buf);
+	       handle_pending_notices();
+	  }
+	  else if (cmd.cmd_id == HOST_CMD_SET_ACCELERATION_TOGGLE)
+	  {
+	       steppers::setSegmentAccelState((cmd.t.set_segment_acceleration.s != 0) ? true : false);		  
+	       if (myctx.buf[0]) pending_notice("%s\n", myctx.buf);
+	  }
+	  else
+	  {
+	       // Dump queued blocks?
+	       if (cmd.cmd_id != HOST_CMD_TOOL_COMMAND &&
+		   cmd.cmd_id != HOST_CMD_ENABLE_AXES &&
+		   cmd.cmd_id != HOST_CMD_SET_BUILD_PERCENT &&
+		   cmd.cmd_id != HOST_CMD_CHANGE_TOOL &&
+		   cmd.cmd_id != HOST_CMD_SET_POSITION_EXT)
+	       {
+		    bool warn = (movesplanned() != 0) && !simulator_quiet;
+		    if (warn) printf("*** >>> Draining planning buffer <<< ***\n");
+		    while (movesplanned() != 0)
+			 plan_dump_current_block(1);
+		    if (warn) printf("*** >>> Planning buffer drained <<< ***\n");
+	       }
+
+	       if (myctx.buf[0] != '\0')
+	       {
+		    if (cmd.cmd_id == HOST_CMD_CHANGE_TOOL ||
+			cmd.cmd_id == HOST_CMD_ENABLE_AXES ||
+			cmd.cmd_id == HOST_CMD_SET_BUILD_PERCENT ||
+			cmd.cmd_id == HOST_CMD_SET_POSITION_EXT ||
+			cmd.cmd_id == HOST_CMD_TOOL_COMMAND)
+			 pending_notice("%s\n", myctx.buf);
+		    else if (!simulator_quiet)
+		    {
+			 puts(myctx.buf);
+		    }
+	       }
+	  }
+     }
+
+     // Dump any remaining blocks
+     steppers::flushSegment();
+     handle_pending_notices();
+     while (movesplanned() != 0)
+	  plan_dump_current_block(1);
+
+     s3g_close(ctx);
+
+     return(0);
+}
+
+int main(int argc, const char *argv[])
+{
+     char c;
      int show_moves = 0;
+     float jd = 0.0, yaj_time = 0.0;
+     const char *vfile = NULL;
+     const char *prog = argv[0];
 
+     // As the firmware's boot: init() loads the axis settings, reset() the planner
+     steppers::init();
      steppers::reset();
 
      // Enable acceleration: it's off by default
@@ -90,7 +247,7 @@ int main(int argc, const char *argv[])
      simulator_dump_speeds = false;
      simulator_show_alt_feed_rate = false;
 
-     while ((c = getopt(argc, (char **)argv, ":a:c:hd:mr:su?")) != -1)
+     while ((c = getopt(argc, (char **)argv, ":a:c:hd:j:mr:suv:?")) != -1)
      {
 	  switch(c)
 	  {
@@ -208,6 +365,21 @@ int main(int argc, const char *argv[])
 	  }
 	  break;
 
+	  // Junction deviation
+	  case 'j' :
+	  {
+	       char *ptr = NULL;
+
+	       jd = strtof(optarg, &ptr);
+	       if (ptr == NULL || ptr == optarg || jd < 0.0)
+	       {
+		    fprintf(stderr, "%s: unable to parse the junction deviation, \"%s\", as a floating point number\n",
+			    argv[0], optarg);
+		    return(1);
+	       }
+	  }
+	  break;
+
           // Display speeds as well as rates
 	  case 's' :
 	       simulator_dump_speeds = true;
@@ -217,120 +389,59 @@ int main(int argc, const char *argv[])
 	  case 'u' :
 	       simulator_show_alt_feed_rate = true;
 	       break;
+
+          // Velocity curve file
+	  case 'v' :
+	       vfile = optarg;
+	       break;
 	  }
      }
 
      argc -= optind;
      argv += optind;
-     if (argc == 0)
-	  // Open stdin
-	  ctx = s3g_open(0, NULL);
-     else
-	  // Open the specified file
-	  ctx = s3g_open(0, (void *)argv[0]);
-
-     if (!ctx)
-	  // Assume that s3g_open() has complained
-	  return(1);
-
-     // Add a writer to use when converting an .s3g packet to 
-     // human readable text
-     s3g_add_writer(ctx, &display, &myctx);
-
-     // Now loop over the input .s3g stream | file
 
-     while (!s3g_command_read(ctx, &cmd))
+     if (jd != 0.0)
      {
-	  // Convert the command to human readable text
-	  myctx.buf[0] = '\0';
-	  s3g_command_display(ctx, &cmd);
-
-	  if (cmd.cmd_id == HOST_CMD_QUEUE_POINT_NEW)
-	  {
-	       Point target = Point(cmd.t.queue_point_new.x, cmd.t.queue_point_new.y,
-				    cmd.t.queue_point_new.z, cmd.t.queue_point_new.a, 
-				    cmd.t.queue_point_new.b);
-	       steppers::setTargetNew(target, cmd.t.queue_point_new.us, cmd.t.queue_point_new.rel);
-	       if (show_moves && myctx.buf[0]) pending_notice("%s\n", myctx.buf);
-	       handle_pending_notices();
-	       if (movesplanned() >= (BLOCK_BUFFER_SIZE >> 1)) plan_dump_current_block(1);
-	  }
-	  else if (cmd.cmd_id == HOST_CMD_QUEUE_POINT_NEW_EXT)
-	  {
-	       Point target = Point(cmd.t.queue_point_new_ext.x, cmd.t.queue_point_new_ext.y,
-				    cmd.t.queue_point_new_ext.z, cmd.t.queue_point_new_ext.a,
-				    cmd.t.queue_point_new_ext.b);
-	       steppers::setTargetNewExt(target, cmd.t.queue_point_new_ext.dda_rate,
-					 cmd.t.queue_point_new_ext.rel,
-					 cmd.t.queue_point_new_ext.distance,
-					 cmd.t.queue_point_new_ext.feedrate_mult_64);
-	       if (show_moves && myctx.buf[0]) pending_notice("%s\n", myctx.buf);
-	       handle_pending_notices();
-	       if (movesplanned() >= (BLOCK_BUFFER_SIZE >> 1)) plan_dump_current_block(1);
-    }
-	  else if (cmd.cmd_id == HOST_CMD_QUEUE_POINT_EXT)
-	  {
-	       Point target = Point(cmd.t.queue_point_ext.x, cmd.t.queue_point_ext.y,
-				    cmd.t.queue_point_ext.z, cmd.t.queue_point_ext.a,
-				    cmd.t.queue_point_ext.b);
-	       steppers::setTarget(target, cmd.t.queue_point_ext.dda);
-	       if (show_moves && myctx.buf[0]) pending_notice("%s\n", myctx.buf);
-	       handle_pending_notices();
-	       if (movesplanned() >= (BLOCK_BUFFER_SIZE >> 1)) plan_dump_current_block(1);
-	  }
-	  else if (cmd.cmd_id == HOST_CMD_SET_POSITION_EXT)
-	  {
-	       Point target = Point(cmd.t.set_position_ext.x, cmd.t.set_position_ext.y,
-				    cmd.t.set_position_ext.z, cmd.t.set_position_ext.a,
-				    cmd.t.set_position_ext.b);
-	       steppers::definePosition(target);
-	       if (myctx.buf[0]) pending_notice("%s\n", myctx.buf);
-	       handle_pending_notices();
-	  }
-	  else if (cmd.cmd_id == HOST_CMD_SET_ACCELERATION_TOGGLE)
+	  // Also run the file with max speed change cornering, quietly,
+	  // so as to report the print time for both modes
+	  if (argc == 0)
 	  {
-	       steppers::setSegmentAccelState((cmd.t.set_segment_acceleration.s != 0) ? true : false);		  
-	       if (myctx.buf[0]) pending_notice("%s\n", myctx.buf);
+	       fprintf(stderr, "%s: -j requires a file name rather than stdin\n", prog);
+	       return(1);
 	  }
-	  else
-	  {
-	       // Dump queued blocks?
-	       if (cmd.cmd_id != HOST_CMD_TOOL_COMMAND &&
-		   cmd.cmd_id != HOST_CMD_ENABLE_AXES &&
-		   cmd.cmd_id != HOST_CMD_SET_BUILD_PERCENT &&
-		   cmd.cmd_id != HOST_CMD_CHANGE_TOOL &&
-		   cmd.cmd_id != HOST_CMD_SET_POSITION_EXT)
-	       {
-		    bool warn = movesplanned() != 0;
-		    if (warn) printf("*** >>> Draining planning buffer <<< ***\n");
-		    while (movesplanned() != 0)
-			 plan_dump_current_block(1);
-		    if (warn) printf("*** >>> Planning buffer drained <<< ***\n");
-	       }
+	  simulator_quiet = true;
+	  junction_deviation = 0;
+	  if (simulate(argv[0], show_moves))
+	       return(1);
+	  yaj_time = plan_reset_run_data();
+	  simulator_quiet = false;
+	  junction_deviation = FTOFP(jd);
+     }
 
-	       if (myctx.buf[0] != '\0')
-	       {
-		    if (cmd.cmd_id == HOST_CMD_CHANGE_TOOL ||
-			cmd.cmd_id == HOST_CMD_ENABLE_AXES ||
-			cmd.cmd_id == HOST_CMD_SET_BUILD_PERCENT ||
-			cmd.cmd_id == HOST_CMD_SET_POSITION_EXT ||
-			cmd.cmd_id == HOST_CMD_TOOL_COMMAND)
-			 pending_notice("%s\n", myctx.buf);
-		    else
-		    {
-			 puts(myctx.buf);
-		    }
-	       }
+     if (vfile)
+     {
+	  simulator_velocity_file = fopen(vfile, "w");
+	  if (!simulator_velocity_file)
+	  {
+	       fprintf(stderr, "%s: unable to open the velocity file \"%s\"; %s (%d)\n",
+		       prog, vfile, strerror(errno), errno);
+	       return(1);
 	  }
      }
 
-     // Dump any remaining blocks
-     while (movesplanned() != 0)
-	  plan_dump_current_block(1);
+     if (simulate((argc == 0) ? NULL : argv[0], show_moves))
+	  return(1);
 
-     s3g_close(ctx);
+     if (simulator_velocity_file)
+	  fclose(simulator_velocity_file);
 
      plan_dump_run_data();
 
+     if (jd != 0.0)
+     {
+	  printf("Total print time with max speed change cornering = %f seconds\n", yaj_time);
+	  printf("Total print time with %f mm junction deviation = %f seconds\n", jd, plan_reset_run_data());
+     }
+
      return(0);
 }
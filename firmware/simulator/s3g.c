@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <math.h>
 
 #include "Simulator.hh"
 #include "Commands.hh"
@@ -58,6 +59,7 @@ static const s3g_command_info_t command_table_raw[] = {
      /*  23 */  {HOST_CMD_BOARD_STATUS, 0, "get board status"},
      /*  24 */  {HOST_CMD_GET_BUILD_STATS, 0, "get build statistics"},
      /*  27 */  {HOST_CMD_ADVANCED_VERSION, 0, "advanced version"},
+     /*  28 */  {HOST_CMD_GET_MOTION_STATS, 1, "get motion statistics"},
      /* 112 */  {HOST_CMD_DEBUG_ECHO, 0, "debug echo"},
      /* 131 */  {HOST_CMD_FIND_AXES_MINIMUM, 7, "find axes minimum"},
      /* 132 */  {HOST_CMD_FIND_AXES_MAXIMUM, 7, "find axes maximum"},
@@ -84,9 +86,280 @@ static const s3g_command_info_t command_table_raw[] = {
      /* 153 */  {HOST_CMD_BUILD_START_NOTIFICATION, 4, "build start notification"},
      /* 154 */  {HOST_CMD_BUILD_END_NOTIFICATION, 1, "build end notification"},
      /* 155 */  {HOST_CMD_QUEUE_POINT_NEW_EXT, 31, "queue point new extended"},
-     /* 156 */  {HOST_CMD_SET_ACCELERATION_TOGGLE, 1, "set segment acceleration"}
+     /* 156 */  {HOST_CMD_SET_ACCELERATION_TOGGLE, 1, "set segment acceleration"},
+     /* 158 */  {HOST_CMD_QUEUE_ARC, 32, "queue arc"},
+     /* 159 */  {HOST_CMD_QUEUE_POINT_DELTA, -1, "queue point delta"},
+     // The batched commands follow, and are read as commands of their own
+     /* 160 */  {HOST_CMD_QUEUE_BATCH, 0, "queue batch"}
 };
 
+// Steps per mm the distance and DDA rate left out of a HOST_CMD_QUEUE_POINT_DELTA
+// are derived with.  These are the Replicator defaults from EepromMap.hh, as
+// the firmware converts them.  A file sent to a machine with other values must
+// be encoded with a tolerance of 0, which always sends them.
+static const uint32_t delta_steps_per_mm[5] = {
+     94139704, 94139704, 400000000, 96275202, 96275202
+};
+
+// Derive the distance and DDA rate of a move of steps[] as the firmware does
+// for a HOST_CMD_QUEUE_POINT_DELTA without them: the XYZ distance or, failing
+// that, the longest extruder move
+static void delta_derive(const int32_t steps[5], uint16_t feedrate_mult_64,
+			 float *distance, int32_t *dda_rate)
+{
+     float mm[5], d;
+     uint32_t master_steps = 0;
+     int i;
+
+     for (i = 0; i < 5; i++)
+     {
+	  int32_t s = steps[i];
+	  mm[i] = (float)s / ((float)delta_steps_per_mm[i] / 1000000.0);
+	  if (s < 0)
+	       s = -s;
+	  if ((uint32_t)s > master_steps)
+	       master_steps = (uint32_t)s;
+     }
+
+     d = sqrt(mm[0] * mm[0] + mm[1] * mm[1] + mm[2] * mm[2]);
+     if (d == 0.0)
+	  d = (fabs(mm[3]) > fabs(mm[4])) ? fabs(mm[3]) : fabs(mm[4]);
+     *distance = d;
+     *dda_rate = (d == 0.0) ? 0 :
+	  (int32_t)((float)master_steps * (float)(int16_t)feedrate_mult_64 /
+		    (64.0 * d) + 0.5);
+}
+
+static size_t put_varint(unsigned char *buf, uint32_t v)
+{
+     size_t n = 0;
+
+     while (v >= 0x80)
+     {
+	  buf[n++] = (unsigned char)(v | 0x80);
+	  v >>= 7;
+     }
+     buf[n++] = (unsigned char)v;
+     return(n);
+}
+
+static uint32_t get_varint(const unsigned char **p, const unsigned char *end,
+			   int *truncated)
+{
+     uint32_t v = 0;
+     int shift = 0;
+     unsigned char c;
+
+     do {
+	  if (*p >= end)
+	  {
+	       *truncated = 1;
+	       break;
+	  }
+	  c = *(*p)++;
+	  v |= (uint32_t)(c & 0x7f) << shift;
+	  shift += 7;
+     } while ((c & 0x80) && shift < 35);
+     return(v);
+}
+
+static void delta_set_target(s3g_delta_state_t *state, int32_t x, int32_t y,
+			     int32_t z, int32_t a, int32_t b, uint8_t rel)
+{
+     const int32_t t[5] = {x, y, z, a, b};
+     int i;
+
+     for (i = 0; i < 5; i++)
+	  if (!(rel & (1 << i)))
+	       state->target[i] = t[i];
+}
+
+void s3g_delta_update(s3g_delta_state_t *state,
+		      const s3g_queue_point_new_ext *move)
+{
+     delta_set_target(state, move->x, move->y, move->z, move->a, move->b,
+		      move->rel);
+     state->rel              = move->rel;
+     state->feedrate_mult_64 = move->feedrate_mult_64;
+}
+
+void s3g_delta_command(s3g_delta_state_t *state, const s3g_command_t *cmd)
+{
+     switch (cmd->cmd_id)
+     {
+     case HOST_CMD_QUEUE_POINT_NEW_EXT :
+	  s3g_delta_update(state, &cmd->t.queue_point_new_ext);
+	  break;
+
+     case HOST_CMD_QUEUE_POINT_DELTA :
+	  s3g_delta_update(state, &cmd->t.queue_point_delta.move);
+	  break;
+
+     // The firmware takes the absolute axes of these as the target too, but
+     // leaves the relative axes and feed rate those of the last move above
+     case HOST_CMD_QUEUE_POINT_EXT :
+	  delta_set_target(state, cmd->t.queue_point_ext.x,
+			   cmd->t.queue_point_ext.y, cmd->t.queue_point_ext.z,
+			   cmd->t.queue_point_ext.a, cmd->t.queue_point_ext.b, 0);
+	  break;
+
+     case HOST_CMD_QUEUE_POINT_NEW :
+	  delta_set_target(state, cmd->t.queue_point_new.x,
+			   cmd->t.queue_point_new.y, cmd->t.queue_point_new.z,
+			   cmd->t.queue_point_new.a, cmd->t.queue_point_new.b,
+			   cmd->t.queue_point_new.rel);
+	  break;
+
+     case HOST_CMD_QUEUE_ARC :
+	  delta_set_target(state, cmd->t.queue_arc.x, cmd->t.queue_arc.y,
+			   cmd->t.queue_arc.z, cmd->t.queue_arc.a,
+			   cmd->t.queue_arc.b, cmd->t.queue_arc.rel);
+	  break;
+
+     case HOST_CMD_SET_POSITION_EXT :
+	  delta_set_target(state, cmd->t.set_position_ext.x,
+			   cmd->t.set_position_ext.y, cmd->t.set_position_ext.z,
+			   cmd->t.set_position_ext.a, cmd->t.set_position_ext.b, 0);
+	  break;
+
+     default :
+	  break;
+     }
+}
+
+size_t s3g_queue_point_delta_encode(s3g_delta_state_t *state,
+				    const s3g_queue_point_new_ext *move,
+				    float tolerance, unsigned char *buf,
+				    size_t maxbuf)
+{
+     const int32_t t[5] = {move->x, move->y, move->z, move->a, move->b};
+     int32_t steps[5];
+     unsigned char tmp[64];
+     size_t n = 3;
+     uint8_t flags = 0;
+     float distance;
+     int32_t dda_rate;
+     int i;
+
+     for (i = 0; i < 5; i++)
+     {
+	  int32_t d = (move->rel & (1 << i)) ? t[i] : t[i] - state->target[i];
+	  steps[i] = d;
+	  if (d != 0)
+	  {
+	       flags |= 1 << i;
+	       n += put_varint(tmp + n, ((uint32_t)d << 1) ^ (uint32_t)(d >> 31));
+	  }
+     }
+
+     if (move->rel != state->rel)
+     {
+	  flags |= DELTA_FLAG_RELATIVE;
+	  tmp[n++] = move->rel;
+     }
+
+     if (move->feedrate_mult_64 != state->feedrate_mult_64)
+     {
+	  flags |= DELTA_FLAG_FEEDRATE;
+	  memcpy(tmp + n, &move->feedrate_mult_64, 2);
+	  n += 2;
+     }
+
+     delta_derive(steps, move->feedrate_mult_64, &distance, &dda_rate);
+     if (tolerance <= 0.0 ||
+	 fabs(distance - move->distance) > tolerance * fabs(move->distance) ||
+	 fabs((float)(dda_rate - move->dda_rate)) > tolerance * fabs((float)move->dda_rate))
+     {
+	  flags |= DELTA_FLAG_DISTANCE;
+	  memcpy(tmp + n, &move->distance, 4);
+	  n += 4;
+	  n += put_varint(tmp + n, (uint32_t)move->dda_rate);
+     }
+
+     if (n > maxbuf)
+	  return(0);
+
+     tmp[0] = HOST_CMD_QUEUE_POINT_DELTA;
+     tmp[1] = (unsigned char)(n - 2);
+     tmp[2] = flags;
+     memcpy(buf, tmp, n);
+
+     s3g_delta_update(state, move);
+
+     return(n);
+}
+
+// Reconstruct the move of a HOST_CMD_QUEUE_POINT_DELTA whose len bytes,
+// after the length, are in p.  Returns -1 if its fields need more than len
+// bytes; the firmware drops such a move.
+static int delta_decode(s3g_context_t *ctx, s3g_queue_point_delta *cmd,
+			const unsigned char *p, size_t len)
+{
+     const unsigned char *end = p + len;
+     int32_t t[5];
+     int i, truncated = 0;
+
+     if (p >= end)
+	  return(-1);
+     cmd->flags = *p++;
+
+     for (i = 0; i < 5; i++)
+     {
+	  cmd->delta[i] = 0;
+	  if (cmd->flags & (1 << i))
+	  {
+	       uint32_t z = get_varint(&p, end, &truncated);
+	       cmd->delta[i] = (int32_t)(z >> 1) ^ -(int32_t)(z & 1);
+	  }
+     }
+
+     cmd->move.rel = ctx->delta.rel;
+     if (cmd->flags & DELTA_FLAG_RELATIVE)
+     {
+	  if (p >= end)
+	       return(-1);
+	  cmd->move.rel = *p++;
+     }
+
+     cmd->move.feedrate_mult_64 = ctx->delta.feedrate_mult_64;
+     if (cmd->flags & DELTA_FLAG_FEEDRATE)
+     {
+	  if (p + 2 > end)
+	       return(-1);
+	  memcpy(&cmd->move.feedrate_mult_64, p, 2);
+	  p += 2;
+     }
+
+     for (i = 0; i < 5; i++)
+	  t[i] = (cmd->move.rel & (1 << i)) ?
+	       cmd->delta[i] : ctx->delta.target[i] + cmd->delta[i];
+     cmd->move.x = t[0];
+     cmd->move.y = t[1];
+     cmd->move.z = t[2];
+     cmd->move.a = t[3];
+     cmd->move.b = t[4];
+
+     if (cmd->flags & DELTA_FLAG_DISTANCE)
+     {
+	  if (p + 4 > end)
+	       return(-1);
+	  memcpy(&cmd->move.distance, p, 4);
+	  p += 4;
+	  cmd->move.dda_rate = (int32_t)get_varint(&p, end, &truncated);
+     }
+     else
+     {
+	  int32_t steps[5];
+	  for (i = 0; i < 5; i++)
+	       steps[i] = (cmd->move.rel & (1 << i)) ?
+		    cmd->delta[i] : t[i] - ctx->delta.target[i];
+	  delta_derive(steps, cmd->move.feedrate_mult_64,
+		       &cmd->move.distance, &cmd->move.dda_rate);
+     }
+
+     return(truncated ? -1 : 0);
+}
+
 static s3g_command_info_t command_table[256];
 
 // Not thread safe
@@ -452,6 +725,36 @@ int s3g_command_read_ext(s3g_context_t *ctx, s3g_command_t *cmd,
 	  GET_INT16(queue_point_new_ext.feedrate_mult_64);
 	  break;
 
+     case HOST_CMD_QUEUE_POINT_DELTA :
+	  // len, then len bytes of flags, varint deltas and optional fields
+	  GET_UINT8(queue_point_delta.len);
+	  bytes_expected = (ssize_t)cmd->t.queue_point_delta.len;
+	  if (maxbuf < (size_t)bytes_expected) goto trunc;
+	  if ((bytes_read = (*ctx->read)(ctx->r_ctx, buf, maxbuf,
+					 (size_t)bytes_expected)) != bytes_expected)
+	       goto io_error;
+	  cmd->cmd_len = 1 + (size_t)bytes_read;
+	  buf    += bytes_read;
+	  maxbuf -= bytes_read;
+	  if (delta_decode(ctx, &cmd->t.queue_point_delta, buf - bytes_read,
+			   (size_t)bytes_read))
+	       goto short_delta;
+	  break;
+
+     case HOST_CMD_QUEUE_ARC :
+	  // x4, y4, z4, a4, b4, i4, j4, relative, feedrate_mult64 2, flags = 32 bytes
+	  GET_INT32(queue_arc.x);
+	  GET_INT32(queue_arc.y);
+	  GET_INT32(queue_arc.z);
+	  GET_INT32(queue_arc.a);
+	  GET_INT32(queue_arc.b);
+	  GET_INT32(queue_arc.i);
+	  GET_INT32(queue_arc.j);
+	  GET_UINT8(queue_arc.rel);
+	  GET_INT16(queue_arc.feedrate_mult_64);
+	  GET_UINT8(queue_arc.flags);
+	  break;
+
      case HOST_CMD_SET_POT_VALUE :
 	  GET_UINT8(digi_pot.axis);
 	  GET_UINT8(digi_pot.value);
@@ -486,12 +789,15 @@ int s3g_command_read_ext(s3g_context_t *ctx, s3g_command_t *cmd,
 	  if (maxbuf < 1) goto trunc;
 	  for (;;)
 	  {
+		  if (maxbuf < 1) goto trunc;
 		  if (1 != (bytes_read = (*ctx->read)(ctx->r_ctx, buf, maxbuf, 1)))
 			  goto io_error;
-		  if (buf[0] == '\0')
+		  buf    += bytes_read;
+		  maxbuf -= bytes_read;
+		  if (buf[-1] == '\0')
 			  break;
 		  if (cmd->t.display_message.message_len < (sizeof(cmd->t.display_message.message) - 1))
-			  cmd->t.display_message.message[cmd->t.display_message.message_len++] = buf[0];
+			  cmd->t.display_message.message[cmd->t.display_message.message_len++] = buf[-1];
 	  }
 	  cmd->t.display_message.message[cmd->t.display_message.message_len] = '\0';
 	  break;
@@ -515,12 +821,15 @@ int s3g_command_read_ext(s3g_context_t *ctx, s3g_command_t *cmd,
 	  if (maxbuf < 1) goto trunc;
 	  for (;;)
 	  {
+		  if (maxbuf < 1) goto trunc;
 		  if (1 != (bytes_read = (*ctx->read)(ctx->r_ctx, buf, maxbuf, 1)))
 			  goto io_error;
-		  if (buf[0] == '\0')
+		  buf    += bytes_read;
+		  maxbuf -= bytes_read;
+		  if (buf[-1] == '\0')
 			  break;
 		  if (cmd->t.build_start.message_len < (sizeof(cmd->t.build_start.message) - 1))
-			  cmd->t.build_start.message[cmd->t.build_start.message_len++] = buf[0];
+			  cmd->t.build_start.message[cmd->t.build_start.message_len++] = buf[-1];
 	  }
 	  cmd->t.build_start.message[cmd->t.build_start.message_len] = '\0';
 	  break;
@@ -546,9 +855,20 @@ int s3g_command_read_ext(s3g_context_t *ctx, s3g_command_t *cmd,
 #undef GET_UINT8
 #undef GET_INT32
 
+     // Track what the HOST_CMD_QUEUE_POINT_DELTA after this is decoded against
+     s3g_delta_command(&ctx->delta, cmd);
+
      iret = 0;
      goto done;
 
+short_delta:
+     fprintf(stderr,
+	     "s3g_command_get(%d): HOST_CMD_QUEUE_POINT_DELTA of %u bytes is "
+	     "too short for its fields\n",
+	     __LINE__, (unsigned)cmd->t.queue_point_delta.len);
+     iret = -1;
+     goto done;
+
 io_error:
      fprintf(stderr,
 	     "s3g_command_get(%d): Error while reading from the s3g file; "
@@ -787,6 +1107,36 @@ void s3g_command_display(s3g_context_t *ctx, s3g_command_t *cmd)
 		 F(queue_point_new_ext.feedrate_mult_64));
 	  break;
 
+     case HOST_CMD_QUEUE_POINT_DELTA :
+	  writef(ctx, "Move to (%d, %d, %d, %d, %d), DDA rate %d, %s relative, "
+		 "distance %f mm, feedrate*64 %d steps/s, %u byte delta",
+		 F(queue_point_delta.move.x),
+		 F(queue_point_delta.move.y),
+		 F(queue_point_delta.move.z),
+		 F(queue_point_delta.move.a),
+		 F(queue_point_delta.move.b),
+		 F(queue_point_delta.move.dda_rate),
+		 axes_mask(F(queue_point_delta.move.rel), buf, sizeof(buf), 0),
+		 F(queue_point_delta.move.distance),
+		 F(queue_point_delta.move.feedrate_mult_64),
+		 2 + F(queue_point_delta.len));
+	  break;
+
+     case HOST_CMD_QUEUE_ARC :
+	  writef(ctx, "%s arc to (%d, %d, %d, %d, %d), center offset (%d, %d), "
+		 "%s relative, feedrate*64 %d",
+		 (F(queue_arc.flags) & 0x01) ? "CCW" : "CW",
+		 F(queue_arc.x),
+		 F(queue_arc.y),
+		 F(queue_arc.z),
+		 F(queue_arc.a),
+		 F(queue_arc.b),
+		 F(queue_arc.i),
+		 F(queue_arc.j),
+		 axes_mask(F(queue_arc.rel), buf, sizeof(buf), 0),
+		 F(queue_arc.feedrate_mult_64));
+	  break;
+
      case HOST_CMD_SET_POT_VALUE :
 	  writef(ctx, "Set %s axis potentiometer to %hhu",
 		 axes_names(F(digi_pot.axis), buf, sizeof(buf)),
@@ -53,6 +53,40 @@ typedef struct {
      uint16_t feedrate_mult_64;
 } s3g_queue_point_new_ext;
 
+// A HOST_CMD_QUEUE_POINT_DELTA is returned with the move it stands for
+// reconstructed in move, so it may be treated as a s3g_queue_point_new_ext.
+// flags and delta[] are as sent; see Commands.hh for the encoding.
+typedef struct {
+     s3g_queue_point_new_ext move;
+     uint8_t  len;
+     uint8_t  flags;
+     int32_t  delta[5];
+} s3g_queue_point_delta;
+
+// What a HOST_CMD_QUEUE_POINT_DELTA is sent against: the absolute target of
+// each axis, the relative axes and the feed rate of the last move command
+#ifndef S3G_DELTA_STATE_T_
+#define S3G_DELTA_STATE_T_
+typedef struct {
+     int32_t  target[5];
+     uint8_t  rel;
+     uint16_t feedrate_mult_64;
+} s3g_delta_state_t;
+#endif
+
+typedef struct {
+     int32_t  x;
+     int32_t  y;
+     int32_t  z;
+     int32_t  a;
+     int32_t  b;
+     int32_t  i;
+     int32_t  j;
+     uint8_t  rel;
+     uint16_t feedrate_mult_64;
+     uint8_t  flags;
+} s3g_queue_arc;
+
 typedef struct {
      int32_t x;
      int32_t y;
@@ -282,6 +316,8 @@ typedef struct {
 	  s3g_queue_point_ext          queue_point_ext;
 	  s3g_queue_point_new          queue_point_new;
 	  s3g_queue_point_new_ext      queue_point_new_ext;
+	  s3g_queue_point_delta        queue_point_delta;
+	  s3g_queue_arc                queue_arc;
 	  s3g_change_tool              change_tool;
 	  s3g_enable_axes              enable_axes;
 	  s3g_set_position             set_position;
@@ -392,6 +428,49 @@ typedef ssize_t s3g_write_proc_t(void *ctx, unsigned char *buf, size_t nbytes);
 int s3g_add_writer(s3g_context_t *ctx, s3g_write_proc_t *wproc, void *wctx);
 void s3g_command_display(s3g_context_t *ctx, s3g_command_t *cmd);
 
+
+// Encode a move as a HOST_CMD_QUEUE_POINT_DELTA against, and then updating,
+// the state, which starts zeroed as the firmware's does.  Every command
+// passed to the firmware ahead of it that sets a target or the position
+// (HOST_CMD_QUEUE_POINT_NEW_EXT included) must have gone through here or
+// s3g_delta_command().  Homing and HOST_CMD_RECALL_HOME_POSITION leave the
+// state alone, as the firmware does.
+//
+// Call arguments:
+//
+//   s3g_delta_state_t *state
+//     Encoder state
+//
+//   const s3g_queue_point_new_ext *move
+//     The move to encode
+//
+//   float tolerance
+//     Leave out the distance and DDA rate when those the firmware derives
+//     from the steps differ from the move's by no more than this fraction.
+//     0 always sends them, and so the exact move.
+//
+//   unsigned char *buf, size_t maxbuf
+//     Where to store the command, command code included
+//
+//  Return values:
+//
+//    > 0 -- Length of the command
+//      0 -- buf is too small
+
+size_t s3g_queue_point_delta_encode(s3g_delta_state_t *state,
+				    const s3g_queue_point_new_ext *move,
+				    float tolerance, unsigned char *buf,
+				    size_t maxbuf);
+
+// Update the state for a move sent as a HOST_CMD_QUEUE_POINT_NEW_EXT
+
+void s3g_delta_update(s3g_delta_state_t *state,
+		      const s3g_queue_point_new_ext *move);
+
+// Update the state for any command read, as the firmware does when it runs it
+
+void s3g_delta_command(s3g_delta_state_t *state, const s3g_command_t *cmd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,6 +5,8 @@
 
 #define S3G_PRIVATE_H_
 
+#include <inttypes.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,6 +16,15 @@ typedef ssize_t s3g_read_proc_t(void *ctx, unsigned char *buf, size_t maxbuf, si
 typedef ssize_t s3g_write_proc_t(void *ctx, unsigned char *buf, size_t nbytes);
 typedef int s3g_close_proc_t(void *ctx);
 
+#ifndef S3G_DELTA_STATE_T_
+#define S3G_DELTA_STATE_T_
+typedef struct {
+     int32_t  target[5];
+     uint8_t  rel;
+     uint16_t feedrate_mult_64;
+} s3g_delta_state_t;
+#endif
+
 // The actual s3g_context_t declaration
 
 #ifndef S3G_CONTEXT_T_
@@ -24,6 +35,7 @@ typedef struct {
      s3g_close_proc_t *close;   // File driver close procedure; optional
      void             *r_ctx;   // File driver private context
      void             *w_ctx;   // File driver private context
+     s3g_delta_state_t delta;   // What HOST_CMD_QUEUE_POINT_DELTA moves are decoded against
 } s3g_context_t;
 #endif
 
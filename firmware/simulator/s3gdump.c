@@ -7,7 +7,9 @@
 //     s3gdump < filename
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <math.h>
 #include "s3g.h"
@@ -18,10 +20,13 @@ static void usage(FILE *f, const char *prog)
 	  f = stderr;
 
      fprintf(f,
-"Usage: %s -hE [file]\n"
+"Usage: %s -hE [-d outfile [-t tolerance]] [file]\n"
 "   file  -- The .s3g file to dump.  If not supplied then stdin is dumped\n"
 "  ?, -h  -- This help message\n"
-"     -E  -- Display distance moved and ratio of extruder steps to distance\n",
+"     -E  -- Display distance moved and ratio of extruder steps to distance\n"
+"     -d  -- Write a copy of the file with its moves sent as compact deltas\n"
+"     -t  -- Leave the distance and DDA rate out of deltas when those derived\n"
+"            from the steps are within this fraction of them (default 0)\n",
 	     prog ? prog : "s3gdump");
 }
 
@@ -91,6 +96,8 @@ static void edensity(const s3g_command_t *cmd)
      // Move to a new position
      case HOST_CMD_QUEUE_POINT_NEW :
      case HOST_CMD_QUEUE_POINT_EXT :
+     case HOST_CMD_QUEUE_POINT_NEW_EXT :
+     case HOST_CMD_QUEUE_POINT_DELTA :
 	  {
 	       float d, delta, e_density;
 	       int32_t esteps, t[AXIS_COUNT], zsteps;
@@ -108,6 +115,19 @@ static void edensity(const s3g_command_t *cmd)
 		    t[B_AXIS] = cmd->t.queue_point_new.b;
 		    rel = cmd->t.queue_point_new.rel;
 	       }
+	       else if (cmd->cmd_id == HOST_CMD_QUEUE_POINT_NEW_EXT ||
+			cmd->cmd_id == HOST_CMD_QUEUE_POINT_DELTA)
+	       {
+		    const s3g_queue_point_new_ext *move =
+			 (cmd->cmd_id == HOST_CMD_QUEUE_POINT_DELTA) ?
+			 &cmd->t.queue_point_delta.move : &cmd->t.queue_point_new_ext;
+		    t[X_AXIS] = move->x;
+		    t[Y_AXIS] = move->y;
+		    t[Z_AXIS] = move->z;
+		    t[A_AXIS] = move->a;
+		    t[B_AXIS] = move->b;
+		    rel = move->rel;
+	       }
 #if 0
 	       else if (cmd->cmd_id == HOST_CMD_QUEUE_POINT_ABS)
 	       {
@@ -196,15 +216,78 @@ static void edensity(const s3g_command_t *cmd)
      return;
 }
 
+// Copy the commands read from ctx to the file named, sending moves as
+// HOST_CMD_QUEUE_POINT_DELTA, and report how much smaller it is
+
+static int delta_copy(s3g_context_t *ctx, const char *filename, float tolerance)
+{
+     s3g_command_t cmd;
+     s3g_delta_state_t state;
+     unsigned char raw[1024], delta[64];
+     size_t len, in_bytes, out_bytes, moves, implicit;
+     FILE *fp;
+
+     if (!(fp = fopen(filename, "wb")))
+     {
+	  fprintf(stderr, "s3gdump: Unable to open %s; %s (%d)\n",
+		  filename, strerror(errno), errno);
+	  return(1);
+     }
+
+     memset(&state, 0, sizeof(state));
+     in_bytes = out_bytes = moves = implicit = 0;
+
+     while (!s3g_command_read_ext(ctx, &cmd, raw, sizeof(raw), &len))
+     {
+	  in_bytes += len;
+	  if (cmd.cmd_id == HOST_CMD_QUEUE_POINT_NEW_EXT ||
+	      cmd.cmd_id == HOST_CMD_QUEUE_POINT_DELTA)
+	  {
+	       const s3g_queue_point_new_ext *move =
+		    (cmd.cmd_id == HOST_CMD_QUEUE_POINT_DELTA) ?
+		    &cmd.t.queue_point_delta.move : &cmd.t.queue_point_new_ext;
+	       len = s3g_queue_point_delta_encode(&state, move, tolerance,
+						  delta, sizeof(delta));
+	       if (!(delta[2] & DELTA_FLAG_DISTANCE))
+		    implicit++;
+	       moves++;
+	       fwrite(delta, 1, len, fp);
+	  }
+	  else
+	  {
+	       s3g_delta_command(&state, &cmd);
+	       fwrite(raw, 1, len, fp);
+	  }
+	  out_bytes += len;
+     }
+
+     if (fclose(fp))
+     {
+	  fprintf(stderr, "s3gdump: Error writing %s; %s (%d)\n",
+		  filename, strerror(errno), errno);
+	  return(1);
+     }
+
+     printf("%lu moves, %lu without distance and DDA rate, %lu bytes -> %lu bytes\n",
+	    (unsigned long)moves, (unsigned long)implicit,
+	    (unsigned long)in_bytes, (unsigned long)out_bytes);
+
+     return(0);
+}
+
 int main(int argc, const char *argv[])
 {
      char c;
      s3g_context_t *ctx;
      s3g_command_t cmd;
      int do_edensity;
+     const char *delta_file;
+     float tolerance;
 
      do_edensity = 0;
-     while ((c = getopt(argc, (char **)argv, ":hE?")) != -1)
+     delta_file = NULL;
+     tolerance = 0.0;
+     while ((c = getopt(argc, (char **)argv, ":hEd:t:?")) != -1)
      {
 	  switch(c)
 	  {
@@ -224,6 +307,16 @@ int main(int argc, const char *argv[])
 	  case 'E' :
 	       do_edensity = -1;
 	       break;
+
+	       // -d write a delta encoded copy
+	  case 'd' :
+	       delta_file = optarg;
+	       break;
+
+	       // -t tolerance for leaving out the distance and DDA rate
+	  case 't' :
+	       tolerance = (float)atof(optarg);
+	       break;
 	  }
      }
 
@@ -240,6 +333,13 @@ int main(int argc, const char *argv[])
 	  // Assume that s3g_open() has complained
 	  return(1);
 
+     if (delta_file)
+     {
+	  int iret = delta_copy(ctx, delta_file, tolerance);
+	  s3g_close(ctx);
+	  return(iret);
+     }
+
      while (!s3g_command_read(ctx, &cmd))
      {
 	  if (do_edensity == 0)
@@ -0,0 +1,168 @@
+// Error check of the step rate to timer interval conversion done by calc_timer()
+// in StepperAccel.cc with the tables generated by GenerateSpeedTable.py
+//
+//     speedtable [-e max_error] [-m max_step_frequency]
+//
+// Every step rate from 0 to 65535 is converted the way calc_timer() does it:
+// the step loop thresholds pick the steps per interrupt, then the interval is
+// interpolated from speed_lookuptable_fast or speed_lookuptable_slow.  The
+// rate actually stepped, step_loops * timer frequency / interval, is compared
+// with the requested rate (clipped to SPEED_TABLE_MIN_RATE and the
+// MAX_STEP_FREQUENCY cap).  The exit status is 1 if the largest relative error
+// is above max_error.
+//
+// MultiU16X8toH16() is AVR assembler and is modelled here with the equivalent
+// rounded C expression.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+
+#include "StepperAccelSpeedTable.hh"
+
+#define DEFAULT_MAX_ERROR		0.015	// The slow table is 1.2% out just above SPEED_TABLE_MIN_RATE
+#define DEFAULT_MAX_STEP_FREQUENCY	40000	// MAX_STEP_FREQUENCY in StepperAccel.hh
+
+#define SHIFT1(x) (uint8_t)((x) >> 8)
+
+// intRes = (charIn1 * intIn2 + 128) >> 8, as MultiU16X8toH16() in StepperAccel.cc
+static uint16_t MultiU16X8toH16(uint8_t charIn1, uint16_t intIn2)
+{
+     return (uint16_t)(((uint32_t)charIn1 * (uint32_t)intIn2 + 128) >> 8);
+}
+
+// Same as calc_timer() with LOOKUP_TABLE_TIMER defined
+static uint16_t calc_timer(uint16_t step_rate, uint16_t max_step_frequency, uint8_t *step_loops)
+{
+     uint16_t timer;
+     uint8_t step_rate_high = SHIFT1(step_rate);
+
+     if (step_rate_high > SHIFT1(max_step_frequency)) {
+	  step_rate = (max_step_frequency / STEP_LOOPS_MAX) & (0xffff / STEP_LOOPS_MAX);
+	  *step_loops = STEP_LOOPS_MAX;
+     }
+#if STEP_LOOPS_MAX >= 8
+     else if (step_rate_high > SHIFT1(STEP_LOOPS_8_RATE)) {
+	  step_rate = (step_rate >> 3) & 0x1fff;
+	  *step_loops = 8;
+     }
+#endif
+#if STEP_LOOPS_MAX >= 4
+     else if (step_rate_high > SHIFT1(STEP_LOOPS_4_RATE)) {
+	  step_rate = (step_rate >> 2) & 0x3fff;
+	  *step_loops = 4;
+     }
+#endif
+#if STEP_LOOPS_MAX >= 2
+     else if (step_rate_high > SHIFT1(STEP_LOOPS_2_RATE)) {
+	  step_rate = (step_rate >> 1) & 0x7fff;
+	  *step_loops = 2;
+     }
+#endif
+     else {
+	  if (step_rate < SPEED_TABLE_MIN_RATE) step_rate = SPEED_TABLE_MIN_RATE;
+	  *step_loops = 1;
+     }
+
+     step_rate -= SPEED_TABLE_MIN_RATE;
+
+     if (step_rate >= (8 * 256)) {
+	  const uint16_t *entry = speed_lookuptable_fast[(uint8_t)(step_rate >> 8)];
+	  timer = entry[0] - MultiU16X8toH16((uint8_t)(step_rate & 0x00ff), entry[1]);
+     } else {
+	  const uint16_t *entry = speed_lookuptable_slow[step_rate >> 3];
+	  timer = entry[0] - ((entry[1] * (uint8_t)(step_rate & 0x0007)) >> 3);
+     }
+     return timer;
+}
+
+static void usage(FILE *f, const char *prog)
+{
+     if (f == NULL)
+	  f = stderr;
+
+     fprintf(f,
+"Usage: %s [-e max_error] [-m max_step_frequency]\n"
+"  ?, -h  -- This help message\n"
+"     -e  -- Largest relative error allowed (default %g)\n"
+"     -m  -- MAX_STEP_FREQUENCY in steps/s (default %d)\n",
+	     prog ? prog : "speedtable", DEFAULT_MAX_ERROR, DEFAULT_MAX_STEP_FREQUENCY);
+}
+
+int main(int argc, const char *argv[])
+{
+     int c;
+     double max_allowed = DEFAULT_MAX_ERROR;
+     uint16_t max_step_frequency = DEFAULT_MAX_STEP_FREQUENCY;
+     double max_err[STEP_LOOPS_MAX + 1] = { 0.0 };
+     uint32_t worst_rate[STEP_LOOPS_MAX + 1] = { 0 };
+     uint16_t min_interval[STEP_LOOPS_MAX + 1];
+     uint32_t rate;
+     double worst = 0.0;
+
+     while ((c = getopt(argc, (char **)argv, ":he:m:?")) != -1)
+     {
+	  switch(c)
+	  {
+	  case 'e' :
+	       max_allowed = atof(optarg);
+	       break;
+
+	  case 'm' :
+	       max_step_frequency = (uint16_t)atoi(optarg);
+	       break;
+
+	  case 'h' :
+	  case '?' :
+	       usage(stdout, argv[0]);
+	       return(0);
+
+	  default :
+	       usage(stderr, argv[0]);
+	       return(1);
+	  }
+     }
+
+     for (c = 0; c <= STEP_LOOPS_MAX; c++)
+	  min_interval[c] = 0xffff;
+
+     for (rate = 0; rate <= 0xffff; rate++)
+     {
+	  uint8_t step_loops;
+	  uint16_t timer = calc_timer((uint16_t)rate, max_step_frequency, &step_loops);
+	  double wanted = (double)rate;
+	  double stepped = (double)step_loops * (double)SPEED_TABLE_TIMER_FREQUENCY / (double)timer;
+	  double err;
+
+	  if (wanted < SPEED_TABLE_MIN_RATE)
+	       wanted = SPEED_TABLE_MIN_RATE;
+	  if (SHIFT1(rate) > SHIFT1(max_step_frequency))
+	       wanted = (double)(((max_step_frequency / STEP_LOOPS_MAX) & (0xffff / STEP_LOOPS_MAX)) * STEP_LOOPS_MAX);
+
+	  err = fabs(stepped - wanted) / wanted;
+	  if (err > max_err[step_loops])
+	  {
+	       max_err[step_loops] = err;
+	       worst_rate[step_loops] = rate;
+	  }
+	  if (timer < min_interval[step_loops])
+	       min_interval[step_loops] = timer;
+	  if (err > worst)
+	       worst = err;
+     }
+
+     printf("timer %d Hz, step loops up to %d, step rates 0 - 65535\n",
+	    SPEED_TABLE_TIMER_FREQUENCY, STEP_LOOPS_MAX);
+     printf("%-10s %14s %12s %14s\n", "step loops", "max rel error", "at rate", "min interval");
+     for (c = 1; c <= STEP_LOOPS_MAX; c <<= 1)
+	  printf("%-10d %14.3e %12u %14u\n", c, max_err[c], worst_rate[c], min_interval[c]);
+
+     if (worst > max_allowed)
+     {
+	  printf("FAIL: max rel error %.3e is above %.3e\n", worst, max_allowed);
+	  return(1);
+     }
+     printf("PASS\n");
+     return(0);
+}
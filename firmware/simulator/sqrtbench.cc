@@ -0,0 +1,179 @@
+// Accuracy and throughput comparison of the square root kernels which
+// initial_speed() and final_speed() in StepperAccelPlanner.cc can use
+//
+//     sqrtbench [-n count] [-s seed]
+//
+// Those routines normalize their argument x so that 2^29 <= x < 2^31 and
+// then want sqrt(x) << 8 [e.g., ITOFP(isqrt1(FPTOI16(x)))].  Every kernel is
+// fed the same random x from that range as well as the endpoints of each
+// table interval used by isqrt_table_newton().  The reference is libm sqrt().
+//
+// Note that host timings only give the relative cost of the C kernels;
+// isqrt1() is AVR assembler and is modelled here with an equivalent bit
+// by bit 16 bit square root.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "avrfix.h"
+#include "StepperAccelSqrt.hh"
+
+#define DEFAULT_COUNT 1000000
+
+typedef uint32_t kernel_t(uint32_t x);
+
+// Same result as the AVR isqrt1(): floor(sqrt(value)) for 0 <= value < 2^15
+static int16_t isqrt1(int16_t value)
+{
+     uint16_t rem = (uint16_t)value;
+     uint16_t root = 0;
+     uint16_t bit = 1 << 14;
+
+     while (bit > rem)
+	  bit >>= 2;
+     while (bit != 0)
+     {
+	  if (rem >= root + bit)
+	  {
+	       rem  -= root + bit;
+	       root  = (root >> 1) + bit;
+	  }
+	  else
+	       root >>= 1;
+	  bit >>= 2;
+     }
+     return (int16_t)root;
+}
+
+static uint32_t kernel_isqrt1(uint32_t x)
+{
+     return (uint32_t)itok(isqrt1(ktoi((_Accum)x)));
+}
+
+static uint32_t kernel_table_newton(uint32_t x)
+{
+     return (uint32_t)isqrt_table_newton(x) << 8;
+}
+
+static uint32_t kernel_sqrtk(uint32_t x)
+{
+     return (uint32_t)sqrtk((_Accum)x);
+}
+
+static uint32_t kernel_libm(uint32_t x)
+{
+     return (uint32_t)(0.5 + sqrt((double)x) * 256.0);
+}
+
+static const struct {
+     const char *name;
+     kernel_t   *proc;
+} kernels[] = {
+     { "isqrt1",              kernel_isqrt1 },
+     { "isqrt_table_newton",  kernel_table_newton },
+     { "sqrtk",               kernel_sqrtk },
+     { "libm sqrt",           kernel_libm },
+     { NULL, NULL }
+};
+
+static void usage(FILE *f, const char *prog)
+{
+     if (f == NULL)
+	  f = stderr;
+
+     fprintf(f,
+"Usage: %s [-n count] [-s seed]\n"
+"  ?, -h  -- This help message\n"
+"     -n  -- Number of random arguments to test (default %d)\n"
+"     -s  -- Seed for the random number generator\n",
+	     prog ? prog : "sqrtbench", DEFAULT_COUNT);
+}
+
+int main(int argc, const char *argv[])
+{
+     int c, i, k, count, seed;
+     uint32_t *args;
+     volatile uint32_t sink;
+
+     count = DEFAULT_COUNT;
+     seed  = 1;
+     while ((c = getopt(argc, (char **)argv, ":hn:s:?")) != -1)
+     {
+	  switch(c)
+	  {
+	  case 'n' :
+	       count = atoi(optarg);
+	       if (count <= 0)
+	       {
+		    usage(stderr, argv[0]);
+		    return(1);
+	       }
+	       break;
+
+	  case 's' :
+	       seed = atoi(optarg);
+	       break;
+
+	  case 'h' :
+	  case '?' :
+	       usage(stdout, argv[0]);
+	       return(0);
+
+	  default :
+	       usage(stderr, argv[0]);
+	       return(1);
+	  }
+     }
+
+     // Interval endpoints first, then random arguments
+     count += 2 * 48;
+     args = (uint32_t *)malloc(count * sizeof(uint32_t));
+     if (!args)
+     {
+	  fprintf(stderr, "Insufficient virtual memory\n");
+	  return(1);
+     }
+     for (i = 0; i < 48; i++)
+     {
+	  args[2 * i]     = (uint32_t)(SQRT_TABLE_FIRST + i) << 25;
+	  args[2 * i + 1] = ((uint32_t)(SQRT_TABLE_FIRST + i + 1) << 25) - 1;
+     }
+     srandom(seed);
+     for (i = 2 * 48; i < count; i++)
+	  args[i] = 0x20000000 + ((uint32_t)random() % 0x60000000);
+
+     printf("%d arguments in [2^29, 2^31)\n", count);
+     printf("%-20s %14s %14s %10s\n", "kernel", "max rel error", "avg rel error", "ns/call");
+
+     for (k = 0; kernels[k].name; k++)
+     {
+	  double err, max_err = 0.0, tot_err = 0.0;
+	  clock_t start;
+	  int pass, passes;
+
+	  for (i = 0; i < count; i++)
+	  {
+	       double exact = sqrt((double)args[i]) * 256.0;
+	       err = fabs((double)kernels[k].proc(args[i]) - exact) / exact;
+	       if (err > max_err)
+		    max_err = err;
+	       tot_err += err;
+	  }
+
+	  passes = 10;
+	  sink = 0;
+	  start = clock();
+	  for (pass = 0; pass < passes; pass++)
+	       for (i = 0; i < count; i++)
+		    sink += kernels[k].proc(args[i]);
+	  printf("%-20s %14.3e %14.3e %10.2f\n", kernels[k].name, max_err, tot_err / (double)count,
+		 1.0e9 * (double)(clock() - start) / (double)CLOCKS_PER_SEC / ((double)passes * (double)count));
+     }
+     (void)sink;
+
+     free(args);
+     return(0);
+}
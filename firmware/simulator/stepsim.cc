@@ -0,0 +1,790 @@
+// Host build of the stepper interrupt
+//
+//     stepsim [-b] [-r shaper,frequency,damping] [-t tfile] [file]
+//
+// The .s3g file is planned as planner does, but rather than dumping the
+// planned blocks, stepsim executes them with the firmware's own st_interrupt()
+// from StepperAccel.cc, writing to the mock registers and pins of
+// SimulatorRegisters.hh.  Time is simulated: the stepper interrupt is called
+// when timer 5 reaches OCR5A, as the interrupt last set it.
+// Moves are queued as Command.cc queues them, waiting while
+// steppers::isRunning(), so the interrupt sees the planner buffer as full as
+// it is on the bot.
+//
+// Reported at the end of the file:
+//
+//   - Block duration, as commanded and as achieved.  The commanded duration is
+//     that of the block's exact trapezoid, from its initial, nominal and final
+//     rates and acceleration.  The achieved duration is from the interrupt
+//     taking the block's first step to the one following its last step.
+//   - Step interval jitter per axis: the change in the interval between
+//     consecutive steps of an axis within a block.  Step loops and the DDA
+//     show up here, as does the extruder rate limit with JKN_ADVANCE.
+//   - DDA timing error: for each step of X, Y and Z which isn't the master axis
+//     of its block, the time it was taken less the time the master axis
+//     reached the point of the move the step belongs at.  The master axis's
+//     position is interpolated across its own steps, so this is the error in
+//     the direction of the move from the DDA's ticks and from step loops, which
+//     OVERSAMPLED_DDA trades against the stepper interrupt rate.
+//   - The JKN_ADVANCE e_steps backlog, sampled every stepper interrupt.
+//   - The host time taken by the stepper interrupt, and the interrupt rate
+//     while blocks are being stepped.  The interrupts which set up a block are
+//     also timed on their own, with the number of blocks BLOCK_PREFETCH had
+//     set up ahead of time.
+//   - With -r, the deflection of X and Y on a resonance of the given frequency
+//     and damping ratio, and with INPUT_SHAPING the shaper is set to cancel it.
+//     The axis's load is modelled as a mass on a spring and damper driven by
+//     the steps, so the deflection is in steps and includes the half step of
+//     the step quantization.
+//
+// -b prints the commanded and achieved rates of every block, -t writes every
+// step to tfile as "seconds axis direction" lines, e.g. "1.2345670 X +".
+// To compare shaped and unshaped steps, write the timelines of runs with
+// "-r none,40,0.1" and "-r zvd,40,0.1" and plot them.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+
+#include "Simulator.hh"
+#include "StepperAccelPlannerExtras.hh"
+#include "StepperAccel.hh"
+#include "SimulatorRegisters.hh"
+#include "Point.hh"
+#include "Steppers.hh"
+#include "Arc.hh"
+#include "s3g.h"
+#include "StepperAccelShaper.hh"
+
+volatile uint16_t OCR5A;
+volatile uint16_t TCNT5;
+volatile uint8_t  TIMSK5;
+
+static const char axis_names[STEPPER_COUNT + 1] = "XYZAB";
+
+static uint64_t now;			// Simulated time in timer 5 ticks
+static uint64_t next_stepper;		// Time of the next stepper interrupt
+
+static FILE *timeline_file = NULL;
+static bool show_blocks = false;
+
+// Levels of the direction pins
+static bool direction_pin[STEPPER_COUNT];
+
+// The block being stepped
+static struct {
+     block_t *block;
+     uint32_t steps;
+     uint8_t  master;
+     bool     use_accel;
+     double   initial_rate, nominal_rate, final_rate, acceleration;
+     uint32_t accelerate_until, decelerate_after;
+     uint32_t axis_steps[STEPPER_COUNT];
+     uint64_t start;
+} running;
+
+static uint32_t block_count;
+static double   commanded_total, achieved_total;
+static double   error_sum, error_worst;
+static uint32_t error_worst_block;
+
+// Step intervals of each axis
+static bool     stepped[STEPPER_COUNT];	// The axis has stepped in the running block
+static uint64_t last_step[STEPPER_COUNT];
+static int64_t  last_interval[STEPPER_COUNT];
+static uint32_t step_count[STEPPER_COUNT];
+static uint32_t jitter_count[STEPPER_COUNT];
+static double   jitter_sq_sum[STEPPER_COUNT];
+static int64_t  jitter_worst[STEPPER_COUNT];
+
+// DDA timing error.  The dda ticks (1 << OVERSAMPLED_DDA) times per step event.
+#ifdef OVERSAMPLED_DDA
+#define DDA_TICKS_PER_EVENT	(1 << OVERSAMPLED_DDA)
+#else
+#define DDA_TICKS_PER_EVENT	1
+#endif
+
+struct dda_step {
+     uint8_t  axis;
+     uint32_t k;			// Step of the axis in the block, from 1
+     uint64_t time;
+};
+
+static uint64_t        *master_times;	// Time of each master axis step of the running block
+static uint32_t         master_count, master_size;
+static struct dda_step *dda_steps;	// Steps of the other axes of X, Y and Z
+static uint32_t         dda_count, dda_size;
+static uint32_t         block_steps[STEPPER_COUNT];	// Steps each axis has taken in the running block
+static uint32_t         dda_error_count;
+static double           dda_error_sq_sum;
+static int64_t          dda_error_worst;
+
+// e_steps backlog
+static uint32_t backlog_samples;
+static double   backlog_sum[EXTRUDERS];
+static int16_t  backlog_worst[EXTRUDERS];
+
+// Resonance of X and Y, the deflection e of the load from the stepper position p
+// and the load's velocity u.  Between steps p is constant and
+//
+//     e' = u,  u' = -w^2 e - 2 z w u
+//
+// and a step moves p by one, with the damper's impulse of 2 z w on u.
+#define RESONANCE_AXES		2
+#define RESONANCE_MAX_DT	40	// Integration interval in ticks, 20us
+
+static bool     resonance = false;
+static double   resonance_w, resonance_z;
+static uint64_t resonance_time;		// Simulated time the deflections are at
+static double   deflection[RESONANCE_AXES], load_velocity[RESONANCE_AXES];
+static double   deflection_sq_sum[RESONANCE_AXES], deflection_worst[RESONANCE_AXES];
+
+// Stepper interrupt counts and host time
+static uint32_t isr_count;
+static uint32_t isr_block_count;	// Interrupts with a block to step
+static uint32_t isr_setup_count;	// Interrupts which set up a block
+static double   isr_setup_ns, isr_setup_ns_worst;
+static uint16_t isr_min_interval = 0xffff;
+static double   isr_host_ns;
+static double   isr_host_ns_worst;
+
+void simulator_direction_pin(uint8_t axis, bool value)
+{
+     direction_pin[axis] = value;
+}
+
+void simulator_step_pins(uint8_t axes, bool value)
+{
+     // Count the rising edges
+     if (!value)
+	  return;
+
+     for (uint8_t i = 0; i < STEPPER_COUNT; i++)
+     {
+	  if (!(axes & _BV(i)))
+	       continue;
+
+	  // The direction pin is inverted for inverted axes
+	  bool forward = direction_pin[i] ^ stepperAxis[i].invert_axis;
+	  // double is float here, too coarse for the time, so it's printed from the ticks
+	  if (timeline_file)
+	       fprintf(timeline_file, "%llu.%07llu %c %c\n",
+		       (unsigned long long)(now / STEPPER_TIMER_FREQUENCY),
+		       (unsigned long long)((now % STEPPER_TIMER_FREQUENCY) * 10000000ULL / STEPPER_TIMER_FREQUENCY),
+		       axis_names[i], forward ? '+' : '-');
+
+	  if (stepped[i])
+	  {
+	       int64_t interval = (int64_t)(now - last_step[i]);
+	       if (last_interval[i] >= 0)
+	       {
+		    int64_t jitter = interval - last_interval[i];
+		    if (jitter < 0)
+			 jitter = -jitter;
+		    jitter_sq_sum[i] += (double)jitter * (double)jitter;
+		    if (jitter > jitter_worst[i])
+			 jitter_worst[i] = jitter;
+		    jitter_count[i]++;
+	       }
+	       last_interval[i] = interval;
+	  }
+	  stepped[i] = true;
+	  last_step[i] = now;
+	  step_count[i]++;
+
+	  if (running.block != NULL && i <= Z_AXIS)
+	  {
+	       block_steps[i]++;
+	       if (i == running.master)
+	       {
+		    if (master_count < master_size)
+			 master_times[master_count++] = now;
+	       }
+	       else
+	       {
+		    if (dda_count == dda_size)
+		    {
+			 dda_size = dda_size ? 2 * dda_size : 1024;
+			 dda_steps = (struct dda_step *)realloc(dda_steps, dda_size * sizeof(struct dda_step));
+			 if (!dda_steps)
+			 {
+			      fprintf(stderr, "stepsim: out of memory\n");
+			      exit(1);
+			 }
+		    }
+		    dda_steps[dda_count].axis = i;
+		    dda_steps[dda_count].k = block_steps[i];
+		    dda_steps[dda_count].time = now;
+		    dda_count++;
+	       }
+	  }
+
+	  if (resonance && i < RESONANCE_AXES)
+	  {
+	       double dir = forward ? 1.0 : -1.0;
+	       deflection[i] -= dir;
+	       load_velocity[i] += 2.0 * resonance_z * resonance_w * dir;
+	  }
+     }
+}
+
+// Advance the deflections of X and Y to the simulated time
+
+static void resonance_update(void)
+{
+     while (resonance_time < now)
+     {
+	  uint64_t ticks = now - resonance_time;
+	  if (ticks > RESONANCE_MAX_DT)
+	       ticks = RESONANCE_MAX_DT;
+	  resonance_time += ticks;
+
+	  // Semi-implicit Euler
+	  double dt = (double)ticks / (double)STEPPER_TIMER_FREQUENCY;
+	  for (uint8_t i = 0; i < RESONANCE_AXES; i++)
+	  {
+	       load_velocity[i] -= (resonance_w * resonance_w * deflection[i] +
+				    2.0 * resonance_z * resonance_w * load_velocity[i]) * dt;
+	       deflection[i] += load_velocity[i] * dt;
+
+	       deflection_sq_sum[i] += deflection[i] * deflection[i] * (double)ticks;
+	       if (fabs(deflection[i]) > deflection_worst[i])
+		    deflection_worst[i] = fabs(deflection[i]);
+	  }
+     }
+}
+
+// Time in seconds to take n steps from rate v0 with acceleration a (negative to
+// decelerate), the rate being held at limit once it's reached
+
+static double ramp_time(double n, double v0, double a, double limit)
+{
+     if (n <= 0.0)
+	  return 0.0;
+     if (a == 0.0 || v0 == limit)
+	  return n / limit;
+
+     double n_ramp = (limit * limit - v0 * v0) / (2.0 * a);
+     if (n_ramp >= n)
+	  return (sqrt(v0 * v0 + 2.0 * a * n) - v0) / a;
+     return (limit - v0) / a + (n - n_ramp) / limit;
+}
+
+// Duration in seconds of the running block's exact trapezoid
+
+static double commanded_duration(void)
+{
+     if (!running.use_accel)
+	  return (double)running.steps / running.nominal_rate;
+
+     double accel_steps = (double)running.accelerate_until;
+     double cruise_steps = (double)running.decelerate_after - accel_steps;
+     double decel_steps = (double)running.steps - (double)running.decelerate_after;
+     double peak = sqrt(running.initial_rate * running.initial_rate + 2.0 * running.acceleration * accel_steps);
+     if (peak > running.nominal_rate)
+	  peak = running.nominal_rate;
+
+     // The interrupt cruises at the nominal rate, whatever the acceleration reached
+     return ramp_time(accel_steps, running.initial_rate, running.acceleration, running.nominal_rate) +
+	  ((cruise_steps > 0.0) ? cruise_steps / running.nominal_rate : 0.0) +
+	  ramp_time(decel_steps, peak, -running.acceleration, running.final_rate);
+}
+
+// Where the dda places the k'th step of an axis taking s of a block's m step
+// events, in step events, which is where it steps if it isn't held back to
+// the next dda tick
+
+static double dda_step_position(uint32_t k, uint32_t s, uint32_t m)
+{
+     return ((double)(k - 1) * (double)m + (double)(m >> 1)) / (double)s;
+}
+
+// The step event at which the dda ticks for the k'th step of the master axis
+
+static double dda_master_position(uint32_t k, uint32_t m)
+{
+     uint64_t f = DDA_TICKS_PER_EVENT;
+     uint64_t ticks = ((uint64_t)(k - 1) * m * f + (uint64_t)(m >> 1) * f) / m + 1;
+     return (double)ticks / (double)f;
+}
+
+// Times the steps of the axes other than the master of the running block
+// against the master axis's steps
+
+static void dda_timing(void)
+{
+     uint32_t m = running.steps;
+     if (master_count != m || m < 3)
+	  return;
+
+     uint32_t j = 1;
+     for (uint32_t n = 0; n < dda_count; n++)
+     {
+	  const struct dda_step *st = &dda_steps[n];
+	  double p = dda_step_position(st->k, running.axis_steps[st->axis], m);
+
+	  // Steps before the master's first or after its last can't be interpolated
+	  if (p < dda_master_position(1, m) || p >= dda_master_position(m, m))
+	       continue;
+
+	  // The steps of an axis are in order, but the axes are interleaved
+	  while (j > 1 && dda_master_position(j, m) > p)
+	       j--;
+	  while (dda_master_position(j + 1, m) <= p)
+	       j++;
+
+	  // Quadratic through the master steps either side and the next one
+	  // along, so acceleration across them doesn't count as error
+	  uint32_t j0 = (j + 2 <= m) ? j : j - 1;
+	  double c0 = dda_master_position(j0, m), c1 = dda_master_position(j0 + 1, m),
+		 c2 = dda_master_position(j0 + 2, m);
+	  double t0 = (double)master_times[j0 - 1], t1 = (double)master_times[j0],
+		 t2 = (double)master_times[j0 + 1];
+	  double ideal = t0 * (p - c1) * (p - c2) / ((c0 - c1) * (c0 - c2)) +
+		         t1 * (p - c0) * (p - c2) / ((c1 - c0) * (c1 - c2)) +
+		         t2 * (p - c0) * (p - c1) / ((c2 - c0) * (c2 - c1));
+
+	  int64_t error = (int64_t)llround((double)st->time - ideal);
+	  dda_error_sq_sum += (double)error * (double)error;
+	  if (llabs(error) > llabs(dda_error_worst))
+	       dda_error_worst = error;
+	  dda_error_count++;
+     }
+}
+
+static void block_start(block_t *block)
+{
+     running.block            = block;
+     running.steps            = block->step_event_count;
+     running.master           = block->dda_master_axis_index;
+     running.use_accel        = block->use_accel;
+     running.initial_rate     = (double)block->initial_rate;
+     running.nominal_rate     = (double)block->nominal_rate;
+     running.final_rate       = (double)block->final_rate;
+     running.acceleration     = (double)block->acceleration_st;
+     running.accelerate_until = (uint32_t)block->accelerate_until;
+     running.decelerate_after = (uint32_t)block->decelerate_after;
+     running.start            = now;
+
+     // Jitter is measured within a block
+     for (uint8_t i = 0; i < STEPPER_COUNT; i++)
+     {
+	  stepped[i] = false;
+	  last_interval[i] = -1;
+	  running.axis_steps[i] = block->steps[i];
+	  block_steps[i] = 0;
+     }
+
+     master_count = 0;
+     dda_count = 0;
+     if (master_size < running.steps)
+     {
+	  master_size = running.steps;
+	  master_times = (uint64_t *)realloc(master_times, master_size * sizeof(uint64_t));
+	  if (!master_times)
+	  {
+	       fprintf(stderr, "stepsim: out of memory\n");
+	       exit(1);
+	  }
+     }
+}
+
+// The block finishes when the interrupt following its last step is due
+
+static void block_end(void)
+{
+     double commanded = commanded_duration();
+     double achieved = (double)(next_stepper - running.start) / (double)STEPPER_TIMER_FREQUENCY;
+     double error = (achieved - commanded) / commanded;
+
+     dda_timing();
+
+     block_count++;
+     commanded_total += commanded;
+     achieved_total += achieved;
+     error_sum += fabs(error);
+     if (fabs(error) > fabs(error_worst))
+     {
+	  error_worst = error;
+	  error_worst_block = block_count;
+     }
+
+     if (show_blocks)
+	  printf("%-6u %11.6f %c %6u steps: entry=%5.0f, nominal=%5.0f, final=%5.0f steps/s; "
+		 "commanded=%8.1f, achieved=%8.1f steps/s (%+.2f%%)\n",
+		 block_count, (double)running.start / (double)STEPPER_TIMER_FREQUENCY,
+		 axis_names[running.master], running.steps,
+		 running.initial_rate, running.nominal_rate, running.final_rate,
+		 (double)running.steps / commanded, (double)running.steps / achieved,
+		 -100.0 * error / (1.0 + error));
+
+     running.block = NULL;
+}
+
+static void stepper_interrupt(void)
+{
+     struct timespec t0, t1;
+
+     // The block this interrupt steps: the current one, or the one it'll start
+     block_t *block = current_block;
+     if (block == NULL && block_buffer_head != block_buffer_tail)
+	  block = &block_buffer[block_buffer_tail];
+     if (block != NULL && block != running.block)
+	  block_start(block);
+
+     if (resonance)
+	  resonance_update();
+
+     block_t *before = current_block;
+
+     clock_gettime(CLOCK_MONOTONIC, &t0);
+     steppers::doStepperInterrupt();
+     clock_gettime(CLOCK_MONOTONIC, &t1);
+
+     double ns = (double)(t1.tv_sec - t0.tv_sec) * 1.0e9 + (double)(t1.tv_nsec - t0.tv_nsec);
+     isr_host_ns += ns;
+     if (ns > isr_host_ns_worst)
+	  isr_host_ns_worst = ns;
+     if (current_block != NULL && current_block != before)
+     {
+	  isr_setup_count++;
+	  isr_setup_ns += ns;
+	  if (ns > isr_setup_ns_worst)
+	       isr_setup_ns_worst = ns;
+     }
+     isr_count++;
+     if (block != NULL)
+	  isr_block_count++;
+     if (OCR5A < isr_min_interval)
+	  isr_min_interval = OCR5A;
+
+     next_stepper = now + OCR5A;
+
+#ifdef JKN_ADVANCE
+     backlog_samples++;
+     for (uint8_t e = 0; e < EXTRUDERS; e++)
+     {
+	  int16_t backlog = (e_steps[e] < 0) ? -e_steps[e] : e_steps[e];
+	  backlog_sum[e] += (double)backlog;
+	  if (backlog > backlog_worst[e])
+	       backlog_worst[e] = backlog;
+     }
+#endif
+
+     if (running.block != NULL && current_block != running.block)
+	  block_end();
+}
+
+// Advance the simulated time to the next interrupt and run it
+
+static void run_interrupt(void)
+{
+     // The main loop gets a turn before every interrupt
+     steppers::runSteppersSlice();
+
+     now = next_stepper;
+     stepper_interrupt();
+}
+
+// Wait for room in the planner buffer, as Command.cc does
+
+static void wait_for_room(void)
+{
+     while (steppers::isRunning())
+	  run_interrupt();
+}
+
+// Run until the planned blocks and any extruder steps left over are done
+
+static void drain(void)
+{
+     steppers::flushSegment();
+     while (!st_empty() || current_block != NULL || e_steps[0] || e_steps[1])
+	  run_interrupt();
+}
+
+static void usage(FILE *f, const char *prog)
+{
+     if (f == NULL)
+	  f = stderr;
+
+     fprintf(f,
+"Usage: %s [? | -h] [-b] [-r shaper,frequency,damping] [-t tfile] [file]\n"
+"     file -- The .s3g file to run.  If not supplied then stdin is run\n"
+"       -b -- Display the commanded and achieved step rates of each block\n"
+"       -r -- Report the deflection of X and Y on a resonance of frequency Hz and\n"
+"             the damping ratio damping, shaping X and Y for it with shaper\n"
+"             none, zv or zvd (INPUT_SHAPING builds)\n"
+" -t tfile -- Write every step to \"tfile\" as \"seconds axis direction\" lines\n"
+"    ?, -h -- This help message\n",
+	     prog ? prog : "stepsim");
+}
+
+// Run the .s3g file "fname", or stdin when fname is NULL, through the planner
+// and the stepper interrupt
+
+static int simulate(const char *fname)
+{
+     s3g_command_t cmd;
+     s3g_context_t *ctx;
+
+     ctx = s3g_open(0, (void *)fname);
+     if (!ctx)
+	  // Assume that s3g_open() has complained
+	  return(1);
+
+     while (!s3g_command_read(ctx, &cmd))
+     {
+	  // As Command.cc does, plan any held back move before a command it can't be merged with
+	  if (cmd.cmd_id != HOST_CMD_QUEUE_POINT_NEW_EXT && cmd.cmd_id != HOST_CMD_QUEUE_POINT_DELTA &&
+	      steppers::segmentPending())
+	  {
+	       steppers::flushSegment();
+	       wait_for_room();
+	  }
+
+	  if (cmd.cmd_id == HOST_CMD_QUEUE_POINT_NEW)
+	  {
+	       Point target = Point(cmd.t.queue_point_new.x, cmd.t.queue_point_new.y,
+				    cmd.t.queue_point_new.z, cmd.t.queue_point_new.a,
+				    cmd.t.queue_point_new.b);
+	       steppers::setTargetNew(target, cmd.t.queue_point_new.us, cmd.t.queue_point_new.rel);
+	       wait_for_room();
+	  }
+	  else if (cmd.cmd_id == HOST_CMD_QUEUE_POINT_NEW_EXT ||
+		   cmd.cmd_id == HOST_CMD_QUEUE_POINT_DELTA)
+	  {
+	       const s3g_queue_point_new_ext *move = (cmd.cmd_id == HOST_CMD_QUEUE_POINT_DELTA) ?
+		    &cmd.t.queue_point_delta.move : &cmd.t.queue_point_new_ext;
+	       Point target = Point(move->x, move->y, move->z, move->a, move->b);
+	       steppers::setTargetNewExt(target, move->dda_rate, move->rel, move->distance,
+					 move->feedrate_mult_64);
+	       wait_for_room();
+	  }
+	  else if (cmd.cmd_id == HOST_CMD_QUEUE_ARC)
+	  {
+	       Point target = Point(cmd.t.queue_arc.x, cmd.t.queue_arc.y,
+				    cmd.t.queue_arc.z, cmd.t.queue_arc.a,
+				    cmd.t.queue_arc.b);
+	       arc::begin(target, cmd.t.queue_arc.i, cmd.t.queue_arc.j,
+			  cmd.t.queue_arc.rel, cmd.t.queue_arc.feedrate_mult_64,
+			  cmd.t.queue_arc.flags);
+	       while (arc::isActive())
+	       {
+		    arc::queueNextSegment();
+		    wait_for_room();
+	       }
+	  }
+	  else if (cmd.cmd_id == HOST_CMD_QUEUE_POINT_EXT)
+	  {
+	       Point target = Point(cmd.t.queue_point_ext.x, cmd.t.queue_point_ext.y,
+				    cmd.t.queue_point_ext.z, cmd.t.queue_point_ext.a,
+				    cmd.t.queue_point_ext.b);
+	       steppers::setTarget(target, cmd.t.queue_point_ext.dda);
+	       wait_for_room();
+	  }
+	  else if (cmd.cmd_id == HOST_CMD_SET_POSITION_EXT)
+	  {
+	       Point target = Point(cmd.t.set_position_ext.x, cmd.t.set_position_ext.y,
+				    cmd.t.set_position_ext.z, cmd.t.set_position_ext.a,
+				    cmd.t.set_position_ext.b);
+	       while (plan_position_resync_busy()) run_interrupt();
+	       steppers::definePosition(target);
+	  }
+	  else if (cmd.cmd_id == HOST_CMD_SET_ACCELERATION_TOGGLE)
+	  {
+	       steppers::setSegmentAccelState((cmd.t.set_segment_acceleration.s != 0) ? true : false);
+	  }
+	  else if (cmd.cmd_id != HOST_CMD_TOOL_COMMAND &&
+		   cmd.cmd_id != HOST_CMD_ENABLE_AXES &&
+		   cmd.cmd_id != HOST_CMD_SET_BUILD_PERCENT &&
+		   cmd.cmd_id != HOST_CMD_CHANGE_TOOL)
+	  {
+	       // As planner does, anything else waits for the motion to finish
+	       drain();
+	  }
+     }
+
+     drain();
+
+     s3g_close(ctx);
+
+     return(0);
+}
+
+static void report(void)
+{
+     printf("Simulated time = %f seconds; stepper interrupts = %u, shortest interval = %u ticks\n",
+	    (double)now / (double)STEPPER_TIMER_FREQUENCY, isr_count, isr_min_interval);
+     if (isr_count)
+	  printf("Host time per stepper interrupt: average = %.0f ns, worst = %.0f ns\n",
+		 isr_host_ns / (double)isr_count, isr_host_ns_worst);
+     if (isr_setup_count)
+     {
+	  printf("Host time per interrupt setting up a block: average = %.0f ns, worst = %.0f ns (%u blocks",
+		 isr_setup_ns / (double)isr_setup_count, isr_setup_ns_worst, isr_setup_count);
+#if defined(BLOCK_PREFETCH) && defined(MOTION_STATS)
+	  printf(", %u prefetched", motion_stats.prefetched);
+#endif
+	  printf(")\n");
+     }
+
+     if (block_count)
+     {
+	  printf("Stepper interrupt rate while stepping = %.0f Hz\n",
+		 (double)isr_block_count / achieved_total);
+	  printf("Blocks = %u; commanded / achieved time = %f / %f seconds\n",
+		 block_count, commanded_total, achieved_total);
+	  printf("Block duration error: average = %.2f%%, worst = %+.2f%% (block %u)\n",
+		 100.0 * error_sum / (double)block_count, 100.0 * error_worst, error_worst_block);
+     }
+
+     printf("Step interval jitter:\n");
+     for (uint8_t i = 0; i < STEPPER_COUNT; i++)
+     {
+	  if (step_count[i] == 0)
+	       continue;
+	  printf("    %c: %u steps; rms = %.1f us, worst = %.1f us\n", axis_names[i], step_count[i],
+		 jitter_count[i] ? 1.0e6 * sqrt(jitter_sq_sum[i] / (double)jitter_count[i]) / (double)STEPPER_TIMER_FREQUENCY : 0.0,
+		 1.0e6 * (double)jitter_worst[i] / (double)STEPPER_TIMER_FREQUENCY);
+     }
+
+     if (dda_error_count)
+	  printf("DDA timing error of %u X, Y and Z steps (%u dda ticks per step event): rms = %.2f us, worst = %+.1f us\n",
+		 dda_error_count, DDA_TICKS_PER_EVENT,
+		 1.0e6 * sqrt(dda_error_sq_sum / (double)dda_error_count) / (double)STEPPER_TIMER_FREQUENCY,
+		 1.0e6 * (double)dda_error_worst / (double)STEPPER_TIMER_FREQUENCY);
+
+     if (resonance && now)
+     {
+	  printf("Deflection at %.1f Hz, damping ratio %.3f:\n",
+		 resonance_w / (2.0 * M_PI), resonance_z);
+	  for (uint8_t i = 0; i < RESONANCE_AXES; i++)
+	       printf("    %c: rms = %.3f, worst = %.3f steps\n", axis_names[i],
+		      sqrt(deflection_sq_sum[i] / (double)now), deflection_worst[i]);
+     }
+
+#ifdef JKN_ADVANCE
+     if (backlog_samples)
+     {
+	  printf("e_steps backlog:\n");
+	  for (uint8_t e = 0; e < EXTRUDERS; e++)
+	       printf("    %c: average = %.2f, worst = %d steps\n", axis_names[A_AXIS + e],
+		      backlog_sum[e] / (double)backlog_samples, backlog_worst[e]);
+     }
+#endif
+}
+
+int main(int argc, const char *argv[])
+{
+     char c;
+     const char *tfile = NULL;
+     const char *prog = argv[0];
+
+     // As the firmware's boot: init() loads the axis settings, reset() the planner
+     // and the stepper interrupt
+     steppers::init();
+     steppers::reset();
+
+     // Enable acceleration: it's off by default
+     init_extras(true);
+
+     simulator_quiet = true;
+
+     next_stepper = OCR5A = STEPPER_TIMER_FREQUENCY / 1000;
+
+     while ((c = getopt(argc, (char **)argv, ":bhr:t:?")) != -1)
+     {
+	  switch(c)
+	  {
+	  // Unknown switch
+	  case ':' :
+	  default :
+	       usage(stderr, argv[0]);
+	       return(1);
+
+	  // Explicit help request
+	  case 'h' :
+	  case '?' :
+	       usage(stdout, argv[0]);
+	       return(1);
+
+	  // Show blocks
+	  case 'b' :
+	       show_blocks = true;
+	       break;
+
+	  // Resonance and input shaper
+	  case 'r' :
+	  {
+	       char name[8];
+	       float frequency, damping;
+	       if (sscanf(optarg, "%7[a-z],%f,%f", name, &frequency, &damping) != 3 ||
+		   frequency <= 0.0 || damping < 0.0 || damping >= 1.0)
+	       {
+		    usage(stderr, argv[0]);
+		    return(1);
+	       }
+
+	       uint8_t type;
+	       if (!strcmp(name, "none"))
+		    type = SHAPER_NONE;
+	       else if (!strcmp(name, "zv"))
+		    type = SHAPER_ZV;
+	       else if (!strcmp(name, "zvd"))
+		    type = SHAPER_ZVD;
+	       else
+	       {
+		    usage(stderr, argv[0]);
+		    return(1);
+	       }
+#ifdef INPUT_SHAPING
+	       plan_set_input_shaper(type, frequency, damping);
+#else
+	       if (type != SHAPER_NONE)
+	       {
+		    fprintf(stderr, "%s: input shaping needs a build with INPUT_SHAPING\n", prog);
+		    return(1);
+	       }
+#endif
+	       resonance = true;
+	       resonance_w = 2.0 * M_PI * frequency;
+	       resonance_z = damping;
+	       break;
+	  }
+
+	  // Step timeline file
+	  case 't' :
+	       tfile = optarg;
+	       break;
+	  }
+     }
+
+     argc -= optind;
+     argv += optind;
+
+     if (tfile)
+     {
+	  timeline_file = fopen(tfile, "w");
+	  if (!timeline_file)
+	  {
+	       fprintf(stderr, "%s: unable to open the timeline file \"%s\"; %s (%d)\n",
+		       prog, tfile, strerror(errno), errno);
+	       return(1);
+	  }
+     }
+
+     if (simulate((argc == 0) ? NULL : argv[0]))
+	  return(1);
+
+     if (timeline_file)
+	  fclose(timeline_file);
+
+     report();
+
+     return(0);
+}
@@ -0,0 +1,102 @@
+#!/usr/bin/python
+#
+# Generates StepperAccelSpeedTable.hh, the step rate to timer interval lookup
+# tables and the step loop thresholds used by calc_timer() in StepperAccel.cc.
+# The SConscript runs this for every build with its f_cpu, prescaler, step_loops
+# and step_loop_rate parameters, the simulator Makefile with the defaults.
+#
+# usage python GenerateSpeedTable.py [options] > StepperAccelSpeedTable.hh
+#
+# Options:
+#   --timer-frequency=...  stepper timer frequency in Hz, F_CPU / prescaler (default 2000000)
+#   --step-loops=...       most steps taken by one stepper interrupt, 1, 2, 4 or 8 (default 8)
+#   --step-loop-rate=...   step rate in steps/s above which two steps are taken per interrupt,
+#                          four above twice this and eight above four times this (default 5000)
+#
+# Both tables hold { timer interval, difference to the next entry's interval } for
+# 256 step rates.  The fast table covers min_rate + i * 256, the slow one min_rate + i * 8,
+# calc_timer() interpolates between the entries.
+
+import getopt
+import sys
+
+def speed_table(timer_frequency, min_rate, spacing):
+	table = [timer_frequency // ((i * spacing) + min_rate) for i in range(256)]
+	gains = [table[i] - table[i + 1] for i in range(255)]
+	gains.append(gains[254])
+	return list(zip(table, gains))
+
+def step_loop_rates(step_loops, step_loop_rate):
+	# calc_timer() compares the high byte of the step rate, so the thresholds are
+	# multiples of 256
+	rates = []
+	loops = 2
+	while loops <= step_loops:
+		rates.append((loops, ((step_loop_rate * (loops >> 1)) >> 8) << 8))
+		loops <<= 1
+	return rates
+
+def write_table(out, name, table):
+	out.write("const uint16_t %s[256][2] SPEED_TABLE_PROGMEM = {\\\n" % name)
+	for i in range(32):
+		out.write(", ".join(["{ %d, %d}" % entry for entry in table[i * 8:(i + 1) * 8]]))
+		out.write(",\n" if i < 31 else "\n")
+	out.write("};\n\n")
+
+def main(argv):
+	timer_frequency = 2000000
+	step_loops = 8
+	step_loop_rate = 5000
+
+	try:
+		opts, args = getopt.getopt(argv, "", ["timer-frequency=", "step-loops=", "step-loop-rate="])
+	except getopt.GetoptError:
+		sys.stderr.write("usage: python GenerateSpeedTable.py [--timer-frequency=Hz] [--step-loops=n] [--step-loop-rate=steps/s]\n")
+		return 2
+	for opt, arg in opts:
+		if opt == "--timer-frequency":
+			timer_frequency = int(arg.rstrip("Ll"))
+		elif opt == "--step-loops":
+			step_loops = int(arg)
+		elif opt == "--step-loop-rate":
+			step_loop_rate = int(arg)
+
+	if step_loops not in (1, 2, 4, 8):
+		sys.stderr.write("step loops must be 1, 2, 4 or 8\n")
+		return 2
+
+	# The timer interval for the lowest step rate has to fit 16 bits
+	min_rate = max(32, -(-timer_frequency // 65535))
+
+	rates = step_loop_rates(step_loops, step_loop_rate)
+	for loops, rate in rates:
+		if rate <= 0 or rate > 0xFFFF:
+			sys.stderr.write("step loop rate %d for %d steps per interrupt is out of range\n" % (rate, loops))
+			return 2
+
+	out = sys.stdout
+	out.write("#ifndef STEPPERACCELSPEEDTABLE_HH\n")
+	out.write("#define STEPPERACCELSPEEDTABLE_HH\n\n")
+	out.write("// Generated by GenerateSpeedTable.py --timer-frequency=%d --step-loops=%d --step-loop-rate=%d\n" %
+		  (timer_frequency, step_loops, step_loop_rate))
+	out.write("// Don't edit, it's regenerated by every build\n\n")
+	out.write("#include <inttypes.h>\n\n")
+	out.write("#define SPEED_TABLE_TIMER_FREQUENCY\t%d\n" % timer_frequency)
+	out.write("#define SPEED_TABLE_MIN_RATE\t\t%d\t// Lowest step rate calc_timer() handles\n" % min_rate)
+	out.write("#define STEP_LOOPS_MAX\t\t\t%d\n" % step_loops)
+	for loops, rate in rates:
+		out.write("#define STEP_LOOPS_%d_RATE\t\t%d\t// %d steps per interrupt above this step rate\n" % (loops, rate, loops))
+	out.write("\n")
+	out.write("#ifdef SIMULATOR\n")
+	out.write("\t#define SPEED_TABLE_PROGMEM\n")
+	out.write("#else\n")
+	out.write("\t#include <avr/pgmspace.h>\n")
+	out.write("\t#define SPEED_TABLE_PROGMEM\tPROGMEM\n")
+	out.write("#endif\n\n")
+	write_table(out, "speed_lookuptable_fast", speed_table(timer_frequency, min_rate, 256))
+	write_table(out, "speed_lookuptable_slow", speed_table(timer_frequency, min_rate, 8))
+	out.write("#endif\n")
+	return 0
+
+if __name__ == "__main__":
+	sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,152 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#include <math.h>
+#include "Arc.hh"
+#include "Steppers.hh"
+#include "StepperAxis.hh"
+
+namespace arc {
+
+/// The radius vector is rotated by the segment angle using the small angle approximation
+/// of its sine and cosine.  Every ARC_CORRECTION_SEGMENTS segments it's recomputed exactly
+/// so that the error doesn't accumulate.
+#define ARC_CORRECTION_SEGMENTS 25
+
+static uint16_t	segment_count;		///< Number of segments in the arc
+static uint16_t	segment;		///< Index of the next segment to queue, arc is done when it reaches segment_count
+static Point	arc_start;		///< Start point, in steps without the tool offsets
+static Point	arc_end;		///< End point, in steps without the tool offsets
+static Point	last_target;		///< Target of the last segment queued
+static float	center_x, center_y;	///< Center relative to arc_start, in mm
+static float	radius_x, radius_y;	///< Vector from the center to the end of the last segment, in mm
+static float	start_angle;		///< Angle of the vector from the center to arc_start
+static float	segment_angle;		///< Signed angle each segment sweeps
+static float	cos_t, sin_t;		///< Small angle cosine and sine of segment_angle
+static float	segment_mm;		///< Length of each segment, in mm
+static float	feedrate;		///< Feed rate in mm/s
+static int16_t	feedrate_mult_64;	///< Feed rate as received, for steppers::setTargetNewExt()
+
+void begin(const Point& target, int32_t i, int32_t j, uint8_t relative, int16_t feedrateMult64, uint8_t flags) {
+	arc_start = steppers::getPlannerPosition();
+	for ( uint8_t axis = 0; axis < STEPPER_COUNT; axis ++ ) {
+		if ((relative & (1 << axis)) != 0)	arc_end[axis] = arc_start[axis] + target[axis];
+		else					arc_end[axis] = target[axis];
+	}
+	last_target = arc_start;
+
+	float steps_per_mm_x = stepperAxisStepsPerMM(X_AXIS);
+	float steps_per_mm_y = stepperAxisStepsPerMM(Y_AXIS);
+
+	center_x = (float)i / steps_per_mm_x;
+	center_y = (float)j / steps_per_mm_y;
+	radius_x = -center_x;
+	radius_y = -center_y;
+
+	float end_x = (float)(arc_end[X_AXIS] - arc_start[X_AXIS]) / steps_per_mm_x - center_x;
+	float end_y = (float)(arc_end[Y_AXIS] - arc_start[Y_AXIS]) / steps_per_mm_y - center_y;
+	float radius = sqrt(center_x * center_x + center_y * center_y);
+
+	// Angle from the start to the end radius vector, in [-pi, pi].  Using the cross and
+	// dot products rather than the difference of the two angles means a start point equal
+	// to the end point gives a sweep of +/-0, which becomes a full circle below.
+	start_angle = atan2(radius_y, radius_x);
+	float sweep = atan2(radius_x * end_y - radius_y * end_x, radius_x * end_x + radius_y * end_y);
+
+	if ( flags & ARC_FLAG_CCW ) {
+		if ( sweep <= 0.0 )	sweep += 2.0 * M_PI;
+	} else {
+		if ( sweep >= 0.0 )	sweep -= 2.0 * M_PI;
+	}
+
+	// Longest chord which stays within ARC_CHORD_ERROR of the arc
+	float arc_mm = fabs(sweep) * radius;
+	float chord_mm = ( radius > ARC_CHORD_ERROR ) ?
+		2.0 * sqrt(ARC_CHORD_ERROR * (2.0 * radius - ARC_CHORD_ERROR)) : arc_mm;
+	if ( chord_mm < ARC_MIN_SEGMENT_LENGTH )	chord_mm = ARC_MIN_SEGMENT_LENGTH;
+
+	float segments = ceil(arc_mm / chord_mm);
+	if ( segments < 1.0 )		segments = 1.0;
+	if ( segments > 65535.0 )	segments = 65535.0;
+	segment_count = (uint16_t)segments;
+	segment = 0;
+
+	segment_angle = sweep / segments;
+	cos_t = 1.0 - 0.5 * segment_angle * segment_angle;
+	sin_t = segment_angle;
+
+	// Each segment is a chord, plus its share of the Z (helix) travel
+	float chord = 2.0 * radius * sin(0.5 * fabs(segment_angle));
+	float dz = (float)(arc_end[Z_AXIS] - arc_start[Z_AXIS]) / stepperAxisStepsPerMM(Z_AXIS) / segments;
+	segment_mm = sqrt(chord * chord + dz * dz);
+
+	feedrate_mult_64 = feedrateMult64;
+	feedrate = (float)feedrateMult64 / 64.0;
+}
+
+bool isActive() {
+	return segment < segment_count;
+}
+
+void queueNextSegment() {
+	if ( ! isActive() )	return;
+
+	segment ++;
+
+	Point next;
+
+	if ( segment == segment_count ) {
+		// Land exactly on the end point
+		next = arc_end;
+	} else {
+		if ( (segment % ARC_CORRECTION_SEGMENTS) == 0 ) {
+			float angle = start_angle + segment_angle * (float)segment;
+			float radius = sqrt(radius_x * radius_x + radius_y * radius_y);
+			radius_x = radius * cos(angle);
+			radius_y = radius * sin(angle);
+		} else {
+			float r = radius_x * sin_t + radius_y * cos_t;
+			radius_x = radius_x * cos_t - radius_y * sin_t;
+			radius_y = r;
+		}
+
+		float fraction = (float)segment / (float)segment_count;
+
+		next[X_AXIS] = arc_start[X_AXIS] + (int32_t)lround((center_x + radius_x) * stepperAxisStepsPerMM(X_AXIS));
+		next[Y_AXIS] = arc_start[Y_AXIS] + (int32_t)lround((center_y + radius_y) * stepperAxisStepsPerMM(Y_AXIS));
+		for ( uint8_t axis = Z_AXIS; axis < STEPPER_COUNT; axis ++ )
+			next[axis] = arc_start[axis] + (int32_t)lround((float)(arc_end[axis] - arc_start[axis]) * fraction);
+	}
+
+	// dda_rate is the number of dda steps per second for the master axis
+	int32_t master_steps = 0;
+	for ( uint8_t axis = 0; axis < STEPPER_COUNT; axis ++ ) {
+		int32_t steps = labs(next[axis] - last_target[axis]);
+		if ( steps > master_steps )	master_steps = steps;
+	}
+	// A zero length segment (zero radius arc) is dropped by setTargetNewExt()
+	int32_t dda_rate = ( segment_mm > 0.0 ) ? (int32_t)(feedrate * (float)master_steps / segment_mm) : 0;
+
+	last_target = next;
+
+	steppers::setTargetNewExt(next, dda_rate, 0, segment_mm, feedrate_mult_64);
+}
+
+void abort() {
+	segment_count = 0;
+	segment = 0;
+}
+
+};
@@ -0,0 +1,59 @@
+/*
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>
+ */
+
+#ifndef ARC_HH
+#define ARC_HH
+
+#include "Point.hh"
+
+/// Largest distance in mm between an arc and the chords it's split into
+#ifndef ARC_CHORD_ERROR
+	#define ARC_CHORD_ERROR		0.01
+#endif
+
+/// Shortest segment in mm an arc is split into, this takes precedence over ARC_CHORD_ERROR
+/// so that tight arcs don't flood the planner with tiny segments
+#ifndef ARC_MIN_SEGMENT_LENGTH
+	#define ARC_MIN_SEGMENT_LENGTH	0.2
+#endif
+
+/// Bits of the flags byte of HOST_CMD_QUEUE_ARC
+#define ARC_FLAG_CCW		0x01	///< Counter clockwise (G3), otherwise clockwise (G2)
+
+/// Expands HOST_CMD_QUEUE_ARC into linear segments for the planner.  The arc is in the
+/// XY plane, Z (helix) and the extruders move linearly along it.  Segments are queued
+/// one at a time with steppers::setTargetNewExt() as the planner has room for them.
+namespace arc {
+
+	/// Start a new arc from the current planner position.  Any arc in progress is abandoned.
+	/// \param[in] target End point in steps, axes in relative are relative to the start
+	/// \param[in] i X offset of the center from the start, in steps
+	/// \param[in] j Y offset of the center from the start, in steps
+	/// \param[in] relative Bit mask of the axes of target which are relative
+	/// \param[in] feedrateMult64 Feed rate in mm/s multiplied by 64
+	/// \param[in] flags ARC_FLAG_ bits
+	void begin(const Point& target, int32_t i, int32_t j, uint8_t relative, int16_t feedrateMult64, uint8_t flags);
+
+	/// returns true if the current arc has segments left to queue
+	bool isActive();
+
+	/// Queue the next segment of the current arc
+	void queueNextSegment();
+
+	/// Abandon the current arc
+	void abort();
+};
+
+#endif // ARC_HH
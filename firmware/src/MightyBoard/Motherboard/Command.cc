@@ -15,6 +15,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>
  */
 
+#include <math.h>
 #include "Command.hh"
 #include "Steppers.hh"
 #include "Commands.hh"
@@ -35,14 +36,63 @@
 #include "stdio.h"
 #include "Menu_locales.hh"
 #include "Version.hh"
+#include "Arc.hh"
 //#include "StepperAxis.hh"
 
 
 namespace command {
 
-#define COMMAND_BUFFER_SIZE 512
-uint8_t buffer_data[COMMAND_BUFFER_SIZE];
-CircularBuffer command_buffer(COMMAND_BUFFER_SIZE, buffer_data);
+CommandBuffer command_buffer;
+
+/// The parameters of a HOST_CMD_QUEUE_POINT_NEW_EXT
+struct move_record {
+	int32_t target[STEPPER_COUNT];
+	int32_t dda_rate;
+	float distance;
+	int16_t feedrateMult64;
+	uint8_t relative;
+};
+
+/// The absolute target of each axis, the relative mask and the feed rate of the last
+/// move command, which HOST_CMD_QUEUE_POINT_DELTA moves are sent against
+int32_t delta_target[STEPPER_COUNT];
+uint8_t delta_relative;
+int16_t delta_feedrateMult64;
+
+#ifdef MOVE_QUEUE_SIZE
+/// Moves decoded out of the command buffer ahead of being planned
+CircularBufferTempl<struct move_record, MOVE_QUEUE_SIZE> move_queue;
+#endif
+
+/// The parameters of a command which can run as an event, see plan_add_event()
+struct event_record {
+	uint8_t command;	/// Host command code
+	union {
+		struct {
+			uint8_t id;
+			uint8_t command;	/// SLAVE_CMD code
+			uint16_t value;
+		} tool;
+		struct {
+			uint8_t red, green, blue;
+			uint8_t blink_rate;
+		} led;
+		struct {
+			uint16_t frequency;
+			uint16_t length;
+		} beep;
+		uint8_t percent;
+		uint8_t song;
+	};
+};
+
+#ifdef EVENT_QUEUE_SIZE
+/// Events waiting on the stepper interrupt to start the block after them
+CircularBufferTempl<struct event_record, EVENT_QUEUE_SIZE> event_queue;
+/// Events run, compared with plan_events_started
+uint8_t events_run;
+#endif
+
 uint8_t currentToolIndex = 0;
 
 uint32_t line_number;
@@ -80,7 +130,13 @@ bool isActivePaused(){
 }
 
 bool isEmpty() {
-	return command_buffer.isEmpty();
+#ifdef MOVE_QUEUE_SIZE
+	if ( ! move_queue.isEmpty() )	return false;
+#endif
+#ifdef EVENT_QUEUE_SIZE
+	if ( ! event_queue.isEmpty() )	return false;
+#endif
+	return command_buffer.isEmpty() && !arc::isActive() && !steppers::segmentPending();
 }
 
 void push(uint8_t byte) {
@@ -99,8 +155,7 @@ int16_t pop16() {
 		struct { 
 			uint8_t data[2];} b;
 	} shared;
-	shared.b.data[0] = command_buffer.pop();
-	shared.b.data[1] = command_buffer.pop();
+	command_buffer.popInto(shared.b.data, 2);
 //	sd_count+=2;
 	return shared.a;
 }
@@ -113,14 +168,142 @@ int32_t pop32() {
 			uint8_t data[4];
 		} b;
 	} shared;
-	shared.b.data[0] = command_buffer.pop();
-	shared.b.data[1] = command_buffer.pop();
-	shared.b.data[2] = command_buffer.pop();
-	shared.b.data[3] = command_buffer.pop();
+	command_buffer.popInto(shared.b.data, 4);
 //	sd_count+=4;
 	return shared.a;
 }
 
+/// Bytes of the HOST_CMD_QUEUE_POINT_DELTA being decoded that are left to pop
+static uint8_t delta_left;
+/// Set when its fields need more bytes than its length gives
+static bool delta_short;
+
+/// Pop a byte of the HOST_CMD_QUEUE_POINT_DELTA being decoded, or 0 once its length is used up
+static uint8_t popDelta8() {
+	if ( delta_left == 0 ) {
+		delta_short = true;
+		return 0;
+	}
+	delta_left--;
+	return pop8();
+}
+
+/// Pop a little endian value of bytes bytes with popDelta8()
+static uint32_t popDeltaLE(uint8_t bytes) {
+	uint32_t value = 0;
+	for (uint8_t i = 0; i < bytes; i++)
+		value |= (uint32_t)popDelta8() << (8 * i);
+	return value;
+}
+
+/// Pop an unsigned little endian base 128 value of up to 5 bytes with popDelta8()
+static uint32_t popDeltaVarint() {
+	uint32_t value = 0;
+	uint8_t shift = 0;
+	uint8_t data;
+	do {
+		data = popDelta8();
+		value |= (uint32_t)(data & 0x7f) << shift;
+		shift += 7;
+	} while (( data & 0x80 ) && ( shift < 35 ));
+	return value;
+}
+
+/// True when the command buffer starts with all the bytes of a
+/// HOST_CMD_QUEUE_POINT_NEW_EXT or HOST_CMD_QUEUE_POINT_DELTA
+static bool moveComplete() {
+	uint16_t length = command_buffer.getLength();
+	if ( length == 0 )	return false;
+	if ( command_buffer[0] == HOST_CMD_QUEUE_POINT_NEW_EXT )	return length >= 32;
+	if ( command_buffer[0] == HOST_CMD_QUEUE_POINT_DELTA )
+		return ( length >= 2 ) && ( length >= 2 + (uint16_t)command_buffer[1] );
+	return false;
+}
+
+/// Pop the body of a HOST_CMD_QUEUE_POINT_DELTA, after the command code, into move.
+/// All of its length is popped, and false returned if its fields didn't fit in it
+static bool decodeDeltaMove(struct move_record &move) {
+	// moveComplete() has seen that all of the length is in the buffer, the fields
+	// are read from no more than that and anything past those we know is skipped
+	delta_left = pop8();
+	delta_short = false;
+	uint8_t flags = popDelta8();
+
+	int32_t delta[STEPPER_COUNT];
+	for (uint8_t i = 0; i < STEPPER_COUNT; i++) {
+		delta[i] = 0;
+		if ( flags & (1 << i) ) {
+			uint32_t zigzag = popDeltaVarint();
+			delta[i] = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+		}
+	}
+
+	move.relative = ( flags & DELTA_FLAG_RELATIVE ) ? popDelta8() : delta_relative;
+	move.feedrateMult64 = ( flags & DELTA_FLAG_FEEDRATE ) ? (int16_t)popDeltaLE(2) : delta_feedrateMult64;
+
+	for (uint8_t i = 0; i < STEPPER_COUNT; i++) {
+		if ( move.relative & (1 << i) )	move.target[i] = delta[i];
+		else				move.target[i] = delta_target[i] + delta[i];
+	}
+
+	if ( flags & DELTA_FLAG_DISTANCE ) {
+		int32_t distanceInt32 = popDeltaLE(4);
+		move.distance = *(float *)&distanceInt32;
+		move.dda_rate = popDeltaVarint();
+	} else {
+		// Derive them as the host does, from the XYZ length of the move or,
+		// for an extruder only move, the longest extruder move
+		float mm[STEPPER_COUNT];
+		uint32_t master_steps = 0;
+		for (uint8_t i = 0; i < STEPPER_COUNT; i++) {
+			int32_t steps = ( move.relative & (1 << i) ) ? delta[i] : move.target[i] - delta_target[i];
+			mm[i] = stepperAxisStepsToMM(steps, i);
+			if ( steps < 0 )	steps = -steps;
+			if ( (uint32_t)steps > master_steps )	master_steps = steps;
+		}
+		move.distance = sqrt(mm[X_AXIS] * mm[X_AXIS] + mm[Y_AXIS] * mm[Y_AXIS] + mm[Z_AXIS] * mm[Z_AXIS]);
+		if ( move.distance == 0.0 )
+			move.distance = ( fabs(mm[A_AXIS]) > fabs(mm[B_AXIS]) ) ? fabs(mm[A_AXIS]) : fabs(mm[B_AXIS]);
+		if ( move.distance == 0.0 )	move.dda_rate = 0;
+		else	move.dda_rate = (int32_t)((float)master_steps * (float)move.feedrateMult64 / (64.0 * move.distance) + 0.5);
+	}
+
+	while ( delta_left > 0 )	popDelta8();
+	return ! delta_short;
+}
+
+/// Take the absolute axes of target as those the next HOST_CMD_QUEUE_POINT_DELTA is sent against
+static void setDeltaTarget(const Point &target, uint8_t relative) {
+	for (uint8_t i = 0; i < STEPPER_COUNT; i++) {
+		if ( ! ( relative & (1 << i) ))	delta_target[i] = target[i];
+	}
+}
+
+/// Pop a complete HOST_CMD_QUEUE_POINT_NEW_EXT or HOST_CMD_QUEUE_POINT_DELTA
+/// off the command buffer into move.  False if it was a HOST_CMD_QUEUE_POINT_DELTA
+/// too short for its fields, which is dropped
+static bool decodeMove(struct move_record &move) {
+	if ( pop8() == HOST_CMD_QUEUE_POINT_DELTA ) {
+		if ( ! decodeDeltaMove(move) )	return false;
+	} else {
+		for (uint8_t i = 0; i < STEPPER_COUNT; i++) {
+			move.target[i] = pop32();
+		}
+		move.dda_rate = pop32();
+		move.relative = pop8();
+		int32_t distanceInt32 = pop32();
+		move.distance = *(float *)&distanceInt32;
+		move.feedrateMult64 = pop16();
+	}
+
+	for (uint8_t i = 0; i < STEPPER_COUNT; i++) {
+		if ( ! ( move.relative & (1 << i) ))	delta_target[i] = move.target[i];
+	}
+	delta_relative = move.relative;
+	delta_feedrateMult64 = move.feedrateMult64;
+	return true;
+}
+
 enum CommandState{
 	READY,
 	MOVING,
@@ -133,6 +316,11 @@ enum CommandState{
 
 Timeout command_buffer_timeout;
 
+#ifdef COALESCE_SEGMENTS
+/// Started when a move is held back for coalescing and no commands are waiting
+Timeout coalesce_timeout;
+#endif
+
 /// Bitmap of button pushes to wait for
 uint8_t button_mask;
 enum {
@@ -148,6 +336,19 @@ bool sdcard_reset = false;
 
 void reset() {
 	command_buffer.reset();
+#ifdef MOVE_QUEUE_SIZE
+	move_queue.reset();
+#endif
+#ifdef EVENT_QUEUE_SIZE
+	event_queue.reset();
+	plan_discard_events();
+	events_run = plan_events_started;
+#endif
+	arc::abort();
+	for (uint8_t i = 0; i < STEPPER_COUNT; i++)
+		delta_target[i] = 0;
+	delta_relative = 0;
+	delta_feedrateMult64 = 0;
 	line_number = 0;
 	check_temp_state = false;
 	paused = false;
@@ -163,7 +364,10 @@ bool isWaiting(){
 }
     
 bool isReady() {
-	return (mode == READY);
+#ifdef MOVE_QUEUE_SIZE
+	if ( ! move_queue.isEmpty() )	return false;
+#endif
+	return (mode == READY) && !arc::isActive();
 }
 
 uint32_t getLineNumber() {
@@ -305,6 +509,38 @@ void ActivePause(bool on, SleepType type){
 	}	
 }
 
+static void runMove(const struct move_record &move) {
+	Motherboard::getBoard().resetUserInputTimeout();
+	mode = MOVING;
+	line_number++;
+
+	const int32_t *t = move.target;
+	steppers::setTargetNewExt(Point(t[0],t[1],t[2],t[3],t[4]), move.dda_rate, move.relative,
+				  move.distance, move.feedrateMult64);
+}
+
+#ifdef MOVE_QUEUE_SIZE
+
+/// Decode the moves at the head of the command buffer into the move queue once all their
+/// bytes are in, freeing the command buffer for more.  Only moves at the head are decoded,
+/// so commands still run in the order they arrived.
+static void decodeMoves() {
+	while (( move_queue.getRemainingCapacity() > 0 ) && moveComplete() ) {
+		struct move_record move;
+		if ( decodeMove(move) )	move_queue.push(move);
+	}
+}
+
+/// Plan decoded moves until the move queue is empty or the planner is full
+static void runMoves() {
+	do {
+		runMove(move_queue[0]);
+		move_queue.pop(1);
+	} while (( ! move_queue.isEmpty() ) && ( ! steppers::isRunning() ));
+}
+
+#endif
+
 static void handleMovementCommand(const uint8_t &command) {
 
 	if (command == HOST_CMD_QUEUE_POINT_EXT) {
@@ -323,7 +559,9 @@ static void handleMovementCommand(const uint8_t &command) {
 
 			line_number++;
 		
-			steppers::setTarget(Point(x,y,z,a,b), dda);
+			Point target(x,y,z,a,b);
+			setDeltaTarget(target, 0);
+			steppers::setTarget(target, dda);
 		}
 	}
 	else if (command == HOST_CMD_QUEUE_POINT_NEW) {
@@ -343,41 +581,53 @@ static void handleMovementCommand(const uint8_t &command) {
 
 			line_number++;
 			
-			steppers::setTargetNew(Point(x,y,z,a,b), us, relative);
+			Point target(x,y,z,a,b);
+			setDeltaTarget(target, relative);
+			steppers::setTargetNew(target, us, relative);
 		}
-	}else if (command == HOST_CMD_QUEUE_POINT_NEW_EXT ) {
+	}else if (command == HOST_CMD_QUEUE_POINT_NEW_EXT || command == HOST_CMD_QUEUE_POINT_DELTA ) {
+#ifndef MOVE_QUEUE_SIZE
 	        // check for completion
-	        if (command_buffer.getLength() >= 32) {
+	        if ( moveComplete() ) {
+			struct move_record move;
+			if ( decodeMove(move) )	runMove(move);
+		}
+#endif
+		// otherwise decodeMoves() takes it once it's complete
+	}else if (command == HOST_CMD_QUEUE_ARC ) {
+		// check for completion
+		if (command_buffer.getLength() >= 33) {
 			Motherboard::getBoard().resetUserInputTimeout();
 			pop8(); // remove the command code
 			mode = MOVING;
-	 
+
 			int32_t x = pop32();
 			int32_t y = pop32();
 			int32_t z = pop32();
 			int32_t a = pop32();
 			int32_t b = pop32();
-			int32_t dda_rate = pop32();
+			int32_t i = pop32();
+			int32_t j = pop32();
 			uint8_t relative = pop8();
-			int32_t distanceInt32 = pop32();
-			float *distance = (float *)&distanceInt32;
 			int16_t feedrateMult64 = pop16();
-	 
+			uint8_t flags = pop8();
+
 			line_number++;
-	            
-			steppers::setTargetNewExt(Point(x,y,z,a,b), dda_rate, relative, *distance, feedrateMult64);
-		}  
+
+			Point target(x,y,z,a,b);
+			setDeltaTarget(target, relative);
+			// The remaining segments are queued from runCommandSlice() as the planner makes room
+			arc::begin(target, i, j, relative, feedrateMult64, flags);
+			arc::queueNextSegment();
+		}
 	}
 }
 
 bool start_build_flag = false;
 bool platform_on_flag = false;
 
-bool processExtruderCommandPacket() {
+static void runExtruderCommand(uint8_t id, uint8_t command, uint16_t value) {
 	Motherboard& board = Motherboard::getBoard();
-	uint8_t	id = pop8();
-	uint8_t command = pop8();
-	pop8(); //uint8_t length = pop8();
 
 	switch (command) {
 		case SLAVE_CMD_SET_TEMP:
@@ -392,7 +642,7 @@ bool processExtruderCommandPacket() {
 				platform_on_flag = false;
 				start_build_flag = false;
 			}
-			board.getExtruderBoard(id).getExtruderHeater().set_target_temperature(pop16());
+			board.getExtruderBoard(id).getExtruderHeater().set_target_temperature(value);
 
 			/// if platform is actively heating and extruder is not cooling down, pause extruder
 			if(board.getPlatformHeater().isHeating() && !board.getPlatformHeater().isCooling() && !board.getExtruderBoard(id).getExtruderHeater().isCooling()){
@@ -408,21 +658,21 @@ bool processExtruderCommandPacket() {
 				board.errorResponse(ERROR_INVALID_TOOL);
 				board.getExtruderBoard(id).getExtruderHeater().set_target_temperature(0);
 			}
-			return true;
+			break;
 		// can be removed in process via host query works OK
  		case SLAVE_CMD_PAUSE_UNPAUSE:
 			host::pauseBuild(!command::isPaused());
-			return true;
+			break;
 		case SLAVE_CMD_TOGGLE_FAN:
-			board.getExtruderBoard(id).setFan((pop8() & 0x01) != 0);
-			return true;
+			board.getExtruderBoard(id).setFan((value & 0x01) != 0);
+			break;
 		case SLAVE_CMD_TOGGLE_VALVE:
-			board.setExtra((pop8() & 0x01) != 0);
-			return true;
+			board.setExtra((value & 0x01) != 0);
+			break;
 		case SLAVE_CMD_SET_PLATFORM_TEMP:
 			board.setUsingPlatform(true);
 			if(start_build_flag){ platform_on_flag = true;}
-			board.getPlatformHeater().set_target_temperature(pop16());
+			board.getPlatformHeater().set_target_temperature(value);
 			// pause extruder heaters platform is heating up
 			bool pause_state; /// avr-gcc doesn't allow cross-initializtion of variables within a switch statement
 			pause_state = false;
@@ -440,41 +690,119 @@ bool processExtruderCommandPacket() {
 				board.getPlatformHeater().set_target_temperature(0);      
 				board.setUsingPlatform(false);
 			}
-			return true;
+			break;
+	}
+}
+
+static void runEvent(const struct event_record &event) {
+	switch (event.command) {
+		case HOST_CMD_TOOL_COMMAND:
+			runExtruderCommand(event.tool.id, event.tool.command, event.tool.value);
+			break;
+		case HOST_CMD_SET_RGB_LED:
+			RGB_LED::setLEDBlink(event.led.blink_rate);
+			RGB_LED::setCustomColor(event.led.red, event.led.green, event.led.blue);
+			break;
+		case HOST_CMD_SET_BEEP:
+			Piezo::setTone(event.beep.frequency, event.beep.length);
+			break;
+		case HOST_CMD_SET_BUILD_PERCENT:
+			interface::setBuildPercentage(event.percent);
+			break;
+		case HOST_CMD_QUEUE_SONG:
+			Piezo::playTune(event.song);
+			break;
+	}
+}
+
+#ifdef EVENT_QUEUE_SIZE
+
+/// Run the event now if nothing is moving, otherwise attach it to the next block planned
+static void queueEvent(const struct event_record &event) {
+	if ( event_queue.isEmpty() && st_empty() ) {
+		runEvent(event);
+	} else {
+		event_queue.push(event);
+		plan_add_event();
+	}
+}
+
+/// Run the events whose blocks the stepper interrupt has started.  Once the planner has
+/// emptied, the rest followed the last move and run too.
+static void runEvents() {
+	while (( ! event_queue.isEmpty() ) && ( plan_events_started != events_run )) {
+		runEvent(event_queue[0]);
+		event_queue.pop(1);
+		events_run++;
+	}
+	if (( ! event_queue.isEmpty() ) && st_empty() ) {
+		plan_discard_events();
+		while ( ! event_queue.isEmpty() ) {
+			runEvent(event_queue[0]);
+			event_queue.pop(1);
+		}
+	}
+	// Nothing can be attached to a block now, so this doesn't miss any
+	if ( event_queue.isEmpty() ) {
+		events_run = plan_events_started;
+	}
+}
+
+/// Commands run as events
+static bool isEventCommand(uint8_t command) {
+	return (command == HOST_CMD_TOOL_COMMAND) ||
+		(command == HOST_CMD_SET_RGB_LED) ||
+		(command == HOST_CMD_SET_BEEP) ||
+		(command == HOST_CMD_SET_BUILD_PERCENT) ||
+		(command == HOST_CMD_QUEUE_SONG);
+}
+
+#else
+
+static void queueEvent(const struct event_record &event) {
+	runEvent(event);
+}
+
+#endif
+
+void processExtruderCommandPacket() {
+	struct event_record event;
+	event.command = HOST_CMD_TOOL_COMMAND;
+	event.tool.id = pop8();
+	event.tool.command = pop8();
+	pop8(); //uint8_t length = pop8();
+
+	switch (event.tool.command) {
+		case SLAVE_CMD_SET_TEMP:
+		case SLAVE_CMD_SET_PLATFORM_TEMP:
+			event.tool.value = pop16();
+			break;
+		case SLAVE_CMD_PAUSE_UNPAUSE:
+			event.tool.value = 0;
+			break;
+		case SLAVE_CMD_TOGGLE_FAN:
+		case SLAVE_CMD_TOGGLE_VALVE:
+			event.tool.value = pop8();
+			break;
 		// not being used with 5D
 		case SLAVE_CMD_TOGGLE_MOTOR_1:
-			pop8();
-			return true;
-		// not being used with 5D
 		case SLAVE_CMD_TOGGLE_MOTOR_2: 
-			pop8();
-			return true;
 		case SLAVE_CMD_SET_MOTOR_1_PWM:
-			pop8();
-			return true;
 		case SLAVE_CMD_SET_MOTOR_2_PWM:
-			pop8();
-			return true;
 		case SLAVE_CMD_SET_MOTOR_1_DIR:
-			pop8();
-			return true;
 		case SLAVE_CMD_SET_MOTOR_2_DIR:
+		case SLAVE_CMD_SET_SERVO_1_POS:
+		case SLAVE_CMD_SET_SERVO_2_POS:
 			pop8();
-			return true;
+			return;
 		case SLAVE_CMD_SET_MOTOR_1_RPM:
-			pop32();
-			return true;
 		case SLAVE_CMD_SET_MOTOR_2_RPM:
 			pop32();
-			return true;
-		case SLAVE_CMD_SET_SERVO_1_POS:
-			pop8();
-			return true;
-		case SLAVE_CMD_SET_SERVO_2_POS:
-			pop8();
-			return true;
+			return;
+		default:
+			return;
 	}
-	return false;
+	queueEvent(event);
 }
 
 // A fast slice for processing commands and refilling the stepper queue, etc.
@@ -495,6 +823,15 @@ void runCommandSlice() {
 			/// temporary behavior until we get a method to restart the build
 			steppers::abort();
 			command_buffer.reset();
+#ifdef MOVE_QUEUE_SIZE
+			move_queue.reset();
+#endif
+#ifdef EVENT_QUEUE_SIZE
+			event_queue.reset();
+			plan_discard_events();
+			events_run = plan_events_started;
+#endif
+			arc::abort();
 
 			// cool heaters
 			Motherboard &board = Motherboard::getBoard();
@@ -531,6 +868,10 @@ void runCommandSlice() {
 		}
 	}
 	
+#ifdef MOVE_QUEUE_SIZE
+	decodeMoves();
+#endif
+
 	// if printer is not waiting for tool or platform to heat, we need to make
 	// sure the extruders are not in a paused state.  this is relevant when 
 	// heating using the control panel in desktop software
@@ -544,6 +885,10 @@ void runCommandSlice() {
 	}
 	// don't execute commands if paused or shutdown because of heater failure
 	if (paused || heat_shutdown) {	return; }
+
+#ifdef EVENT_QUEUE_SIZE
+	runEvents();
+#endif
     
 	if (mode == HOMING) {
 		if (!steppers::isRunning()) {
@@ -618,6 +963,31 @@ void runCommandSlice() {
 	
 
 	if (mode == READY) {
+
+#ifdef COALESCE_SEGMENTS
+		// Plan a move held back for coalescing unless the next command is a move it
+		// might merge with.  Don't hold it if the planner has run dry, or for more than
+		// COALESCE_TIMEOUT waiting for a command.  Planning it waits for room in the
+		// planner, as the moves do.
+		if ( steppers::segmentPending() && ( ! steppers::isRunning() )) {
+			if ( active_paused || st_empty() ) {
+				steppers::flushSegment();
+#ifdef MOVE_QUEUE_SIZE
+			} else if ( ! move_queue.isEmpty() ) {
+				coalesce_timeout.abort();
+#endif
+			} else if ( command_buffer.getLength() > 0 ) {
+				coalesce_timeout.abort();
+				if (( command_buffer[0] != HOST_CMD_QUEUE_POINT_NEW_EXT ) &&
+				    ( command_buffer[0] != HOST_CMD_QUEUE_POINT_DELTA ))
+					steppers::flushSegment();
+			} else if ( ! coalesce_timeout.isActive() ) {
+				coalesce_timeout.start(COALESCE_TIMEOUT);
+			} else if ( coalesce_timeout.hasElapsed() ) {
+				steppers::flushSegment();
+			}
+		}
+#endif
 		
 		/// motion capable pause
 		/// this loop executes cold heat pausing and restart
@@ -723,7 +1093,8 @@ void runCommandSlice() {
 				command_buffer_timeout.start(USER_INPUT_TIMEOUT);
 				sleep_mode = SLEEP_RETURN;
 			// when heaters are hot, return to print
-			}else if (sleep_mode == SLEEP_RETURN){
+			// stopSleep() sets the position, so it waits for any position change still queued
+			}else if ((sleep_mode == SLEEP_RETURN) && ( ! plan_position_resync_busy() )){
 				Motherboard::getBoard().StopProgressBar();
 				stopSleep();
 				sleep_mode = SLEEP_FINISHED;
@@ -737,6 +1108,21 @@ void runCommandSlice() {
 
 		}
 		
+		// finish queueing the current arc before moving on to the next command
+		if (arc::isActive()) {
+			mode = MOVING;
+			if ( ! steppers::isRunning() )	arc::queueNextSegment();
+			return;
+		}
+
+#ifdef MOVE_QUEUE_SIZE
+		// plan the decoded moves before the commands that followed them
+		if ( ! move_queue.isEmpty() ) {
+			if ( ! steppers::isRunning() )	runMoves();
+			return;
+		}
+#endif
+
 		// process next command on the queue.
 		if ((command_buffer.getLength() > 0)){
 			Motherboard::getBoard().resetUserInputTimeout();
@@ -751,6 +1137,8 @@ void runCommandSlice() {
 			if ((command != HOST_CMD_QUEUE_POINT_EXT) &&
 					(command != HOST_CMD_QUEUE_POINT_NEW) &&
 					(command != HOST_CMD_QUEUE_POINT_NEW_EXT) &&
+					(command != HOST_CMD_QUEUE_POINT_DELTA) &&
+					(command != HOST_CMD_QUEUE_ARC) &&
 					(command != HOST_CMD_ENABLE_AXES ) &&
 					(command != HOST_CMD_SET_BUILD_PERCENT ) &&
 					(command != HOST_CMD_CHANGE_TOOL ) &&
@@ -759,12 +1147,48 @@ void runCommandSlice() {
 					(command != HOST_CMD_RECALL_HOME_POSITION) &&
 					(command != HOST_CMD_FIND_AXES_MINIMUM) &&
 					(command != HOST_CMD_FIND_AXES_MAXIMUM) &&
+#ifdef EVENT_QUEUE_SIZE
+					( ! isEventCommand(command) )){
+#else
 					(command != HOST_CMD_TOOL_COMMAND)){
+#endif
 				if ( ! st_empty() )     return;
+#ifdef EVENT_QUEUE_SIZE
+				//The steppers may have run dry since runEvents(), the queued events it
+				//would now run go first
+				if ( ! event_queue.isEmpty() )	return;
+#endif
 			}
 
+#ifdef EVENT_QUEUE_SIZE
+			//Events wait for room in the event queue instead
+			if ( isEventCommand(command) && ( event_queue.getRemainingCapacity() == 0 ))	return;
+#endif
+
+			//Position changes are also pipelined, but only one large change can be
+			//waiting for the steppers at a time
+			if (((command == HOST_CMD_SET_POSITION_EXT) || (command == HOST_CMD_RECALL_HOME_POSITION)) &&
+			    ( plan_position_resync_busy() ))	return;
+
+			//Moves wait for room in the planner.  The mode is only MOVING after a move, and a
+			//move held back for coalescing can be planned by other commands, so it's checked here
+			if ( steppers::isRunning() &&
+			     ((command == HOST_CMD_QUEUE_POINT_EXT) || (command == HOST_CMD_QUEUE_POINT_NEW) ||
+			      (command == HOST_CMD_QUEUE_POINT_NEW_EXT) || (command == HOST_CMD_QUEUE_POINT_DELTA) ||
+			      (command == HOST_CMD_QUEUE_ARC)))
+				return;
+
+#ifdef COALESCE_SEGMENTS
+			//These plan a move held back for coalescing, so they also wait for room
+			if ( steppers::isRunning() && steppers::segmentPending() &&
+			     ((command == HOST_CMD_CHANGE_TOOL) || (command == HOST_CMD_SET_POSITION_EXT) ||
+			      (command == HOST_CMD_RECALL_HOME_POSITION) || (command == HOST_CMD_SET_ACCELERATION_TOGGLE)))
+				return;
+#endif
+
 			if (command == HOST_CMD_QUEUE_POINT_EXT || command == HOST_CMD_QUEUE_POINT_NEW ||
-					command == HOST_CMD_QUEUE_POINT_NEW_EXT) {
+					command == HOST_CMD_QUEUE_POINT_NEW_EXT || command == HOST_CMD_QUEUE_POINT_DELTA ||
+					command == HOST_CMD_QUEUE_ARC) {
 				handleMovementCommand(command);
 			}  else if (command == HOST_CMD_CHANGE_TOOL) {
 				if (command_buffer.getLength() >= 2) {
@@ -836,7 +1260,9 @@ void runCommandSlice() {
 					int32_t b = pop32();
 					line_number++;
 					
-					steppers::definePosition(Point(x,y,z,a,b));
+					Point position(x,y,z,a,b);
+					setDeltaTarget(position, 0);
+					steppers::definePosition(position);
 				}
 			} else if (command == HOST_CMD_DELAY) {
 				if (command_buffer.getLength() >= 5) {
@@ -1014,25 +1440,28 @@ void runCommandSlice() {
 				if (command_buffer.getLength() >= 6) {
 					pop8(); // remove the command code
 
-					uint8_t red = pop8();
-					uint8_t green = pop8();
-					uint8_t blue = pop8();
-					uint8_t blink_rate = pop8();
+					struct event_record event;
+					event.command = command;
+					event.led.red = pop8();
+					event.led.green = pop8();
+					event.led.blue = pop8();
+					event.led.blink_rate = pop8();
 
 					pop8(); //uint8_t effect = pop8();
 					line_number++;
-					RGB_LED::setLEDBlink(blink_rate);
-					RGB_LED::setCustomColor(red, green, blue);
+					queueEvent(event);
 
 				}
 			} else if (command == HOST_CMD_SET_BEEP){
 				if (command_buffer.getLength() >= 6) {
 					pop8(); // remove the command code
-					uint16_t frequency= pop16();
-					uint16_t beep_length = pop16();
+					struct event_record event;
+					event.command = command;
+					event.beep.frequency = pop16();
+					event.beep.length = pop16();
 					pop8(); //uint8_t effect = pop8();
 					line_number++;
-					Piezo::setTone(frequency, beep_length);
+					queueEvent(event);
 
 				}
 			} else if (command == HOST_CMD_TOOL_COMMAND) {
@@ -1047,10 +1476,12 @@ void runCommandSlice() {
 			} else if (command == HOST_CMD_SET_BUILD_PERCENT){
 				if (command_buffer.getLength() >= 3){
 					pop8(); // remove the command code
-					uint8_t percent = pop8();
+					struct event_record event;
+					event.command = command;
+					event.percent = pop8();
 					pop8(); // remove the reserved byte
 					line_number++;
-					interface::setBuildPercentage(percent);
+					queueEvent(event);
 				}
 			} else if (command == HOST_CMD_QUEUE_SONG ) //queue a song for playing
  			{
@@ -1059,9 +1490,11 @@ void runCommandSlice() {
 				/// all other tones user-defined (defaults to end-tone)
 				if (command_buffer.getLength() >= 2){
 					pop8(); // remove the command code
-					uint8_t songId = pop8();
+					struct event_record event;
+					event.command = command;
+					event.song = pop8();
 					line_number++;
-					Piezo::playTune(songId);
+					queueEvent(event);
 				}
 
 			} else if ( command == HOST_CMD_RESET_TO_FACTORY) {
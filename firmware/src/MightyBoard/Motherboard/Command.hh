@@ -19,10 +19,15 @@
 #define COMMAND_HH_
 
 #include <stdint.h>
+#include "CircularBuffer.hh"
 
 /// The command namespace contains functions that handle the incoming command
 /// queue, for both SD and serial jobs.
 namespace command {
+
+/// The command buffer, its size must be a power of 2
+#define COMMAND_BUFFER_SIZE 512
+typedef CircularBufferTempl<uint8_t, COMMAND_BUFFER_SIZE> CommandBuffer;
 	
 enum SleepType{
 	SLEEP_TYPE_COLD,
@@ -221,8 +221,26 @@ void setDefaultsAcceleration()
     eeprom_write_word((uint16_t *)(eeprom_offsets::ACCELERATION2_SETTINGS + acceleration2_eeprom_offsets::EXTRUDER_DEPRIME_STEPS + sizeof(uint16_t)*1), DEFAULT_EXTRUDER_DEPRIME_STEPS_B);
  
     eeprom_write_byte((uint8_t *) (eeprom_offsets::ACCELERATION2_SETTINGS + acceleration2_eeprom_offsets::SLOWDOWN_FLAG), DEFAULT_SLOWDOWN_FLAG);
+
+    setDefaultsAccelerationAdded();
+}
+
+/**
+ * Writes the defaults of the acceleration settings added since bit 7 alone
+ * was written to DEFAULTS_FLAG, leaving the others alone, and marks the
+ * settings as of ACCELERATION_SETTINGS_VERSION
+ */
+void setDefaultsAccelerationAdded()
+{
+    eeprom_write_word((uint16_t *)(eeprom_offsets::ACCELERATION2_SETTINGS + acceleration2_eeprom_offsets::JUNCTION_DEVIATION), DEFAULT_JUNCTION_DEVIATION);
+
+    eeprom_write_word((uint16_t *)(eeprom_offsets::ACCELERATION2_SETTINGS + acceleration2_eeprom_offsets::SLOWDOWN_TIME), DEFAULT_SLOWDOWN_TIME);
+
+    eeprom_write_byte((uint8_t *) (eeprom_offsets::ACCELERATION2_SETTINGS + acceleration2_eeprom_offsets::INPUT_SHAPER_TYPE), DEFAULT_INPUT_SHAPER_TYPE);
+    eeprom_write_word((uint16_t *)(eeprom_offsets::ACCELERATION2_SETTINGS + acceleration2_eeprom_offsets::INPUT_SHAPER_FREQUENCY), DEFAULT_INPUT_SHAPER_FREQUENCY);
+    eeprom_write_word((uint16_t *)(eeprom_offsets::ACCELERATION2_SETTINGS + acceleration2_eeprom_offsets::INPUT_SHAPER_DAMPING), DEFAULT_INPUT_SHAPER_DAMPING);
  
-    eeprom_write_byte((uint8_t *) (eeprom_offsets::ACCELERATION_SETTINGS + acceleration_eeprom_offsets::DEFAULTS_FLAG), _BV(ACCELERATION_INIT_BIT));
+    eeprom_write_byte((uint8_t *) (eeprom_offsets::ACCELERATION_SETTINGS + acceleration_eeprom_offsets::DEFAULTS_FLAG), _BV(ACCELERATION_INIT_BIT) | ACCELERATION_SETTINGS_VERSION);
 }  
 
 /// Writes to EEPROM the default toolhead 'home' values to idicate toolhead offset
@@ -357,7 +357,18 @@ const static uint16_t FREE_EEPROM_STARTS        = 0x0252;
  
 #define DEFAULT_SLOWDOWN_FLAG 0x01
  
+#define DEFAULT_JUNCTION_DEVIATION 0		// In microns, 0 selects max speed change (YAJ) cornering
+ 
+#define DEFAULT_SLOWDOWN_TIME 250		// In milliseconds of queued moves
+ 
+#define DEFAULT_INPUT_SHAPER_TYPE 0		// 0 = off, 1 = ZV, 2 = ZVD
+#define DEFAULT_INPUT_SHAPER_FREQUENCY 400	// In 0.1Hz, 40.0Hz
+#define DEFAULT_INPUT_SHAPER_DAMPING 100	// Damping ratio multiplied by 1000, 0.100
+ 
 #define ACCELERATION_INIT_BIT 7
+// Kept in the low bits of DEFAULTS_FLAG.  1 has the junction deviation, slowdown time and input
+// shaper settings, which are in acceleration2 bytes that were FUTURE_USE and may hold old data
+#define ACCELERATION_SETTINGS_VERSION 1
  
 namespace acceleration_eeprom_offsets{
  
@@ -378,7 +389,7 @@ namespace acceleration_eeprom_offsets{
     const static uint16_t MAX_ACCELERATION_EXTRUDER_MOVE    = 0x18; //uint16_t
     //$BEGIN_ENTRY
     //$type:B $constraints:a $ignore:True
-    const static uint16_t DEFAULTS_FLAG         = 0x1A; //uint8_t Bit 7 == 1 is defaults written
+    const static uint16_t DEFAULTS_FLAG         = 0x1A; //uint8_t Bit 7 == 1 is defaults written, bits 0-6 the settings version
 }
 
 namespace acceleration2_eeprom_offsets{
@@ -394,7 +405,22 @@ namespace acceleration2_eeprom_offsets{
     //$BEGIN_ENTRY
     //$type:B $constraints:l,0,1
     const static uint16_t SLOWDOWN_FLAG         = 0x0C; //uint8_t Bit 0 == 1 is slowdown enabled
-    const static uint16_t FUTURE_USE            = 0x0E; //18 bytes for future use
+    //$BEGIN_ENTRY
+    //$type:H $constraints:a $unit:µm $tooltip:Junction deviation used to set cornering speeds.  0 uses the max speed changes instead.
+    const static uint16_t JUNCTION_DEVIATION    = 0x0E; //uint16_t
+    //$BEGIN_ENTRY
+    //$type:H $constraints:a $unit:ms $tooltip:Slow down when the queued moves would take less than this long to print.  Doubled when printing over USB.
+    const static uint16_t SLOWDOWN_TIME         = 0x10; //uint16_t
+    //$BEGIN_ENTRY
+    //$type:B $constraints:l,0,2 $tooltip:Input shaping of X and Y moves.  0 is off, 1 is ZV and 2 is ZVD.
+    const static uint16_t INPUT_SHAPER_TYPE     = 0x12; //uint8_t
+    //$BEGIN_ENTRY
+    //$type:H $constraints:a $unit:0.1Hz $tooltip:Frequency of the X and Y resonance cancelled by the input shaper.
+    const static uint16_t INPUT_SHAPER_FREQUENCY = 0x14; //uint16_t
+    //$BEGIN_ENTRY
+    //$type:H $constraints:m,0,999 $tooltip:Damping ratio of the X and Y resonance multiplied by 1000.
+    const static uint16_t INPUT_SHAPER_DAMPING  = 0x16; //uint16_t
+    const static uint16_t FUTURE_USE            = 0x18; //4 bytes for future use
     //0x1C is end of acceleration2 settings (28 bytes long)
 }
 
@@ -553,6 +579,7 @@ namespace eeprom {
   bool isSingleTool();
   bool hasHBP();
   void setDefaultsAcceleration();
+  void setDefaultsAccelerationAdded();
   void storeToolheadToleranceDefaults();
   void updateBuildTime(uint8_t new_hours, uint8_t new_minutes);
   void setDefaultAxisHomePositions();
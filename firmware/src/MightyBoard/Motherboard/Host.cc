@@ -17,6 +17,7 @@
  
 #include "Host.hh"
 #include "Command.hh"
+#include "HostBatch.hh"
 #include <string.h>
 #include "Commands.hh"
 #include "Steppers.hh"
@@ -221,10 +222,16 @@ bool processCommandPacket(const InPacket& from_host, OutPacket& to_host) {
 	if (from_host.getLength() >= 1) {
 		uint8_t command = from_host.read8(0);
 		if ((command & 0x80) != 0) {
+#ifdef BATCH_PACKET_PAYLOAD
+			// A batch's commands follow its command code
+			const uint8_t start = (command == HOST_CMD_QUEUE_BATCH) ? 1 : 0;
+#else
+			const uint8_t start = 0;
+#endif
 			// If we're capturing a file to an SD card, we send it to the sdcard module
 			// for processing.
 			if (sdcard::isCapturing()) {
-				sdcard::capturePacket(from_host);
+				sdcard::capturePacket(from_host, start);
 				to_host.append8(RC_OK);
 				return true;
 			}
@@ -235,20 +242,17 @@ bool processCommandPacket(const InPacket& from_host, OutPacket& to_host) {
 				return true;
 			}
 			
-			// Queue command, if there's room.
-			// Turn off interrupts while querying or manipulating the queue!
-			ATOMIC_BLOCK(ATOMIC_FORCEON) {
-				const uint8_t command_length = from_host.getLength();
-				if (command::getRemainingCapacity() >= command_length) {
-					// Append command to buffer
-					for (int i = 0; i < command_length; i++) {
-						command::push(from_host.read8(i));
-					}
-					to_host.append8(RC_OK);
-				} else {
-					to_host.append8(RC_BUFFER_OVERFLOW);
-				}
+			// Queue command, if there's room
+			if (queuePacketCommands<command::getRemainingCapacity, command::push>(from_host, start)) {
+				to_host.append8(RC_OK);
+			} else {
+				to_host.append8(RC_BUFFER_OVERFLOW);
 			}
+#ifdef BATCH_PACKET_PAYLOAD
+			// So the host can send the next batch without asking
+			if ( start )
+				to_host.append32(command::getRemainingCapacity());
+#endif
 			return true;
 		}
 	}
@@ -474,7 +478,7 @@ void handleExtendedStop(const InPacket& from_host, OutPacket& to_host) {
 }
 
     //set build name and build state
-void handleBuildStartNotification(CircularBuffer& buf) {
+void handleBuildStartNotification(command::CommandBuffer& buf) {
 	
 	uint8_t idx = 0;
 	char newName[MAX_FILE_LEN];
@@ -545,6 +549,43 @@ void handleGetBoardStatus(OutPacket& to_host) {
 	to_host.append8(board.GetBoardStatus());
 }
 
+#ifdef MOTION_STATS
+/// planner and stepper interrupt counters, see motion_stats_t
+/// if bit 0 of the flags byte is set, the counters are reset after they're read
+void handleGetMotionStats(const InPacket& from_host, OutPacket& to_host) {
+	motion_stats_t stats;
+	ATOMIC_BLOCK(ATOMIC_FORCEON) {
+		memcpy(&stats, (const void *)&motion_stats, sizeof(stats));
+	}
+	if ( from_host.read8(1) & 0x01 )
+		motionStatsReset();
+
+	// average occupancy as 8.8 fixed point
+	uint32_t sum = stats.occupancy_sum;
+	uint32_t count = stats.handovers;
+	while ( sum >= (1UL << 24) ) {
+		sum >>= 1;
+		count >>= 1;
+	}
+	uint16_t avg = count ? (uint16_t)((sum << 8) / count) : 0;
+
+	// STEPPER_TIMER_PRESCALER cpu cycles to each timer tick
+	uint32_t isr_max_cycles = (uint32_t)stats.isr_max_ticks * STEPPER_TIMER_PRESCALER;
+	if ( isr_max_cycles > 0xFFFF )	isr_max_cycles = 0xFFFF;
+
+	to_host.append8(RC_OK);
+	to_host.append8(stats.occupancy_min);
+	to_host.append16(avg);
+	to_host.append16(stats.underruns);
+	to_host.append32(stats.recalculations);
+	to_host.append16((uint16_t)isr_max_cycles);
+	for (uint8_t i = 0; i < 4; i++) {
+		to_host.append32(stats.step_loops[i]);
+	}
+	to_host.append32(stats.prefetched);
+}
+#endif
+
 // query packets (non action, not queued)
 bool processQueryPacket(const InPacket& from_host, OutPacket& to_host) {
 	if (from_host.getLength() >= 1) {
@@ -626,6 +667,11 @@ bool processQueryPacket(const InPacket& from_host, OutPacket& to_host) {
 			case HOST_CMD_ADVANCED_VERSION:
 				handleGetAdvancedVersion(from_host, to_host);
 				return true;
+#ifdef MOTION_STATS
+			case HOST_CMD_GET_MOTION_STATS:
+				handleGetMotionStats(from_host, to_host);
+				return true;
+#endif
 			}
 		}
 	}
@@ -81,7 +81,7 @@ void startOnboardBuild(uint8_t  build);
 void stopBuild();
 
 /// set build state and build name
-void handleBuildStartNotification(CircularBuffer& buf);
+void handleBuildStartNotification(command::CommandBuffer& buf);
 
 /// set build state
 void handleBuildStopNotification(uint8_t stopFlags);
@@ -0,0 +1,39 @@
+#ifndef HOSTBATCH_HH_
+#define HOSTBATCH_HH_
+
+// Queueing of the commands in a host packet, for processCommandPacket() in Host.cc.
+//
+// A packet holds one command or, after a HOST_CMD_QUEUE_BATCH code, several.  The
+// bytes from start on are queued all or none: remaining() is read once, and only the
+// command interpreter frees room, so once there's room it stays there.  The bytes are
+// pushed a few at a time with interrupts off, rather than all of a batch in one go.
+// simulator/batchtest checks it with a CircularBuffer for the command buffer.
+
+#include <stdint.h>
+
+#ifdef SIMULATOR
+	#define BATCH_ATOMIC_BLOCK(type)
+#else
+	#include <util/atomic.h>
+	#define BATCH_ATOMIC_BLOCK(type)	ATOMIC_BLOCK(type)
+#endif
+
+/// Bytes pushed for each time interrupts are turned off
+#define BATCH_PUSH_CHUNK 8
+
+/// Push the bytes of packet from start on with push() if remaining() has room for
+/// all of them.  False, with nothing pushed, if it hasn't.
+template <uint16_t (*remaining)(), void (*push)(uint8_t), class PACKET>
+bool queuePacketCommands(const PACKET &packet, uint8_t start) {
+	if ( remaining() < (uint16_t)(packet.getLength() - start) )
+		return false;
+	for (uint8_t i = start; i < packet.getLength(); ) {
+		BATCH_ATOMIC_BLOCK(ATOMIC_FORCEON) {
+			for (uint8_t n = 0; (n < BATCH_PUSH_CHUNK) && (i < packet.getLength()); n++, i++)
+				push(packet.read8(i));
+		}
+	}
+	return true;
+}
+
+#endif // HOSTBATCH_HH_
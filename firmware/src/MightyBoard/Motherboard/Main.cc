@@ -151,6 +151,8 @@ int main() {
 		host::runHostSlice();	
 		// Command handling thread.
 		command::runCommandSlice();
+		// Stepper slice, plans the later stages of homing
+		steppers::runSteppersSlice();
 		// Motherboard slice
 		board.runMotherboardSlice();
 		//Alert if SRAM/stack has been corrupted by running out of SRAM
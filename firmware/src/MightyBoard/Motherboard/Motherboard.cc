@@ -75,6 +75,9 @@ Motherboard::Motherboard() :
  
 #define DISABLE_TIMER_INTERRUPTS    TIMSK2 &= ~(1<<OCIE2A); \
                             TIMSK5 &= ~(1<<OCIE5A)
+
+//Timer 5 ticks (0.5us) after an overflowed stepper interrupt that the next one is called
+#define ANTI_CLUNK_TICKS            4
  
 
 void Motherboard::init(){
@@ -122,12 +125,12 @@ void Motherboard::initClocks(){
 	// Reset and configure timer 5,  stepper
 	// interrupt timer.
 	TCCR5A = 0x00;
-	TCCR5B = 0x0A; // no prescaling
+	TCCR5B = 0x08 | STEPPER_TIMER_CLOCK_SELECT; // CTC, STEPPER_TIMER_PRESCALER
 	TCCR5C = 0x00;
 	OCR5A = 0x2000; //INTERVAL_IN_MICROSECONDS * 16;
 	TIMSK5 = 0x02; // turn on OCR5A match interrupt
 	
-	// Reset and configure timer 2, the microsecond timer, advance_timer and debug LED flasher timer.
+	// Reset and configure timer 2, the microsecond timer and debug LED flasher timer.
 	TCCR2A = 0x02; //CTC  //0x00;  
 	TCCR2B = 0x04; //prescaler at 1/64  //0x0A; /// prescaler at 1/8
 	OCR2A = 25; //Generate interrupts 16MHz / 64 / 25 = 10KHz  //INTERVAL_IN_MICROSECONDS;  // TODO: update PWM settings to make overflowtime adjustable if desired : currently interupting on overflow
@@ -327,14 +330,15 @@ void Motherboard::doStepperInterrupt() {
 	//Because it's possible another stepper interrupt became due whilst
 	//we were processing the last interrupt, and had stepper interrupts
 	//disabled, we compare the counter to the requested interrupt time
-	//to see if it overflowed.  If it did, then we reset the counter, and
-	//schedule another interrupt for very shortly into the future.
-	if ( TCNT5 >= OCR5A ) {
-
-		OCR5A = 0x01;   //We set the next interrupt to 1 interval, because this will cause the interrupt to  fire again
-		//on the next chance it has after exiting this interrupt, i.e. it gets queued.
+	//to see if it overflowed.  If it did, then we schedule another interrupt
+	//for very shortly into the future.
+	//The counter isn't reset, so that OCR5A remains the time since the last interrupt,
+	//which the stepper interrupt counts with JKN_ADVANCE (the extruder step rate) and
+	//OVERSAMPLED_DDA (whose short intervals are the likeliest to overflow).
+	uint16_t ticks = TCNT5;
+	if ( ticks >= OCR5A ) {
 
-		TCNT5 = 0;  //Reset the timer counter
+		OCR5A = ticks + ANTI_CLUNK_TICKS;	//Far enough ahead that the counter can't pass it before it's written
 
 		//debug_onscreen1 ++;
 	}
@@ -799,10 +803,6 @@ volatile micros_t m2;
 ISR(TIMER2_COMPA_vect) {
 	
 	Motherboard::getBoard().UpdateMicros();
-
-#ifdef JKN_ADVANCE
-  steppers::doExtruderInterrupt();
-#endif
 	
 	if(blink_overflow_counter++ <= 0xA4)
 			return;
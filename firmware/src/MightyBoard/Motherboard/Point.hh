@@ -67,7 +67,11 @@ public:
 
 	/// Absolute value -- convert all point to positive
 	Point abs();
-} __attribute__ ((__packed__));
+}
+#ifndef SIMULATOR
+__attribute__ ((__packed__))
+#endif
+;
 
 
 #endif // POINT_HH
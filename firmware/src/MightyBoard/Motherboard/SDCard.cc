@@ -247,13 +247,14 @@ SdErrorCode startCapture(char* filename)
   return SD_SUCCESS;
 }
 
-void capturePacket(const Packet& packet)
+void capturePacket(const Packet& packet, uint8_t start)
 {
 	if (file == 0) return;
+	if (start >= packet.getLength()) return;
 	// Casting away volatile is OK in this instance; we know where the
 	// data is located and that fat_write_file isn't caching
-	fat_write_file(file, (uint8_t*)packet.getData(), packet.getLength());
-	capturedBytes += packet.getLength();
+	fat_write_file(file, (uint8_t*)packet.getData() + start, packet.getLength() - start);
+	capturedBytes += packet.getLength() - start;
 }
 
 
@@ -67,7 +67,8 @@ namespace sdcard {
 
     /// Capture the contents of a packet to the currently open file.
     /// \param[in] packet Packet to write to file.
-    void capturePacket(const Packet& packet);
+    /// \param[in] start Index of the first payload byte to write.
+    void capturePacket(const Packet& packet, uint8_t start = 0);
 
 
     /// Complete the capture, and flush buffers.  Return the number of bytes
@@ -27,20 +27,42 @@
 */
 
 
+#ifdef SIMULATOR
+	#include <stdio.h>
+	#include <math.h>
+	#include <string.h>
+	#include "Simulator.hh"
+#endif
+
 #include "Configuration.hh"
 #include "StepperAccel.hh"
 
-#ifdef LOOKUP_TABLE_TIMER
-	#include "StepperAccelSpeedTable.hh"
+// Generated by GenerateSpeedTable.py, the step loop thresholds are needed with or without
+// LOOKUP_TABLE_TIMER
+#include "StepperAccelSpeedTable.hh"
+
+#if SPEED_TABLE_TIMER_FREQUENCY != STEPPER_TIMER_FREQUENCY
+	#error "StepperAccelSpeedTable.hh was generated for a different STEPPER_TIMER_FREQUENCY"
 #endif
 
-#include "Motherboard.hh"
+#ifndef SIMULATOR
+	#include "Motherboard.hh"
+	#include <avr/interrupt.h>
+#else
+	#include "SimulatorRegisters.hh"
+#endif
 
-#include <avr/interrupt.h>
 #include <string.h>
 #include <math.h>
 #include "StepperAxis.hh"
 #include "Steppers.hh"
+#ifdef SCURVE
+	#include "StepperAccelSCurve.hh"
+#elif defined(INPUT_SHAPING)
+	#include "StepperAccelShaper.hh"
+#else
+	#include "StepperAccelRamp.hh"
+#endif
 
 
 block_t		*current_block;				// A pointer to the block currently being traced
@@ -60,21 +82,31 @@ float		extruder_only_max_feedrate[EXTRUDERS];
 		static int16_t		lastAdvanceDeprime[EXTRUDERS];
 	#endif
 
-	#define ADVANCE_INTERRUPT_FREQUENCY 10000	// 10KHz
-
-	static uint8_t			st_extruder_interrupt_rate[EXTRUDERS]		= {0, 0};
-	static uint8_t			extruder_interrupt_steps_per_call[EXTRUDERS]	= {0, 0};
-	static uint8_t			st_extruder_interrupt_rate_counter[EXTRUDERS];
+	// The extruder steps are taken from e_steps by this interrupt, see e_step_axes()
+	static uint16_t			e_step_ticks[EXTRUDERS];	// Timer ticks per step at extruder_only_max_feedrate
+	static uint16_t			e_step_credit[EXTRUDERS];	// Timer ticks accrued towards the next step
+	static uint16_t			e_step_credit_max[EXTRUDERS];	// Limits the steps taken in a burst to STEP_LOOPS_MAX
+	static uint16_t			e_step_idle_ticks;		// OCR5A with no block and extruder steps left
 #endif
 
 static unsigned char		out_bits;		// The next stepping-bits to be output
+static uint8_t			active_axes;		// Bit mask of the axes the current block moves
 volatile static uint32_t	step_events_completed;	// The number of step events executed in the current block
 
-static int32_t		acceleration_time, deceleration_time;
 static uint16_t		acc_step_rate, step_rate;
 static char		step_loops, step_loops_nominal;
 static uint16_t		OCR5A_nominal;
 
+static int32_t		ramp_ticks;		// Timer ticks of the current phase not yet consumed by the ramp
+static bool		decelerating;		// The deceleration phase's ramp has been started
+#ifdef SCURVE
+	static scurve_t		scurve;			// Ramp of the current acceleration or deceleration phase
+#elif defined(INPUT_SHAPING)
+	static shaper_ramp_t	shaper;			// Ramp of the current acceleration or deceleration phase
+#else
+	static ramp_t		ramp;			// Ramp of the current acceleration or deceleration phase
+#endif
+
 static bool		deprimed[EXTRUDERS];
 
 static bool		deprime_enabled;		//If true, depriming is On, if not, it's Off.  It's normally switched on.
@@ -86,7 +118,40 @@ static uint8_t		last_active_toolhead = 0;
 #endif
 
 #ifdef OVERSAMPLED_DDA
-	uint8_t oversampledCount = 0;
+	// The ddas are ticked (1 << OVERSAMPLED_DDA) times per step event, the rate is only updated
+	// every oversampledInterrupts interrupts.  Where the interrupt would be called more often than
+	// OVERSAMPLED_DDA_MAX_FREQUENCY, it ticks the ddas more times per call instead, see
+	// set_oversampled_timer().
+	#define DDA_OVERSAMPLE		(1 << OVERSAMPLED_DDA)
+
+	#ifndef OVERSAMPLED_DDA_MAX_FREQUENCY
+		#define OVERSAMPLED_DDA_MAX_FREQUENCY	(4 * STEP_LOOPS_2_RATE)
+	#endif
+	#define OVERSAMPLED_DDA_MIN_TICKS	(STEPPER_TIMER_FREQUENCY / OVERSAMPLED_DDA_MAX_FREQUENCY)
+
+	static uint8_t		oversampledCount;	// Interrupts since the rate was last updated
+	static uint8_t		oversampledInterrupts;	// Interrupts per rate update
+	static uint8_t		dda_loops;		// dda ticks per interrupt
+	static uint8_t		dda_subtick;		// dda ticks into the current step event
+#endif
+
+#ifdef BLOCK_PREFETCH
+	// The setup of the block after current_block, precomputed by st_prefetch_next_block() from the
+	// main loop, so at the block boundary the interrupt copies it in instead of working it out.
+	// block is set last, and the interrupt only uses the rest if block is the block it's starting.
+	struct block_prefetch_t {
+		block_t		*block;			// The block prefetched, or NULL
+		uint16_t	OCR5A_nominal;
+		uint16_t	timer;			// Timer of the initial rate, OCR5A_nominal without use_accel
+		char		step_loops_nominal;
+		char		step_loops;		// step_loops of timer
+		uint8_t		active_axes;
+		struct dda	dda[STEPPER_COUNT];	// Only the ddas of active_axes are set up
+	};
+
+	static struct block_prefetch_t	prefetch;
+	static volatile uint8_t		blocks_started;	// Blocks started by setup_next_block(), so the main
+							// loop can tell if the block it's prefetching started
 #endif
 
 
@@ -115,50 +180,61 @@ static uint8_t		last_active_toolhead = 0;
 		"r26"					\
 	)
 
-// intRes = longIn1 * longIn2 >> 24
-// uses:
-// r26 to store 0
-// r27 to store the byte 1 of the 48bit result
-#define MultiU24X24toH16(intRes, longIn1, longIn2)	\
-	asm volatile (					\
-		"clr r26 \n\t"				\
-		"mul %A1, %B2 \n\t"			\
-		"mov r27, r1 \n\t"			\
-		"mul %B1, %C2 \n\t"			\
-		"movw %A0, r0 \n\t"			\
-		"mul %C1, %C2 \n\t"			\
-		"add %B0, r0 \n\t"			\
-		"mul %C1, %B2 \n\t"			\
-		"add %A0, r0 \n\t"			\
-		"adc %B0, r1 \n\t"			\
-		"mul %A1, %C2 \n\t"			\
-		"add r27, r0 \n\t"			\
-		"adc %A0, r1 \n\t"			\
-		"adc %B0, r26 \n\t"			\
-		"mul %B1, %B2 \n\t"			\
-		"add r27, r0 \n\t"			\
-		"adc %A0, r1 \n\t"			\
-		"adc %B0, r26 \n\t"			\
-		"mul %C1, %A2 \n\t"			\
-		"add r27, r0 \n\t"			\
-		"adc %A0, r1 \n\t"			\
-		"adc %B0, r26 \n\t"			\
-		"mul %B1, %A2 \n\t"			\
-		"add r27, r1 \n\t"			\
-		"adc %A0, r26 \n\t"			\
-		"adc %B0, r26 \n\t"			\
-		"lsr r27 \n\t"				\
-		"adc %A0, r26 \n\t"			\
-		"adc %B0, r26 \n\t"			\
-		"clr r1 \n\t"				\
-		:					\
-		"=&r" (intRes)				\
-		:					\
-		"d" (longIn1),				\
-		"d" (longIn2)				\
-		:					\
-		"r26" , "r27"				\
-	)
+#ifdef JKN_ADVANCE
+
+// Accrues the timer ticks since the last interrupt towards the extruder steps
+
+FORCE_INLINE void e_step_accrue(uint16_t ticks) {
+	for ( uint8_t e = 0; e < EXTRUDERS; e ++ ) {
+		uint16_t credit = e_step_credit[e] + ticks;
+		if (( credit < ticks ) || ( credit > e_step_credit_max[e] ))	credit = e_step_credit_max[e];
+		e_step_credit[e] = credit;
+	}
+}
+
+
+
+// Sets up a step from the e_steps backlog of extruder e, if the ticks for one have accrued, and
+// returns its step pin mask.  A backlog over E_STEPS_BACKLOG_MAX is stepped regardless of the ticks.
+
+FORCE_INLINE uint8_t e_step(uint8_t e) {
+	int16_t steps = e_steps[e];
+	if ( steps == 0 )	return 0;
+
+	if ( e_step_credit[e] >= e_step_ticks[e] )	e_step_credit[e] -= e_step_ticks[e];
+	else if (( steps < E_STEPS_BACKLOG_MAX ) && ( steps > - E_STEPS_BACKLOG_MAX ))	return 0;
+
+	stepperAxisSetDirection(A_AXIS + e, steps > 0);
+	return _BV(A_AXIS + e);
+}
+
+
+
+// Steps the extruders with accrued e_steps, called once per dda tick.  As for the ddas in
+// stepperAxis_dda_step_axes(), the step pins go high together and the backlogs are then
+// accounted for, which holds the pins high for the 1us (16 cycles) the stepper drivers need,
+// before the pins go low together.
+
+FORCE_INLINE void e_step_axes() {
+	uint8_t pulses = 0;
+	for ( uint8_t e = 0; e < EXTRUDERS; e ++ )	pulses |= e_step(e);
+	if ( ! pulses )	return;
+
+	stepperAxisStepPins(pulses, true);
+
+	for ( uint8_t e = 0; e < EXTRUDERS; e ++ ) {
+		if ( pulses & _BV(A_AXIS + e) ) {
+			if ( e_steps[e] < 0 )	e_steps[e] ++;
+			else			e_steps[e] --;
+		}
+	}
+
+	stepperAxisStepPins(pulses, false);
+}
+
+#endif
+
+
 
 // Some useful constants
 
@@ -195,31 +271,44 @@ struct lookup_table_entry {
 #define SHIFT1(x) (uint8_t)(x >> 8 )
 
 
-FORCE_INLINE uint16_t calc_timer(uint16_t step_rate) {
-	uint16_t timer;
+// Returns the timer interval for step_rate, and in loops the steps to take per interrupt
+
+FORCE_INLINE uint16_t calc_timer_loops(uint16_t step_rate, char &loops) {
 	uint8_t step_rate_high = SHIFT1(step_rate);
 
-	if (step_rate_high > SHIFT1(19968)) { // If steprate > 19.968 kHz >> step 8 times
-		if (step_rate_high > SHIFT1(MAX_STEP_FREQUENCY)) // ~39.936 kHz
-			step_rate = (MAX_STEP_FREQUENCY >> 3) & 0x1fff;
-		else
-			step_rate = (step_rate >> 3) & 0x1fff;
-		step_loops = 8;
+	// The thresholds are generated from the SConscript's step_loop_rate and step_loops,
+	// by default 4.864, 9.984 and 19.968 kHz
+	if (step_rate_high > SHIFT1(MAX_STEP_FREQUENCY)) { // ~39.936 kHz
+		step_rate = (MAX_STEP_FREQUENCY / STEP_LOOPS_MAX) & (0xffff / STEP_LOOPS_MAX);
+		loops = STEP_LOOPS_MAX;
+	}
+	#if STEP_LOOPS_MAX >= 8
+	else if (step_rate_high > SHIFT1(STEP_LOOPS_8_RATE)) { // step 8 times
+		step_rate = (step_rate >> 3) & 0x1fff;
+		loops = 8;
 	}
-	else if (step_rate_high > SHIFT1(9984)) { // If steprate > 9.984 kHz >> step 4 times
+	#endif
+	#if STEP_LOOPS_MAX >= 4
+	else if (step_rate_high > SHIFT1(STEP_LOOPS_4_RATE)) { // step 4 times
 		step_rate = (step_rate >> 2) & 0x3fff;
-		step_loops = 4;
+		loops = 4;
 	}
-	else if (step_rate_high > SHIFT1(4864)) { // If steprate > 4.864 kHz >> step 2 times
+	#endif
+	#if STEP_LOOPS_MAX >= 2
+	else if (step_rate_high > SHIFT1(STEP_LOOPS_2_RATE)) { // step 2 times
 		step_rate = (step_rate >> 1) & 0x7fff;
-		step_loops = 2;
-	} else {
-		if (step_rate < 32) step_rate = 32;
-		step_loops = 1;
+		loops = 2;
+	}
+	#endif
+	else {
+		if (step_rate < SPEED_TABLE_MIN_RATE) step_rate = SPEED_TABLE_MIN_RATE;
+		loops = 1;
 	}
 
 	#ifdef LOOKUP_TABLE_TIMER
-		step_rate -= 32; // Correct for minimal speed
+		uint16_t timer;
+
+		step_rate -= SPEED_TABLE_MIN_RATE; // Correct for minimal speed
 
 		if(step_rate >= (8*256)) { // higher step rate 
 			uint16_t table_address		= (uint16_t)&speed_lookuptable_fast[(unsigned char)(step_rate>>8)][0];
@@ -249,27 +338,65 @@ FORCE_INLINE uint16_t calc_timer(uint16_t step_rate) {
 
 		return timer;
 	#else
-		return (uint16_t)((uint32_t)2000000 / (uint32_t)step_rate);
+		return (uint16_t)((uint32_t)STEPPER_TIMER_FREQUENCY / (uint32_t)step_rate);
 	#endif
 }
 
 
 
+// calc_timer_loops() for the interrupt, setting step_loops
+
+FORCE_INLINE uint16_t calc_timer(uint16_t step_rate) {
+	return calc_timer_loops(step_rate, step_loops);
+}
+
+
+
+#ifdef OVERSAMPLED_DDA
+
+// Sets OCR5A for timer ticks per step_loops step events with the ddas oversampled, and returns
+// the ticks until the next rate update.  The interval is rounded rather than truncated, so the
+// rate isn't biased high.
+
+FORCE_INLINE int32_t set_oversampled_timer(uint16_t timer) {
+	uint8_t shift = OVERSAMPLED_DDA;
+	while (( shift ) && ( (timer >> shift) < OVERSAMPLED_DDA_MIN_TICKS ))	shift --;
+
+	uint16_t interval = (uint16_t)(((uint32_t)timer + ((1 << shift) >> 1)) >> shift);
+	OCR5A = interval;
+	dda_loops = step_loops << (OVERSAMPLED_DDA - shift);
+	oversampledInterrupts = 1 << shift;
+
+	return (int32_t)interval << shift;
+}
+
+#endif
+
+
+
 // Sets up the next block from the buffer
 
 FORCE_INLINE void setup_next_block() {
 	//DEBUG_TIMER_START;
 
-	// Using this instead of memcpy saves 64 cycles
-	// starting_position is needed so that "definePosition" in Steppers.cc doesn't require a buffer drain before
-	// setting the position.  By including the starting_position in the block, we can make definePosition
-	// asynchronous
-	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
-		dda_position[i] = current_block->starting_position[i];
+	// The block starts where the last one finished, unless "definePosition" in Steppers.cc was
+	// called in between.  definePosition doesn't require a buffer drain, instead the position change
+	// is attached to the next block, either as a delta or, if it was large, an absolute position.
+	if ( current_block->position_resync ) {
+		for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
+			dda_position[i] = plan_position_resync[i];
+		plan_position_resync_state = PLAN_RESYNC_FREE;
+	} else if ( current_block->position_changed ) {
+		for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
+			dda_position[i] += current_block->position_delta[i];
 	}
 
 	last_active_toolhead = current_block->active_toolhead;
 
+	#ifdef EVENT_QUEUE_SIZE
+		plan_events_started += current_block->events;
+	#endif
+
 	#ifdef JKN_ADVANCE
 		if ( deprime_enabled ) {
 			// Something in the buffer, prime if we previously deprimed
@@ -294,24 +421,59 @@ FORCE_INLINE void setup_next_block() {
 		}
 	#endif
 
-	deceleration_time = 0;
+	decelerating = false;
+
+	#ifdef BLOCK_PREFETCH
+		bool prefetched = ( prefetch.block == current_block );
+		prefetch.block = NULL;
+		blocks_started ++;
+	#endif
 
-	OCR5A_nominal = calc_timer(current_block->nominal_rate);
-	step_loops_nominal = step_loops;
+	uint16_t timer;
+	#ifdef BLOCK_PREFETCH
+		if ( prefetched ) {
+			OCR5A_nominal		= prefetch.OCR5A_nominal;
+			step_loops_nominal	= prefetch.step_loops_nominal;
+			timer			= prefetch.timer;
+			step_loops		= prefetch.step_loops;
+		} else
+	#endif
+	{
+		OCR5A_nominal = calc_timer(current_block->nominal_rate);
+		step_loops_nominal = step_loops;
+		// step_rate to timer interval
+		if ( current_block->use_accel )	timer = calc_timer(current_block->initial_rate);
+		else				timer = OCR5A_nominal;
+	}
   
 	if ( current_block->use_accel ) {
-		// step_rate to timer interval
 		acc_step_rate = current_block->initial_rate;
-		acceleration_time = calc_timer(acc_step_rate);
+		#ifdef SCURVE
+			scurve_start(&scurve, current_block->scurve_accel_jerk, current_block->scurve_accel_updates);
+		#elif defined(INPUT_SHAPING)
+			shaper_start(&shaper, current_block->shaper_accel_rate, current_block->shaper_accel_box);
+		#else
+			ramp_start(&ramp, current_block->acceleration_rate);
+		#endif
 		#ifdef OVERSAMPLED_DDA
-			OCR5A = acceleration_time >> OVERSAMPLED_DDA;
+			ramp_ticks = set_oversampled_timer(timer);
 		#else
-			OCR5A = acceleration_time;
+			OCR5A = timer;
+			ramp_ticks = timer;
 		#endif
 	} else {
-		OCR5A = OCR5A_nominal;
+		#ifdef OVERSAMPLED_DDA
+			set_oversampled_timer(timer);
+		#else
+			OCR5A = timer;
+		#endif
 	}
 
+	#ifdef OVERSAMPLED_DDA
+		oversampledCount = 0;
+		dda_subtick = 0;
+	#endif
+
 	// Setup the next dda's and enabled axis
 	out_bits = current_block->direction_bits;
 
@@ -322,23 +484,46 @@ FORCE_INLINE void setup_next_block() {
 
 	stepperAxisSetHardwareEnabledToMatch(extruderOverriddenAxesEnabled);
 
-	// Reset the dda's, doing it this way instead of a loop saves 325 cycles.
-	stepperAxis_dda_reset(X_AXIS, (current_block->dda_master_axis_index == X_AXIS), current_block->step_event_count,
-				(out_bits & (1 << X_AXIS)), current_block->steps[X_AXIS]);
-	stepperAxis_dda_reset(Y_AXIS, (current_block->dda_master_axis_index == Y_AXIS), current_block->step_event_count, 
-				(out_bits & (1 << Y_AXIS)), current_block->steps[Y_AXIS]);
-	stepperAxis_dda_reset(Z_AXIS, (current_block->dda_master_axis_index == Z_AXIS), current_block->step_event_count, 
-				(out_bits & (1 << Z_AXIS)), current_block->steps[Z_AXIS]);
-	stepperAxis_dda_reset(A_AXIS, (current_block->dda_master_axis_index == A_AXIS), current_block->step_event_count, 
-				(out_bits & (1 << A_AXIS)), current_block->steps[A_AXIS]);
-	stepperAxis_dda_reset(B_AXIS, (current_block->dda_master_axis_index == B_AXIS), current_block->step_event_count, 
-				(out_bits & (1 << B_AXIS)), current_block->steps[B_AXIS]);
+	#ifdef BLOCK_PREFETCH
+		if ( prefetched ) {
+			active_axes = prefetch.active_axes;
+			for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
+				if ( active_axes & _BV(i) )	stepperAxis[i].dda = prefetch.dda[i];
+				else				stepperAxis[i].dda.enabled = false;
+			}
+		} else
+	#endif
+	{
+		// Reset the dda's, doing it this way instead of a loop saves 325 cycles.
+		stepperAxis_dda_reset(X_AXIS, (current_block->dda_master_axis_index == X_AXIS), current_block->step_event_count,
+					(out_bits & (1 << X_AXIS)), current_block->steps[X_AXIS]);
+		stepperAxis_dda_reset(Y_AXIS, (current_block->dda_master_axis_index == Y_AXIS), current_block->step_event_count, 
+					(out_bits & (1 << Y_AXIS)), current_block->steps[Y_AXIS]);
+		stepperAxis_dda_reset(Z_AXIS, (current_block->dda_master_axis_index == Z_AXIS), current_block->step_event_count, 
+					(out_bits & (1 << Z_AXIS)), current_block->steps[Z_AXIS]);
+		stepperAxis_dda_reset(A_AXIS, (current_block->dda_master_axis_index == A_AXIS), current_block->step_event_count, 
+					(out_bits & (1 << A_AXIS)), current_block->steps[A_AXIS]);
+		stepperAxis_dda_reset(B_AXIS, (current_block->dda_master_axis_index == B_AXIS), current_block->step_event_count, 
+					(out_bits & (1 << B_AXIS)), current_block->steps[B_AXIS]);
+
+		active_axes = 0;
+		for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
+			if ( current_block->steps[i] )	active_axes |= _BV(i);
+	}
+
+	stepperAxisSetEndstopDirections(active_axes, out_bits);
 
 	#ifdef JKN_ADVANCE
 		advance_state = ADVANCE_STATE_ACCEL;
 	#endif
 	step_events_completed = 0;
 
+	#ifdef MOTION_STATS
+		#ifdef BLOCK_PREFETCH
+			if ( prefetched )	motion_stats.prefetched ++;
+		#endif
+	#endif
+
 	#ifdef DEBUG_BLOCK_BY_MOVE_INDEX
 		if ( current_block->move_index == 4 ) {
 			debug_onscreen1 = (float)current_block->initial_rate;
@@ -352,6 +537,138 @@ FORCE_INLINE void setup_next_block() {
 
 
 
+#ifdef BLOCK_PREFETCH
+
+// Works out the setup of the block the stepper interrupt starts next for setup_next_block(),
+// see block_prefetch_t.  Called from the main loop.
+//
+// The block's timers come from its rates, which the planner rewrites until it's done with the
+// block, so only a block the planner has finished with is prefetched: the block and the one
+// after it, whose entry speed is the block's exit speed, must be behind block_buffer_planned.
+// The block is then marked busy, as the interrupt does when it starts a block.  If the buffer
+// is too short for that the interrupt sets the block up itself, as it always did.
+
+void st_prefetch_next_block()
+{
+	block_t *block = NULL;
+	uint8_t started;
+
+	CRITICAL_SECTION_START;
+		if ( prefetch.block == NULL ) {
+			uint8_t next = ( current_block == NULL ) ? 0 : 1;
+			uint8_t planned = (block_buffer_planned - block_buffer_tail) & (BLOCK_BUFFER_SIZE - 1);
+			if ( next + 1 < planned ) {
+				block = &block_buffer[(block_buffer_tail + next) & (BLOCK_BUFFER_SIZE - 1)];
+				block->busy = true;
+			}
+		}
+		started = blocks_started;
+	CRITICAL_SECTION_END;
+
+	if ( block == NULL )	return;
+
+	prefetch.OCR5A_nominal		= calc_timer_loops(block->nominal_rate, prefetch.step_loops_nominal);
+	if ( block->use_accel ) {
+		prefetch.timer		= calc_timer_loops(block->initial_rate, prefetch.step_loops);
+	} else {
+		prefetch.timer		= prefetch.OCR5A_nominal;
+		prefetch.step_loops	= prefetch.step_loops_nominal;
+	}
+
+	uint8_t axes = 0;
+	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
+		if ( ! block->steps[i] )	continue;
+		axes |= _BV(i);
+		prefetch.dda[i].eAxis = stepperAxis[i].dda.eAxis;
+		stepperAxis_dda_prepare(prefetch.dda[i], (block->dda_master_axis_index == i), block->step_event_count,
+					(block->direction_bits & _BV(i)), block->steps[i]);
+	}
+	prefetch.active_axes = axes;
+
+	// Unless the interrupt started the block while we were at it
+	CRITICAL_SECTION_START;
+		if ( started == blocks_started )	prefetch.block = block;
+	CRITICAL_SECTION_END;
+}
+
+#endif
+
+
+
+// Steps the ddas of the axes the current block moves.  The common combinations get a variant
+// with the idle axes compiled out, anything else tests each axis.
+
+#define AXES_XY		(_BV(X_AXIS) | _BV(Y_AXIS))
+#define AXES_XYA	(_BV(X_AXIS) | _BV(Y_AXIS) | _BV(A_AXIS))
+#define AXES_XYB	(_BV(X_AXIS) | _BV(Y_AXIS) | _BV(B_AXIS))
+#define AXES_Z		_BV(Z_AXIS)
+#define AXES_A		_BV(A_AXIS)
+#define AXES_B		_BV(B_AXIS)
+#define AXES_ALL	(_BV(X_AXIS) | _BV(Y_AXIS) | _BV(Z_AXIS) | _BV(A_AXIS) | _BV(B_AXIS))
+
+FORCE_INLINE void dda_step_active_axes() {
+	switch ( active_axes ) {
+		case AXES_XY:	stepperAxis_dda_step_axes<AXES_XY>(AXES_XY);	break;
+		case AXES_XYA:	stepperAxis_dda_step_axes<AXES_XYA>(AXES_XYA);	break;
+		case AXES_XYB:	stepperAxis_dda_step_axes<AXES_XYB>(AXES_XYB);	break;
+		case AXES_Z:	stepperAxis_dda_step_axes<AXES_Z>(AXES_Z);	break;
+		case AXES_A:	stepperAxis_dda_step_axes<AXES_A>(AXES_A);	break;
+		case AXES_B:	stepperAxis_dda_step_axes<AXES_B>(AXES_B);	break;
+		default:	stepperAxis_dda_step_axes<AXES_ALL>(active_axes); break;
+	}
+}
+
+
+
+// Takes the interrupt's step_loops step events of the current block, stopping at its end.  With
+// OVERSAMPLED_DDA the interrupt ticks the ddas dda_loops times, (1 << OVERSAMPLED_DDA) per step event.
+
+FORCE_INLINE void dda_ticks() {
+	// The endstops are sampled once for all the steps taken below
+	stepperAxisSampleEndstops();
+
+	#ifdef OVERSAMPLED_DDA
+		uint8_t loops = dda_loops;
+	#else
+		uint8_t loops = step_loops;
+	#endif
+
+	for ( uint8_t i = 0; i < loops; i ++ ) {
+		#ifdef JKN_ADVANCE
+			// With OVERSAMPLED_DDA the phase shifts are per dda tick, see StepperAxis.hh
+			if ( current_block->use_accel ) {
+				for ( uint8_t e = 0; e < EXTRUDERS; e ++ ) {
+					if ( advance_state == ADVANCE_STATE_ACCEL ) {
+						stepperAxis_dda_shift_phase16(A_AXIS + e, current_block->advance_lead_entry);
+					}
+					if ( advance_state == ADVANCE_STATE_DECEL ) {
+						stepperAxis_dda_shift_phase16(A_AXIS + e, - current_block->advance_lead_exit);
+						stepperAxis_dda_shift_phase32(A_AXIS + e, - advance_pressure_relax_accumulator >> 8);
+					}
+				}
+			}
+		#endif
+
+		//Step the dda for each axis
+		dda_step_active_axes();
+
+		#ifdef JKN_ADVANCE
+			e_step_axes();
+		#endif
+
+		#ifdef OVERSAMPLED_DDA
+			if ( ++ dda_subtick < DDA_OVERSAMPLE )	continue;
+			dda_subtick = 0;
+		#endif
+
+		step_events_completed += 1;
+
+		if(step_events_completed >= current_block->step_event_count) break;
+	}
+}
+
+
+
 // "The Stepper Driver Interrupt" - This timer interrupt is the workhorse.  
 // It pops blocks from the block_buffer and executes them by pulsing the stepper pins appropriately.
 // Returns true if we deleted an item in the pipeline buffer 
@@ -360,20 +677,21 @@ bool st_interrupt() {
 	//DEBUG_TIMER_START;
 	bool block_deleted = false;
 
+	#ifdef JKN_ADVANCE
+		// The compare match restarted timer 5, OCR5A is still the period which just ended
+		e_step_accrue(OCR5A);
+	#endif
+
 	#ifdef OVERSAMPLED_DDA
+		// In between the rate updates the interrupt only ticks the ddas, unless the block finishes
+		bool ticked = false;
 		if ( current_block != NULL ) {
-			oversampledCount ++;
-
-			if ( oversampledCount < (1 << OVERSAMPLED_DDA) ) {
-				//Step the dda for each axis
-				stepperAxis_dda_step(X_AXIS);
-				stepperAxis_dda_step(Y_AXIS);
-				stepperAxis_dda_step(Z_AXIS);
-				stepperAxis_dda_step(A_AXIS);
-				stepperAxis_dda_step(B_AXIS);
-
-				return block_deleted;
+			if ( ++ oversampledCount < oversampledInterrupts ) {
+				dda_ticks();
+				if ( step_events_completed < current_block->step_event_count )	return block_deleted;
+				ticked = true;
 			}
+			oversampledCount = 0;
 		}
 	#endif
 
@@ -385,12 +703,11 @@ bool st_interrupt() {
 		if (current_block != NULL) {
 			setup_next_block();
 		} else {
-			OCR5A=2000; // 1kHz.
+			OCR5A=STEPPER_TIMER_FREQUENCY / 1000; // 1kHz.
 
 			// Buffer is empty, because enabling/disabling axes doesn't require a block to be 
 			// present, we better set the hardware to match the last enable/disable in software
-			// If we're running JKN_ADVANCE, the e_steps are on a seperate interrupt so we need to wait for those to be
-			// empty too
+			// If we're running JKN_ADVANCE, we need to wait for the e_steps to be empty too
 			#ifdef JKN_ADVANCE
 				if (( e_steps[0] == 0 ) && ( e_steps[1] == 0 ))
 			#endif
@@ -421,54 +738,38 @@ bool st_interrupt() {
 				}    
 			}
 		}
+
+		// With no block, keep the interrupt going at the extruder step rate until the e_steps are done
+		if (( current_block == NULL ) && ( e_steps[0] || e_steps[1] )) {
+			e_step_axes();
+			OCR5A = e_step_idle_ticks;
+		}
 	#endif
 
 	if (current_block != NULL) {
 		// Take multiple steps per interrupt (For high speed moves) 
-		for(int8_t i=0; i < step_loops; i++) {
-			#ifdef JKN_ADVANCE
-				if ( current_block->use_accel ) {
-					for ( uint8_t e = 0; e < EXTRUDERS; e ++ ) {
-						if ( advance_state == ADVANCE_STATE_ACCEL ) {
-							stepperAxis_dda_shift_phase16(A_AXIS + e, current_block->advance_lead_entry);
-						}
-						if ( advance_state == ADVANCE_STATE_DECEL ) {
-							stepperAxis_dda_shift_phase16(A_AXIS + e, - current_block->advance_lead_exit);
-							stepperAxis_dda_shift_phase32(A_AXIS + e, - advance_pressure_relax_accumulator >> 8);
-						}
-					}
-				}
-			#endif
-      
-			//Step the dda for each axis
-			stepperAxis_dda_step(X_AXIS);
-			stepperAxis_dda_step(Y_AXIS);
-			stepperAxis_dda_step(Z_AXIS);
-			stepperAxis_dda_step(A_AXIS);
-			stepperAxis_dda_step(B_AXIS);
-
-			#ifdef OVERSAMPLED_DDA
-				oversampledCount = 0;
-			#endif
-
-			step_events_completed += 1;  
+		#ifdef OVERSAMPLED_DDA
+			if ( ! ticked )
+		#endif
+		dda_ticks();
 
-			if(step_events_completed >= current_block->step_event_count) break;
-		}
+		#ifdef MOTION_STATS
+			// step_loops is 1, 2, 4 or 8
+			motion_stats.step_loops[(step_loops > 2) ? ((step_loops >> 2) + 1) : (step_loops - 1)] ++;
+		#endif
 
 		// Calculate new timer value
 		uint16_t timer;
 		if (step_events_completed <= (uint32_t)current_block->accelerate_until) { // ACCELERATION PHASE
-      
-			// Note that we need to convert acceleration_time from units of
-			// 2 MHz to seconds.  That is done by dividing acceleration_time
-			// by 2000000.  But, that will make it 0 when we use integer
-			// arithmetic.  So, we first multiply block->acceleration_rate by
-			// acceleration_time and then do the divide.  However, it's
-			// convenient to divide by 2^24 ( >> 24 ).  So, block->acceleration_rate
-			// has been prescaled by a factor of 8.388608.
-
-			MultiU24X24toH16(acc_step_rate, acceleration_time, current_block->acceleration_rate);
+
+			// Additions only, the ramp was precomputed by the planner
+			#ifdef SCURVE
+				acc_step_rate = scurve_delta(&scurve, &ramp_ticks);
+			#elif defined(INPUT_SHAPING)
+				acc_step_rate = shaper_delta(&shaper, &ramp_ticks);
+			#else
+				acc_step_rate = ramp_delta(&ramp, &ramp_ticks);
+			#endif
 			acc_step_rate += current_block->initial_rate;
       
 			// upper limit
@@ -477,12 +778,11 @@ bool st_interrupt() {
 			// step_rate to timer interval
 			timer = calc_timer(acc_step_rate);
 			#ifdef OVERSAMPLED_DDA
-				OCR5A = timer >> OVERSAMPLED_DDA;
+				ramp_ticks += set_oversampled_timer(timer);
 			#else
 				OCR5A = timer;
+				ramp_ticks += timer;
 			#endif
-
-			acceleration_time += timer;
 		} 
 		else if (step_events_completed > (uint32_t)current_block->decelerate_after) {  // DECELERATION PHASE
 			#ifdef JKN_ADVANCE
@@ -496,15 +796,24 @@ bool st_interrupt() {
 				advance_pressure_relax_accumulator += current_block->advance_pressure_relax;
 			#endif
 
-			// Note that we need to convert deceleration_time from units of
-			// 2 MHz to seconds.  That is done by dividing deceleration_time
-			// by 2000000.  But, that will make it 0 when we use integer
-			// arithmetic.  So, we first multiply block->acceleration_rate by
-			// deceleration_time and then do the divide.  However, it's
-			// convenient to divide by 2^24 ( >> 24 ).  So, block->acceleration_rate
-			// has been prescaled by a factor of 8.388608.
-
-			MultiU24X24toH16(step_rate, deceleration_time, current_block->acceleration_rate);
+			if ( ! decelerating ) {
+				#ifdef SCURVE
+					scurve_start(&scurve, current_block->scurve_decel_jerk, current_block->scurve_decel_updates);
+				#elif defined(INPUT_SHAPING)
+					shaper_start(&shaper, current_block->shaper_decel_rate, current_block->shaper_decel_box);
+				#else
+					ramp_start(&ramp, current_block->acceleration_rate);
+				#endif
+				ramp_ticks = 0;
+				decelerating = true;
+			}
+			#ifdef SCURVE
+				step_rate = scurve_delta(&scurve, &ramp_ticks);
+			#elif defined(INPUT_SHAPING)
+				step_rate = shaper_delta(&shaper, &ramp_ticks);
+			#else
+				step_rate = ramp_delta(&ramp, &ramp_ticks);
+			#endif
       
 			if(step_rate > acc_step_rate) { // Check step_rate stays positive
 				step_rate = current_block->final_rate;
@@ -517,12 +826,11 @@ bool st_interrupt() {
 			// step_rate to timer interval
 			timer = calc_timer(step_rate);
 			#ifdef OVERSAMPLED_DDA
-				OCR5A = timer >> OVERSAMPLED_DDA;
+				ramp_ticks += set_oversampled_timer(timer);
 			#else
 				OCR5A = timer;
+				ramp_ticks += timer;
 			#endif
-
-			deceleration_time += timer;
 		} else {	//NOMINAL PHASE
 			#ifdef JKN_ADVANCE
 				if ( advance_state == ADVANCE_STATE_ACCEL ) {
@@ -530,13 +838,13 @@ bool st_interrupt() {
 				}
 			#endif
 
+			step_loops = step_loops_nominal;
+
 			#ifdef OVERSAMPLED_DDA
-				OCR5A = OCR5A_nominal >> OVERSAMPLED_DDA;
+				set_oversampled_timer(OCR5A_nominal);
 			#else
 				OCR5A = OCR5A_nominal;
 			#endif
-
-			step_loops = step_loops_nominal;
 		}
 
 		// If current block is finished, reset pointer 
@@ -556,6 +864,14 @@ bool st_interrupt() {
 			if (current_block != NULL) {
 				setup_next_block();
 			} 
+
+			#ifdef MOTION_STATS
+				uint8_t planned = movesplanned();
+				motion_stats.handovers ++;
+				motion_stats.occupancy_sum += planned;
+				if ( planned < motion_stats.occupancy_min )	motion_stats.occupancy_min = planned;
+				if ( planned == 0 )				motion_stats.underruns ++;
+			#endif
 		}   
 	} 
 
@@ -566,91 +882,42 @@ bool st_interrupt() {
 
 
 
-#ifdef JKN_ADVANCE
-
-void st_extruder_interrupt()
-{
-	uint8_t i;
-
-	//Increment the rate counters
-	for ( i = 0; i < EXTRUDERS; i ++ )	st_extruder_interrupt_rate_counter[i] ++;
-
-	// Set E direction (Depends on E direction + advance)
-	for ( i = 0; e_steps[0] &&
-		     (st_extruder_interrupt_rate_counter[0] >= st_extruder_interrupt_rate[0]) &&
-		     (i < extruder_interrupt_steps_per_call[0]); i ++ ) {
-
-		stepperAxisStep(A_AXIS, false);
-		if (e_steps[0] < 0) {
-			stepperAxisSetDirection(A_AXIS, false);
-			e_steps[0]++;
-			stepperAxisStep(A_AXIS, true);
-		} 
-		else if (e_steps[0] > 0) {
-			stepperAxisSetDirection(A_AXIS, true);
-			e_steps[0]--;
-			stepperAxisStep(A_AXIS, true);
-		}
-
-		st_extruder_interrupt_rate_counter[0] = 0;
-	}
-
-	#if EXTRUDERS > 1
-
-	for ( i = 0; e_steps[1] &&
-		     (st_extruder_interrupt_rate_counter[1] >= st_extruder_interrupt_rate[1]) &&
-		     (i < extruder_interrupt_steps_per_call[1]); i ++ ) {
-
-		stepperAxisStep(B_AXIS, false);
-		if (e_steps[1] < 0) {
-			stepperAxisSetDirection(B_AXIS, false);
-			e_steps[1]++;
-			stepperAxisStep(B_AXIS, true);
-		} 
-		else if (e_steps[1] > 0) {
-			stepperAxisSetDirection(B_AXIS, true);
-			e_steps[1]--;
-			stepperAxisStep(B_AXIS, true);
-		}
-
-		st_extruder_interrupt_rate_counter[1] = 0;
-	}
-
-	#endif
-}
-
-#endif // JKN_ADVANCE
-
-
-
 void st_init()
 {
 	#ifdef OVERSAMPLED_DDA
 		oversampledCount = 0;
+		oversampledInterrupts = 1;
+		dda_loops = 1;
+		dda_subtick = 0;
+	#endif
+
+	#ifdef BLOCK_PREFETCH
+		prefetch.block = NULL;
 	#endif
 
 	last_active_toolhead = 0;
 
 	#ifdef JKN_ADVANCE
-		// Calculate the smallest number of st_extruder_interrupt's between extruder steps based on the
-		// st_extruder_interrupt of 10KHz (ADVANCE_INTERRUPT_FREQUENCY).
+		// Timer ticks between extruder steps at extruder_only_max_feedrate, rounded up (slower).  The
+		// interrupt can't run faster than MAX_STEP_FREQUENCY while it's only stepping the extruders.
+		e_step_idle_ticks = 0xffff;
 		for ( uint8_t e = 0; e < EXTRUDERS; e ++ ) {
-			float st_extruder_interrupt_ratef = (float)ADVANCE_INTERRUPT_FREQUENCY / (extruder_only_max_feedrate[e] * stepperAxisStepsPerMM(A_AXIS + e));
+			float ticks = ceil((float)STEPPER_TIMER_FREQUENCY / (extruder_only_max_feedrate[e] * stepperAxisStepsPerMM(A_AXIS + e)));
 
-			// Round up (slower), or if we need more steps than 1 in an interrupt (st_extruder_interrupt_ratef < 1), then
-			// we need to process more steps in the loop
-			if	( st_extruder_interrupt_ratef > 1.0 ) st_extruder_interrupt_ratef = ceil(st_extruder_interrupt_ratef);
-			else if ( st_extruder_interrupt_ratef < 1.0 ) st_extruder_interrupt_ratef = 0;
+			if	( ticks < 1.0 )		ticks = 1.0;
+			else if ( ticks > 65535.0 )	ticks = 65535.0;
+			e_step_ticks[e] = (uint16_t)ticks;
 
-			st_extruder_interrupt_rate[e] = (uint8_t)st_extruder_interrupt_ratef;
+			ticks *= STEP_LOOPS_MAX;
+			e_step_credit_max[e] = ( ticks > 65535.0 ) ? 0xffff : (uint16_t)ticks;
+			e_step_credit[e] = e_step_ticks[e];
 
-			extruder_interrupt_steps_per_call[e] = 0;
-			if ( st_extruder_interrupt_rate[e] == 0 )	extruder_interrupt_steps_per_call[e] = (uint8_t)ceil(1.0 / st_extruder_interrupt_ratef);	
-			if ( extruder_interrupt_steps_per_call[e] < 1 )	extruder_interrupt_steps_per_call[e] = 1;
+			if ( e_step_ticks[e] < e_step_idle_ticks )	e_step_idle_ticks = e_step_ticks[e];
 
 			e_steps[e] = 0;
-			st_extruder_interrupt_rate_counter[e] = st_extruder_interrupt_rate[e];
 		}
+		if ( e_step_idle_ticks < STEPPER_TIMER_FREQUENCY / MAX_STEP_FREQUENCY )
+			e_step_idle_ticks = STEPPER_TIMER_FREQUENCY / MAX_STEP_FREQUENCY;
 	#endif
 }
 
@@ -710,14 +977,17 @@ void quickStop()
 		while(blocks_queued())	plan_discard_current_block();
 
 		current_block = NULL;
+		#ifdef BLOCK_PREFETCH
+			prefetch.block = NULL;
+		#endif
 
+		// With the buffer empty, this also drops any position change waiting for the next block
+		int32_t position[STEPPER_COUNT];
 		CRITICAL_SECTION_START;
-			planner_position[X_AXIS] = dda_position[X_AXIS];
-			planner_position[Y_AXIS] = dda_position[Y_AXIS];
-			planner_position[Z_AXIS] = dda_position[Z_AXIS];
-			planner_position[A_AXIS] = dda_position[A_AXIS];
-			planner_position[B_AXIS] = dda_position[B_AXIS];
+			for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
+				position[i] = dda_position[i];
 		CRITICAL_SECTION_END;
+		plan_set_position(position[X_AXIS], position[Y_AXIS], position[Z_AXIS], position[A_AXIS], position[B_AXIS]);
 
 	ENABLE_STEPPER_DRIVER_INTERRUPT();
 }
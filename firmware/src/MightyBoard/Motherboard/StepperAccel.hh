@@ -32,6 +32,35 @@
 
 #define MAX_STEP_FREQUENCY 40000 // Max step frequency for Ultimaker (5000 pps / half step)
 
+//With JKN_ADVANCE the stepper interrupt takes the extruder steps from the e_steps backlog no
+//faster than extruder_only_max_feedrate, unless the backlog is over E_STEPS_BACKLOG_MAX when
+//it takes one every dda tick.  That's as fast as the dda adds to it, so with the prime / deprime
+//steps limited to E_STEPS_DEPRIME_MAX the backlog can't overflow e_steps.
+#define E_STEPS_BACKLOG_MAX	8192
+#define E_STEPS_DEPRIME_MAX	8192
+
+//Stepper interrupt timer (timer 5) frequency and prescaler, the SConscript passes these
+//to the compiler and to GenerateSpeedTable.py
+#ifndef STEPPER_TIMER_PRESCALER
+	#define STEPPER_TIMER_PRESCALER		8
+#endif
+#ifndef STEPPER_TIMER_FREQUENCY
+	#define STEPPER_TIMER_FREQUENCY		2000000
+#endif
+
+//Clock select bits of TCCR5B for STEPPER_TIMER_PRESCALER
+#if   STEPPER_TIMER_PRESCALER == 1
+	#define STEPPER_TIMER_CLOCK_SELECT	0x01
+#elif STEPPER_TIMER_PRESCALER == 8
+	#define STEPPER_TIMER_CLOCK_SELECT	0x02
+#elif STEPPER_TIMER_PRESCALER == 64
+	#define STEPPER_TIMER_CLOCK_SELECT	0x03
+#elif STEPPER_TIMER_PRESCALER == 256
+	#define STEPPER_TIMER_CLOCK_SELECT	0x04
+#else
+	#error "STEPPER_TIMER_PRESCALER must be 1, 8, 64 or 256"
+#endif
+
 //Enables the debug timer.  The timer can detected upto 4ms before overflowing.
 //Example usage:
 //	DEBUG_TIMER_START;
@@ -87,7 +116,10 @@ void st_get_position(int32_t *x, int32_t *y, int32_t *z, int32_t *a, int32_t *b,
 // Returns true if we deleted an item in the pipeline buffer
 bool st_interrupt();
 
-void st_extruder_interrupt();
+#ifdef BLOCK_PREFETCH
+// Sets up the block the stepper interrupt starts next ahead of time, called from the main loop
+void st_prefetch_next_block();
+#endif
 
 void quickStop();
   
@@ -71,11 +71,11 @@
 #include <string.h>
 #include "EepromMap.hh"
 #include "Eeprom.hh"
-#include <avr/eeprom.h>
-#include "Interface.hh"
 
 #ifndef SIMULATOR
+	#include <avr/eeprom.h>
 	#include  <avr/interrupt.h>
+	#include "Interface.hh"
 	#include "Motherboard.hh"
 #endif
 
@@ -104,8 +104,9 @@ uint32_t	p_acceleration;						// Normal acceleration mm/s^2  THIS IS THE DEFAULT
 uint32_t	p_retract_acceleration;					//  mm/s^2   filament pull-pack and push-forward  while standing still in the other axis M204 TXXXX
 FPTYPE		smallest_max_speed_change;
 FPTYPE		max_speed_change[STEPPER_COUNT];			//The speed between junctions in the planner, reduces blobbing
+FPTYPE		junction_deviation;					//Junction deviation in mm, 0 = use max_speed_change instead
 FPTYPE		minimumPlannerSpeed;
-int		slowdown_limit;
+uint32_t	slowdown_time;						//Slow down when less than this is queued, in PLAN_TIME_UNITS, 0 = never
 
 bool		disable_slowdown = true;
 uint32_t	axis_steps_per_sqr_second[STEPPER_COUNT];
@@ -136,6 +137,8 @@ int32_t		planner_position[STEPPER_COUNT];			//rescaled from extern when axisStep
 int32_t		planner_target[STEPPER_COUNT];
 
 static FPTYPE	prev_speed[STEPPER_COUNT];
+static FPTYPE	prev_unit_vec[3];					//XYZ unit vector of the previous block, for junction deviation
+static FPTYPE	prev_nominal_speed;					//0 if the previous block can't be used for junction deviation
 
 #ifdef SIMULATOR
 	static block_t	*sblock = NULL;
@@ -194,10 +197,50 @@ bool		acceleration_zhold = false;
 
 #endif
 
+#ifdef SCURVE
+	#include "StepperAccelSCurve.hh"
+#endif
+
+#ifdef INPUT_SHAPING
+	#include "StepperAccelShaper.hh"
+
+	shaper_t input_shaper;			// Off until plan_set_input_shaper()
+#endif
+
+#ifdef FIXED
+	// Square root of a positive FPTYPE x normalized to have one of its top 3 bits set,
+	// returned as ITOFP(sqrt(x >> 16)) which is (sqrt(x) << 8)
+	#ifdef SQRT_TABLE
+		#include "StepperAccelSqrt.hh"
+		#define SPEED_SQRT(x)	((FPTYPE)isqrt_table_newton((uint32_t)(x)) << 8)
+	#else
+		#define SPEED_SQRT(x)	ITOFP(isqrt1(FPTOI16(x)))
+	#endif
+#endif
+
 
 block_t			block_buffer[BLOCK_BUFFER_SIZE];	// A ring buffer for motion instfructions
 volatile unsigned char	block_buffer_head;			// Index of the next block to be pushed
 volatile unsigned char	block_buffer_tail;			// Index of the block to process now
+volatile unsigned char	block_buffer_planned;			// Index of the first block which may still be re-planned
+volatile uint32_t	plan_queued_time;			// Sum of the durations of the blocks in the buffer, in PLAN_TIME_UNITS
+
+// Position changes made by plan_set_position() while moves are queued reach the stepper interrupt
+// with the next block added.  Changes which fit in an int16_t travel in the block's position_delta,
+// larger ones travel in plan_position_resync, of which there's only one.
+static int32_t		planner_position_delta[STEPPER_COUNT];	// Change not yet attached to a block
+int32_t			plan_position_resync[STEPPER_COUNT];	// Starting position for the block flagged position_resync
+volatile uint8_t	plan_position_resync_state;		// PLAN_RESYNC_FREE, PLAN_RESYNC_PENDING or PLAN_RESYNC_QUEUED
+
+#ifdef EVENT_QUEUE_SIZE
+	static uint8_t		plan_pending_events;	// Events for the next block added
+	volatile uint8_t	plan_events_started;	// Events of the blocks the stepper interrupt has started
+#endif
+
+#ifdef MOTION_STATS
+	// Kept from power on, or the last motionStatsReset(), so that a finished build can still be queried
+	volatile motion_stats_t	motion_stats = { 0, 0, BLOCK_BUFFER_SIZE };
+#endif
 
 
 // Returns the index of the next block in the ring buffer
@@ -333,7 +376,7 @@ FORCE_INLINE int32_t intersection_distance(int32_t initial_rate_sq, int32_t fina
 }
 
 
-#ifdef JKN_ADVANCE
+#if defined(JKN_ADVANCE) || defined(SCURVE) || defined(INPUT_SHAPING)
 
 	// Same as final_speed, except this one works with step_rates.
 	// Regular final_speed will overflow if we use step_rates instead of mm/s
@@ -396,6 +439,45 @@ FORCE_INLINE int32_t intersection_distance(int32_t initial_rate_sq, int32_t fina
 
 
 
+#ifdef SCURVE
+
+	// Number of SCURVE_UPDATE_TICKS in a phase changing the step rate by rate_change at
+	// the constant acceleration of the trapezoid.  The S-curve keeps the duration of the phase.
+
+	static uint16_t scurve_updates(uint32_t rate_change, uint32_t acceleration) {
+		if ( acceleration == 0 )	return 0;
+		uint32_t updates = (rate_change * SCURVE_UPDATES_PER_SEC + (acceleration >> 1)) / acceleration;
+		return (updates > 0xFFFF) ? 0xFFFF : (uint16_t)updates;
+	}
+
+	// Jerk in 16.16 step rate per update per update such that the ramp of updates
+	// updates changes the step rate by rate_change.  With n = scurve_ramp_updates(updates)
+	// the rate changes by jerk * n * (updates - n)
+
+	static uint32_t scurve_jerk(uint32_t rate_change, uint16_t updates) {
+		uint32_t n = scurve_ramp_updates(updates);
+		return (rate_change << 16) / (n * (scurve_total_updates(updates) - n));
+	}
+
+#endif
+
+#ifdef INPUT_SHAPING
+
+	// Box length and acceleration (a') for a phase changing the step rate by rate_change at the
+	// constant acceleration of the trapezoid, see StepperAccelShaper.hh.  Phases shorter than
+	// twice the shaper, for which a' would exceed twice the acceleration, are left as they are.
+
+	static void shaper_phase(uint32_t rate_change, uint32_t acceleration, uint16_t *box, uint32_t *accel) {
+		if (( input_shaper.impulses == 0 ) || ( acceleration == 0 ))	return;
+		uint32_t updates = (rate_change * RAMP_UPDATES_PER_SEC + (acceleration >> 1)) / acceleration;
+		uint16_t span = input_shaper.start[input_shaper.impulses - 1];
+		if (( updates < ((uint32_t)span << 1) ) || ( updates >= 0xFFFF ))	return;
+		*box   = (uint16_t)(updates - span);
+		*accel = (rate_change << 16) / *box;
+	}
+
+#endif
+
 // Calculates trapezoid parameters so that the entry- and exit-speed is compensated by the provided factors.
 
 void calculate_trapezoid_for_block(block_t *block, FPTYPE entry_factor, FPTYPE exit_factor) {
@@ -430,14 +512,17 @@ void calculate_trapezoid_for_block(block_t *block, FPTYPE entry_factor, FPTYPE e
 
 	int32_t initial_rate_sq = (int32_t)(initial_rate * initial_rate);
 	int32_t final_rate_sq   = (int32_t)(final_rate   * final_rate);
+
+	// Max rate is sqrt(0x7fffffff) = 46,340.95 steps/s
+	int32_t nominal_rate_sq = (int32_t)(block->nominal_rate * block->nominal_rate);
   
 	int32_t acceleration = block->acceleration_st;
 	int32_t acceleration_doubled = acceleration << 1;
 	int32_t accelerate_steps = 0;
 	int32_t decelerate_steps = 0;
 	if ( block->use_accel ) {
-		accelerate_steps = estimate_acceleration_distance(initial_rate_sq, block->nominal_rate_sq, acceleration_doubled);
-		decelerate_steps = estimate_acceleration_distance(block->nominal_rate_sq, final_rate_sq, -acceleration_doubled);
+		accelerate_steps = estimate_acceleration_distance(initial_rate_sq, nominal_rate_sq, acceleration_doubled);
+		decelerate_steps = estimate_acceleration_distance(nominal_rate_sq, final_rate_sq, -acceleration_doubled);
 	}
 
 	// accelerate_steps = max(accelerate_steps,0); // Check limits due to numerical round-off
@@ -461,7 +546,10 @@ void calculate_trapezoid_for_block(block_t *block, FPTYPE entry_factor, FPTYPE e
 		#ifdef SIMULATOR
 			sblock = block;
 		#endif
-		int16_t advance_lead_entry = 0, advance_lead_exit = 0, advance_lead_prime = 0, advance_lead_deprime = 0;
+		int16_t advance_lead_entry = 0, advance_lead_exit = 0;
+		#ifdef JKN_ADVANCE_LEAD_DE_PRIME
+			int16_t advance_lead_prime = 0, advance_lead_deprime = 0;
+		#endif
 		int32_t advance_pressure_relax = 0;
 
 		if ( block->use_advance_lead ) {
@@ -537,7 +625,9 @@ void calculate_trapezoid_for_block(block_t *block, FPTYPE entry_factor, FPTYPE e
 
 				#ifndef SIMULATOR
 					if (advance_lead_entry < 0) advance_lead_entry = 0;
-					if (advance_lead_prime < 0) advance_lead_prime = 0;
+					#ifdef JKN_ADVANCE_LEAD_DE_PRIME
+						if (advance_lead_prime < 0) advance_lead_prime = 0;
+					#endif
 				#endif
 			}
 
@@ -577,7 +667,9 @@ void calculate_trapezoid_for_block(block_t *block, FPTYPE entry_factor, FPTYPE e
 					if ( advance_pressure_relax < 0 ) advance_pressure_relax = 0;
 
 					if (advance_lead_exit    < 0) advance_lead_exit = 0;
-					if (advance_lead_deprime < 0) advance_lead_deprime = 0;
+					#ifdef JKN_ADVANCE_LEAD_DE_PRIME
+						if (advance_lead_deprime < 0) advance_lead_deprime = 0;
+					#endif
 				#endif
 			}
 
@@ -592,12 +684,48 @@ void calculate_trapezoid_for_block(block_t *block, FPTYPE entry_factor, FPTYPE e
 						 "i/n/f/a=%d/%d/%d/%d !!!\n",
 						 advance_lead_entry, advance_lead_exit, advance_pressure_relax,initial_rate, block->nominal_rate,
 						 maximum_rate, final_rate, accelerate_steps, decelerate_after, block->step_event_count,
-						 plateau_steps, initial_rate_sq, block->nominal_rate_sq, final_rate_sq, acceleration_doubled);
+						 plateau_steps, initial_rate_sq, nominal_rate_sq, final_rate_sq, acceleration_doubled);
 					strlcat(block->message, buf, sizeof(block->message));
 				}
 			#endif
 		}
 	#endif
+
+	#if defined(SCURVE) || defined(INPUT_SHAPING)
+		// Peak rate reached at accelerate_until, see the JKN_ADVANCE note on accelerate_steps + 1
+		uint32_t peak_rate = block->nominal_rate;
+		if ( block->use_accel ) {
+			if ( plateau_steps == 0 ) {
+				peak_rate = FPTOI(final_speed_step_rate(block->acceleration_st, initial_rate, accelerate_steps + 1));
+				if ( peak_rate > block->nominal_rate )	peak_rate = block->nominal_rate;
+			}
+			if ( peak_rate < initial_rate )	peak_rate = initial_rate;
+			if ( peak_rate < final_rate )	peak_rate = final_rate;
+		}
+	#endif
+
+	#ifdef SCURVE
+		uint32_t scurve_accel_jerk = 0, scurve_decel_jerk = 0;
+		uint16_t scurve_accel_updates = 0, scurve_decel_updates = 0;
+
+		if ( block->use_accel ) {
+			scurve_accel_updates = scurve_updates(peak_rate - initial_rate, block->acceleration_st);
+			scurve_accel_jerk    = scurve_jerk(peak_rate - initial_rate, scurve_accel_updates);
+			scurve_decel_updates = scurve_updates(peak_rate - final_rate, block->acceleration_st);
+			scurve_decel_jerk    = scurve_jerk(peak_rate - final_rate, scurve_decel_updates);
+		}
+	#endif
+
+	#ifdef INPUT_SHAPING
+		// Only X and Y are shaped, other blocks keep the trapezoid's ramps
+		uint32_t shaper_accel_rate = block->acceleration_rate, shaper_decel_rate = block->acceleration_rate;
+		uint16_t shaper_accel_box = 0, shaper_decel_box = 0;
+
+		if ( block->use_accel && ( block->steps[X_AXIS] || block->steps[Y_AXIS] )) {
+			shaper_phase(peak_rate - initial_rate, block->acceleration_st, &shaper_accel_box, &shaper_accel_rate);
+			shaper_phase(peak_rate - final_rate,   block->acceleration_st, &shaper_decel_box, &shaper_decel_rate);
+		}
+	#endif
   
 	CRITICAL_SECTION_START;  // Fill variables used by the stepper in a critical section
 		if(block->busy == false) { // Don't update variables if block is busy.
@@ -608,11 +736,27 @@ void calculate_trapezoid_for_block(block_t *block, FPTYPE entry_factor, FPTYPE e
 			block->initial_rate = initial_rate;
 			block->final_rate = final_rate;
 
+			#ifdef SCURVE
+				block->scurve_accel_jerk    = scurve_accel_jerk;
+				block->scurve_decel_jerk    = scurve_decel_jerk;
+				block->scurve_accel_updates = scurve_accel_updates;
+				block->scurve_decel_updates = scurve_decel_updates;
+			#endif
+
+			#ifdef INPUT_SHAPING
+				block->shaper_accel_rate = shaper_accel_rate;
+				block->shaper_decel_rate = shaper_decel_rate;
+				block->shaper_accel_box  = shaper_accel_box;
+				block->shaper_decel_box  = shaper_decel_box;
+			#endif
+
 			#ifdef JKN_ADVANCE
 				block->advance_lead_entry     = advance_lead_entry;
 				block->advance_lead_exit      = advance_lead_exit;
-				block->advance_lead_prime     = advance_lead_prime;
-				block->advance_lead_deprime   = advance_lead_deprime;
+				#ifdef JKN_ADVANCE_LEAD_DE_PRIME
+					block->advance_lead_prime     = advance_lead_prime;
+					block->advance_lead_deprime   = advance_lead_deprime;
+				#endif
 				block->advance_pressure_relax = advance_pressure_relax;
 			#endif
 		}
@@ -644,6 +788,7 @@ FORCE_INLINE FPTYPE initial_speed(FPTYPE acceleration, FPTYPE target_velocity, F
 			FPTYPE acceleration_original = acceleration;
 			FPTYPE distance_original = distance;
 			FPTYPE target_velocity_original = target_velocity;
+			SIMULATOR_RECORD(RECORD_SQRT, 1);
 			float  ftv = FPTOF(target_velocity);
 			float  fac = FPTOF(acceleration);
 			float   fd = FPTOF(distance);
@@ -687,15 +832,15 @@ FORCE_INLINE FPTYPE initial_speed(FPTYPE acceleration, FPTYPE target_velocity, F
 			// so as to counter the 2^(2n) scaling we did.  This means
 			// a net multiply by 2^(6-n).
 			if	(sum2 <= 0)	return 0;
-			else if	(n > 6)		return ITOFP(isqrt1(FPTOI16(sum2))) >> (n - 6);
-			else			return ITOFP(isqrt1(FPTOI16(sum2))) << (6 - n);
+			else if	(n > 6)		return SPEED_SQRT(sum2) >> (n - 6);
+			else			return SPEED_SQRT(sum2) << (6 - n);
 		#else
 			FPTYPE result;
 			if (sum2 <= 0)		result = 0;
 			#ifndef isqrt1
 				#define isqrt1(x) ((int32_t)sqrt((float)(x)))
 			#endif
-			else			result = ITOFP(isqrt1(FPTOI16(sum2)));
+			else			result = SPEED_SQRT(sum2);
 
 			if (n > 6)		result >>= (n - 6);
 			else			result <<= (6 - n);
@@ -765,6 +910,7 @@ FORCE_INLINE FPTYPE final_speed(FPTYPE acceleration, FPTYPE initial_velocity, FP
 			FPTYPE acceleration_original = acceleration;
 			FPTYPE distance_original = distance;
 			FPTYPE initial_velocity_original = initial_velocity;
+			SIMULATOR_RECORD(RECORD_SQRT, 1);
 			float  ftv = FPTOF(initial_velocity);
 			float  fac = FPTOF(acceleration);
 			float   fd = FPTOF(distance);
@@ -822,15 +968,15 @@ FORCE_INLINE FPTYPE final_speed(FPTYPE acceleration, FPTYPE initial_velocity, FP
 			// a net multiply by 2^(6-n).
 
 			if	(sum2 <= 0)	return 0;
-			else if	(n > 6)		return ITOFP(isqrt1(FPTOI16(sum2))) >> (n - 6);
-			else			return ITOFP(isqrt1(FPTOI16(sum2))) << (6 - n);
+			else if	(n > 6)		return SPEED_SQRT(sum2) >> (n - 6);
+			else			return SPEED_SQRT(sum2) << (6 - n);
 
 			//#ifdef DEBUG_ONSCREEN
 			//	Timing code
 			//	FPTYPE result;
 			//	if (sum2 <= 0) result = 0;
-			// 	else if (n > 6) result = ITOFP(isqrt1(FPTOI16(sum2))) >> (n - 6);
-			//	else result = ITOFP(isqrt1(FPTOI16(sum2))) << (6 - n);
+			// 	else if (n > 6) result = SPEED_SQRT(sum2) >> (n - 6);
+			//	else result = SPEED_SQRT(sum2) << (6 - n);
 			//	DEBUG_TIMER_FINISH;
 			//	debug_onscreen2 += DEBUG_TIMER_TCTIMER_US;
 			//	counts += 1;
@@ -841,7 +987,7 @@ FORCE_INLINE FPTYPE final_speed(FPTYPE acceleration, FPTYPE initial_velocity, FP
 			#define isqrt1(x) ((int32_t)sqrt((float)(x)))
 			FPTYPE result;
 			if (sum2 <= 0)	result = 0;
-			else		result = ITOFP(isqrt1(FPTOI16(sum2)));
+			else		result = SPEED_SQRT(sum2);
 			if (n > 6)	result >>= (n - 6);
 			else		result <<= (6 - n);
 
@@ -869,6 +1015,26 @@ FORCE_INLINE FPTYPE final_speed(FPTYPE acceleration, FPTYPE initial_velocity, FP
 
 
 
+// Square root of a non-negative FPTYPE, using the same kernel as final_speed()
+
+static FPTYPE junction_sqrt(FPTYPE x) {
+	if (x <= 0)	return 0;
+	#ifdef FIXED
+		// Normalize so one of the top 3 bits is set, and undo the 2^(2n) scaling
+		// of the argument by dividing the result by 2^n
+		uint8_t n = 0;
+		while ((x & 0xe0000000) == 0) {
+			x <<= 2;
+			n++;
+		}
+		return SPEED_SQRT(x) >> n;
+	#else
+		return FPSQRT(x);
+	#endif
+}
+
+
+
 // The kernel called by planner_recalculate() when scanning the plan from last to first entry.
 
 void planner_reverse_pass_kernel(block_t *current, block_t *next) {
@@ -905,21 +1071,20 @@ void planner_reverse_pass_kernel(block_t *current, block_t *next) {
 
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
-// implements the reverse pass.
+// implements the reverse pass.  Blocks from the tail up to and including "planned" already have
+// their final entry speeds, so we stop there.
 
-void planner_reverse_pass() {
+void planner_reverse_pass(uint8_t planned) {
 	uint8_t block_index	= block_buffer_head;
 	block_t *block[2]	= { NULL, NULL};
 
-	//Make a local copy of block_buffer_tail, because the interrupt can alter it
-	CRITICAL_SECTION_START;
-  		unsigned char tail = block_buffer_tail;
-	CRITICAL_SECTION_END;
-
-	while(block_index != tail) { 
+	while(block_index != planned) { 
 		block_index = prev_block_index(block_index); 
 		block[1]= block[0];
 		block[0] = &block_buffer[block_index];
+		#ifdef SIMULATOR
+			block[0]->passes += 1;
+		#endif
 		planner_reverse_pass_kernel(block[0], block[1]);
 	}
 }
@@ -961,15 +1126,39 @@ void planner_forward_pass_kernel(block_t *previous, block_t *current) {
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
 // implements the forward pass.
-
-void planner_forward_pass() {
-	uint8_t block_index	= block_buffer_tail;
+//
+// It also advances the "planned" watermark.  A block which leaves the forward pass at its
+// max_entry_speed is skipped by all future reverse passes, and only the forward pass can lower it
+// again, which it won't do unless the block before it changes.  So if every block before it is
+// already optimally planned, then so is this block and the watermark can move up to it.  This is
+// what keeps planner_recalculate() from re-walking the whole ring for every new block when the
+// older blocks are cruising.
+
+void planner_forward_pass(uint8_t planned) {
+	uint8_t block_index	= planned;
 	block_t *block[2]	= { NULL, NULL };
+	bool advance		= true;
 
 	while(block_index != block_buffer_head) {
 		block[0] = block[1];
 		block[1] = &block_buffer[block_index];
+		#ifdef SIMULATOR
+			block[1]->passes += 1;
+		#endif
 		planner_forward_pass_kernel(block[0],block[1]);
+
+		if ( advance && block[0] ) {
+			if ( VNEQ(block[1]->entry_speed, block[1]->max_entry_speed) )	advance = false;
+			else {
+				// The interrupt may have pushed the watermark along as the tail passed it,
+				// in which case it's already where we want it
+				CRITICAL_SECTION_START;
+					if ( block_buffer_planned == planned )	block_buffer_planned = block_index;
+				CRITICAL_SECTION_END;
+				planned = block_index;
+			}
+		}
+
 		block_index = next_block_index(block_index);
 	}
 }
@@ -978,10 +1167,11 @@ void planner_forward_pass() {
 
 // Recalculates the trapezoid speed profiles for all blocks in the plan according to the 
 // entry_factor for each junction. Must be called by planner_recalculate() after 
-// updating the blocks.
+// updating the blocks.  Blocks before "planned" (the watermark as it was before the
+// reverse and forward passes) were not touched by the passes and need no recalculation.
 
-void planner_recalculate_trapezoids() {
-	uint8_t block_index	= block_buffer_tail;
+void planner_recalculate_trapezoids(uint8_t planned) {
+	uint8_t block_index	= planned;
 	block_t *current;
 	block_t *next		= NULL;
   
@@ -1031,11 +1221,22 @@ void planner_recalculate_trapezoids() {
 // the set limit. Finally it will:
 //
 //   3. Recalculate trapezoids for all blocks.
+//
+// Only the blocks from block_buffer_planned onwards are visited, see planner_forward_pass().
 
 void planner_recalculate() {   
-	planner_reverse_pass();
-	planner_forward_pass();
-	planner_recalculate_trapezoids();
+	#ifdef MOTION_STATS
+		motion_stats.recalculations ++;
+	#endif
+
+	//Make a local copy of block_buffer_planned, because the interrupt can alter it
+	CRITICAL_SECTION_START;
+		uint8_t planned = block_buffer_planned;
+	CRITICAL_SECTION_END;
+
+	planner_reverse_pass(planned);
+	planner_forward_pass(planned);
+	planner_recalculate_trapezoids(planned);
 }
 
 
@@ -1052,6 +1253,17 @@ void plan_init(FPTYPE extruderAdvanceK, FPTYPE extruderAdvanceK2, bool zhold) {
 
 	block_buffer_head = 0;
 	block_buffer_tail = 0;
+	plan_queued_time  = 0;
+	block_buffer_planned = 0;
+
+	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
+		planner_position_delta[i] = 0;
+	plan_position_resync_state = PLAN_RESYNC_FREE;
+
+	#ifdef EVENT_QUEUE_SIZE
+		plan_pending_events = 0;
+		plan_events_started = 0;
+	#endif
 
 	// clear planner_position
 	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
@@ -1072,6 +1284,80 @@ void plan_init(FPTYPE extruderAdvanceK, FPTYPE extruderAdvanceK2, bool zhold) {
 
 
 
+#ifdef INPUT_SHAPING
+
+// The impulses of a ZV or ZVD shaper, see StepperAccelShaper.hh.  Any other type,
+// or a frequency or damping out of range, turns shaping off.
+
+void plan_set_input_shaper(uint8_t type, float frequency, float damping) {
+	shaper_t shaper;
+	shaper.impulses = 0;
+
+	if ((( type == SHAPER_ZV ) || ( type == SHAPER_ZVD )) && ( frequency > 0.0 ) &&
+	    ( damping >= 0.0 ) && ( damping < 1.0 )) {
+		float root = sqrt(1.0 - damping * damping);
+		float k    = exp(- damping * M_PI / root);
+		float half = (float)RAMP_UPDATES_PER_SEC / (2.0 * frequency * root);	// Td/2 in updates
+		float amplitude[SHAPER_MAX_IMPULSES];
+
+		if ( type == SHAPER_ZV ) {
+			shaper.impulses = 2;
+			amplitude[0] = 1.0 / (1.0 + k);
+			amplitude[1] = k   / (1.0 + k);
+		} else {
+			shaper.impulses = 3;
+			amplitude[0] = 1.0     / ((1.0 + k) * (1.0 + k));
+			amplitude[1] = 2.0 * k / ((1.0 + k) * (1.0 + k));
+			amplitude[2] = k * k   / ((1.0 + k) * (1.0 + k));
+		}
+
+		for ( uint8_t i = 0; i < shaper.impulses; i ++ ) {
+			float start = half * i + 0.5;
+			float a	    = amplitude[i] * 65536.0 + 0.5;
+			shaper.start[i]	    = ( start > 16383.0 ) ? 16383 : (uint16_t)start;
+			shaper.amplitude[i] = ( a > 65535.0 ) ? 65535 : (uint16_t)a;
+		}
+
+		// Too high a frequency to resolve, or so low that no phase is long enough
+		if (( shaper.start[1] == 0 ) || ( shaper.start[shaper.impulses - 1] >= 16383 ))
+			shaper.impulses = 0;
+	}
+
+	CRITICAL_SECTION_START;
+		input_shaper = shaper;
+	CRITICAL_SECTION_END;
+}
+
+#endif
+
+
+
+// Returns plan_queued_time, which the stepper interrupt decrements as it discards blocks
+
+static uint32_t plan_get_queued_time() {
+	CRITICAL_SECTION_START;
+		uint32_t queued_time = plan_queued_time;
+	CRITICAL_SECTION_END;
+	return queued_time;
+}
+
+
+// Sets the nominal duration of a block about to be added to the buffer, plan_commit_line()
+// adds it to plan_queued_time.  The time spent accelerating isn't included, so this
+// underestimates and the slowdown errs on the side of starting early.
+
+static void plan_block_time(block_t *block) {
+	uint32_t duration = 0xFFFF;
+
+	if ( block->nominal_rate && block->step_event_count < (1UL << (32 - PLAN_TIME_SHIFT)) ) {
+		duration = (block->step_event_count << PLAN_TIME_SHIFT) / block->nominal_rate;
+		if ( duration > 0xFFFF )	duration = 0xFFFF;
+	}
+	block->duration = (uint16_t)duration;
+}
+
+
+
 // Add a new linear movement to the buffer. 
 // planner_target[5] should be set outside this function prior to entry to denote the 
 // absolute target position in steps.
@@ -1080,12 +1366,78 @@ void plan_init(FPTYPE extruderAdvanceK, FPTYPE extruderAdvanceK2, bool zhold) {
 // The stepper module, gaurantees this never gets called with 0 steps
 void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t &extruder, bool use_accel, uint8_t active_toolhead)
 {
-	//If we have an empty buffer, then disable slowdown until the buffer has become at least 1/2 full
-	//This prevents slow start and gradual speedup at the beginning of a print, due to the SLOWDOWN algorithm
-	if ( slowdown_limit && block_buffer_head == block_buffer_tail ) disable_slowdown = true;
+	block_t *block = plan_prepare_line(feed_rate, dda_rate, extruder, use_accel, active_toolhead);
+
+	plan_commit_line();
 
-	// Calculate the buffer head after we push this byte
-	uint8_t next_buffer_head = next_block_index(block_buffer_head);
+	if ( block->use_accel )	planner_recalculate();
+
+	#ifdef SIMULATOR
+		sblock = NULL;
+	#endif
+
+	if ( ! block->use_accel )	return;
+
+	// Detect when we are at the correct height
+	// If at the correct height, detect when axis height is being changed
+	// Stop prints and call filament change menu
+	// Check for change in Z axis
+	if( (block->steps[Z_AXIS] != 0) ) {
+		// Changing Z_AXIS
+		// Check if filament change stop is enabled and if we've reached the filament change height
+		if( (stopHeightEnabled == true) && ( (stopHeightValue * 400) <= planner_target[Z_AXIS]) ) {
+
+			// Stop enabled, condition reached, turning off enable and sleeping for a filament change
+			stopHeightEnabled = false;
+#ifndef SIMULATOR
+      // queue activebuild menu (in case we are on the monitor screen
+      interface::queueScreen(InterfaceBoard::ACTIVE_BUILD_SCREEN);
+      // record the start screen here
+      Motherboard::getBoard().getInterfaceBoard().RecordOnboardStartIdx();
+      interface::queueScreen(InterfaceBoard::CHANGE_FILAMENT_SCREEN);
+			host::activePauseBuild(true, command::SLEEP_TYPE_FILAMENT);
+#endif
+		}
+	}
+}
+
+
+
+// Publishes the block prepared by plan_prepare_line() to the stepper interrupt.
+// Publishing is the single byte store to block_buffer_head, the interrupt never looks
+// at the block before then.  planner_position isn't used by the interrupt, so it's
+// updated without a critical section.
+
+void plan_commit_line()
+{
+	block_t *block = &block_buffer[block_buffer_head];
+
+	CRITICAL_SECTION_START;
+		plan_queued_time += block->duration;
+	CRITICAL_SECTION_END;
+
+	#ifdef EVENT_QUEUE_SIZE
+		block->events = plan_pending_events;
+		plan_pending_events = 0;
+	#endif
+
+	block_buffer_head = next_block_index(block_buffer_head);
+
+	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
+		planner_position[i] = planner_target[i];
+}
+
+
+
+// Computes the new block in block_buffer[block_buffer_head] with interrupts enabled.  The
+// block isn't visible to the stepper interrupt until plan_commit_line(), and only the
+// blocks already in the buffer need planner_recalculate() and its critical sections.
+
+block_t *plan_prepare_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t &extruder, bool use_accel, uint8_t active_toolhead)
+{
+	//If we have an empty buffer, then disable slowdown until slowdown_time has been queued or the buffer
+	//is 1/2 full.  This prevents slow start and gradual speedup at the beginning of a print, due to the SLOWDOWN algorithm
+	if ( slowdown_time && block_buffer_head == block_buffer_tail ) disable_slowdown = true;
 
 	// Prepare to set up new block
 	block_t *block = &block_buffer[block_buffer_head];
@@ -1099,15 +1451,29 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 	// Note the active toolhead
 	block->active_toolhead = active_toolhead;
 
-	CRITICAL_SECTION_START;
-	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
-		block->starting_position[i] = planner_position[i];
-	CRITICAL_SECTION_END;
+	// Hand any position change made since the last block over to the stepper interrupt.
+	// This is what lets "definePosition" in Steppers.cc happen without a buffer drain.
+	// No critical section is needed: the interrupt only moves plan_position_resync_state
+	// on from PLAN_RESYNC_QUEUED, and doesn't touch planner_position_delta.
+	block->position_resync  = false;
+	block->position_changed = false;
+	if ( plan_position_resync_state == PLAN_RESYNC_PENDING ) {
+		block->position_resync = true;
+		plan_position_resync_state = PLAN_RESYNC_QUEUED;
+	}
+	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
+		block->position_delta[i] = (int16_t)planner_position_delta[i];
+		if ( planner_position_delta[i] != 0 ) {
+			block->position_changed = true;
+			planner_position_delta[i] = 0;
+		}
+	}
 
 	#ifdef SIMULATOR
 		// Track how many times this block is worked on by the planner
 		// Namely, how many times it is passed to calculate_trapezoid_for_block()
 		block->planned = 0;
+		block->passes = 0;
 		block->message[0] = '\0';
 		sblock = block;
 	#endif
@@ -1142,16 +1508,17 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 	if (planner_target[A_AXIS] < planner_position[A_AXIS]) { block->direction_bits |= (1<<A_AXIS); }
 	if (planner_target[B_AXIS] < planner_position[B_AXIS]) { block->direction_bits |= (1<<B_AXIS); }
   
-	//Set block->active_extruder based on either the extruder that has steps,
+	//Set active_extruder based on either the extruder that has steps,
 	//or if 2 extruders have steps, use the current tool index that was passed to this function
 	//as extruder.
+	uint8_t active_extruder;
 	if 	(( block->steps[A_AXIS] != 0 ) && ( block->steps[B_AXIS] != 0 ))
-		block->active_extruder = extruder;
+		active_extruder = extruder;
 	else if ( block->steps[A_AXIS] != 0 )
-		block->active_extruder = A_AXIS - A_AXIS;	//0
+		active_extruder = A_AXIS - A_AXIS;	//0
 	else if ( block->steps[B_AXIS] != 0 )
-		block->active_extruder = B_AXIS - A_AXIS;	//1
-	else	block->active_extruder = extruder;
+		active_extruder = B_AXIS - A_AXIS;	//1
+	else	active_extruder = extruder;
 
 	#ifndef SIMULATOR
 		//enable active axes
@@ -1178,6 +1545,7 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 	if ( moves_queued == 0 ) {
 		for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
 			prev_speed[i] = 0;
+		prev_nominal_speed = 0;
 	}
 
 	block->nominal_rate = dda_rate;
@@ -1185,17 +1553,25 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 	#ifndef PLANNER_OFF	//Don't slowdown the buffer if the planner is constrained to a pipeline size of 1
 
 		// SLOWDOWN
-		// slow down when the buffer starts to empty, rather than wait at the corner for a buffer refill
-		if ( slowdown_limit ) {
-			//Renable slowdown if we have half filled up the buffer
-			if (( disable_slowdown ) && ( moves_queued >= slowdown_limit ))	disable_slowdown = false;
+		// slow down when the queued moves are about to run out, rather than wait at the corner for a buffer refill.
+		// What's queued is measured in time rather than blocks, so a few long moves don't slow down and many
+		// tiny segments do, however many of them are queued.  Slowing down makes the blocks last longer, so
+		// the queued time climbs back towards slowdown_time and the scaling back towards 1.
+		uint32_t queued_time = plan_get_queued_time();
+		if ( moves_queued > 1 )	SIMULATOR_RECORD(RECORD_QUEUED_TIME, (int)queued_time);
+
+		if ( slowdown_time ) {
+			//Renable slowdown once slowdown_time is queued or the buffer is half full
+			if (( disable_slowdown ) && (( queued_time >= slowdown_time ) || ( moves_queued >= (BLOCK_BUFFER_SIZE / 2) )))
+				disable_slowdown = false;
   
-			//If the buffer is less than half full, start slowing down the feed_rate
-			//according to how little we have left in the buffer
-			if ( moves_queued < slowdown_limit && (! disable_slowdown ) && moves_queued > 1) {
-				FPTYPE slowdownScaling = FPDIV(ITOFP(moves_queued), ITOFP((int32_t)slowdown_limit));
+			//Slow down the feed_rate according to how little time we have left in the buffer
+			if ( queued_time < slowdown_time && (! disable_slowdown ) && moves_queued > 1 ) {
+				FPTYPE slowdownScaling = FPDIV(ITOFP((int32_t)queued_time), ITOFP((int32_t)slowdown_time));
+				if ( slowdownScaling < KCONSTANT_0_25 )	slowdownScaling = KCONSTANT_0_25;
 				feed_rate = FPMULT2(feed_rate, slowdownScaling);
 				block->nominal_rate = (uint32_t)FPTOI(FPMULT2( ITOFP((int32_t)block->nominal_rate), slowdownScaling));
+				SIMULATOR_RECORD(RECORD_SLOWDOWN, 1);
 			}
 		}
 
@@ -1207,7 +1583,7 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 
 	//If we have a feed_rate, we calculate some stuff early, because it's also needed for non-accelerated blocks
 	if ( feed_rate != 0 ) {
-		if ( extruder_only_move )	block->millimeters = FPABS(delta_mm[A_AXIS + block->active_extruder]);
+		if ( extruder_only_move )	block->millimeters = FPABS(delta_mm[A_AXIS + active_extruder]);
 		else				block->millimeters = planner_distance;
 
 		inverse_millimeters = FPDIV(KCONSTANT_1, block->millimeters);  // Inverse millimeters to remove multiple divides 
@@ -1260,23 +1636,9 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 			block->entry_speed   = feed_rate;
 		#endif
 
-		// Max rate is sqrt(0x7fffffff) = 46,340.95 steps/s
-		block->nominal_rate_sq	= (int32_t)(block->nominal_rate * block->nominal_rate);
-
-		// Add to the buffer
-		block_buffer_head = next_buffer_head;
-
-		// Update position
-		CRITICAL_SECTION_START;
-			for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
-				planner_position[i] = planner_target[i];
-		CRITICAL_SECTION_END;
-		#ifdef SIMULATOR
-			sblock = NULL;
-		#endif
-
-		return;
+		plan_block_time(block);
 
+		return block;
 	}
 
 
@@ -1299,7 +1661,6 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 		}
 	}
 
-	block->nominal_rate_sq	= (int32_t)(block->nominal_rate * block->nominal_rate);
 	block->nominal_speed	= feed_rate; // (mm/sec) Always > 0
 
 	// Compute and limit the acceleration rate for the trapezoid generator.
@@ -1343,6 +1704,19 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 		}
 	}
 
+	#ifdef SCURVE
+		// The S-curve peaks at 4/3 of the trapezoid's acceleration (see StepperAccelSCurve.hh),
+		// so plan the trapezoid at 3/4 of the limit to keep the peak within it
+		block->acceleration_st -= block->acceleration_st >> 2;
+	#endif
+
+	#ifdef INPUT_SHAPING
+		// A shaped phase peaks at up to twice the trapezoid's acceleration (see StepperAccelShaper.hh),
+		// so plan the blocks which may be shaped at half of the limit to keep the peak within it
+		if ( input_shaper.impulses && ( block->steps[X_AXIS] || block->steps[Y_AXIS] ))
+			block->acceleration_st >>= 1;
+	#endif
+
 	// Acceleration limit to prevent overflow is 
 	if	(block->acceleration_st <= 0x7FFF)
 		// Acceleration limit to prevent overflow is 0x7FFF / axis-steps-per-mm
@@ -1373,23 +1747,22 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 			block->acceleration = FPDIV(ITOFP(((int32_t)block->acceleration_st)>>8), (steps_per_mm>>8));
 	#endif
 
-	// The value 8.388608 derives from the timer frequency used for
-	// st_interrupt().  That interrupt is driven by a timer counter which
-	// ticks at a frequency of 2 MHz.  To convert counter values to seconds
-	// the counter value needs to be divided by 2000000.  So that we
-	// can do integer arithmetic (rather than floating point), we first
-	// multiply the acceleration by the counter value and THEN divide the
-	// result by 2000000.  However, the divide can be done by a shift and
-	// it turns out that it is convenient to use >> 24 which is a divide
-	// by approximately 16777216.  That's too large by about 8.388608.
-	// Therefore, we pre-scale the acceleration here by 8.388608
+	// acceleration_rate is the change in step rate over one RAMP_UPDATE_TICKS (256 ticks
+	// of the STEPPER_TIMER_FREQUENCY timer) in 16.16, which the stepper interrupt adds
+	// to the rate of an acceleration or deceleration phase (see StepperAccelRamp.hh):
+	//
+	//    acceleration_st * 256 / STEPPER_TIMER_FREQUENCY * 65536
+	//
+	// which is acceleration_st * 8.388608 at 2 MHz
 
 	//This can potentially overflow in fixed point, due to a large block->acceleration_st,
 	//so we don't use fixed point for this calculation
 	#ifdef FIXED
-		block->acceleration_rate = (int32_t)(((int64_t)block->acceleration_st * 137439) >> 14);
+		// 137439 at 2 MHz, 8.388608 << 14
+		block->acceleration_rate = (int32_t)(((int64_t)block->acceleration_st *
+			((((int64_t)1 << 38) + (STEPPER_TIMER_FREQUENCY >> 1)) / STEPPER_TIMER_FREQUENCY)) >> 14);
 	#else
-		block->acceleration_rate = (int32_t)((FPTYPE)block->acceleration_st * 8.388608);
+		block->acceleration_rate = (int32_t)((FPTYPE)block->acceleration_st * (16777216.0 / STEPPER_TIMER_FREQUENCY));
 	#endif
   
 	//START OF YET_ANOTHER_JERK
@@ -1399,6 +1772,35 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 	if		( moves_queued == 0 ) {
 		vmax_junction = minimumPlannerSpeed;
 		scaling = FPDIV(vmax_junction, block->nominal_speed);
+	} else if	(( junction_deviation != 0 ) && ( ! extruder_only_move ) && ( prev_nominal_speed != 0 )) {
+		// Junction deviation: take the corner at the speed of a circle tangent to both moves whose
+		// edge passes within junction_deviation of the corner.  Its radius is
+		//
+		//    r = junction_deviation * sin(theta/2) / (1 - sin(theta/2))
+		//
+		// where theta is the angle between the moves, sin(theta/2) = sqrt((1 + u_prev . u) / 2)
+		// and u_prev and u are the XYZ unit vectors.  The junction speed is then sqrt(a * r)
+		FPTYPE cos_prev = FPMULT2(delta_mm[X_AXIS], prev_unit_vec[X_AXIS]) +
+				  FPMULT2(delta_mm[Y_AXIS], prev_unit_vec[Y_AXIS]) +
+				  FPMULT2(delta_mm[Z_AXIS], prev_unit_vec[Z_AXIS]);
+		cos_prev = FPMULT2(cos_prev, inverse_millimeters);
+
+		vmax_junction = min(block->nominal_speed, prev_nominal_speed);
+		if ( cos_prev < KCONSTANT_0_999 ) {
+			// Turns by more than 2.6 degrees.  1 - sin(theta/2) is worked out as
+			// (1 - sin^2(theta/2)) / (1 + sin(theta/2)) = ((1 - u_prev . u) / 2) / (1 + sin(theta/2))
+			// as it's only a few LSBs for shallow corners
+			FPTYPE sin_theta_d2 = junction_sqrt(FPMULT2(KCONSTANT_1 + cos_prev, KCONSTANT_0_5));
+			FPTYPE one_minus_sin = FPDIV(FPMULT2(KCONSTANT_1 - cos_prev, KCONSTANT_0_5), KCONSTANT_1 + sin_theta_d2);
+			// sin / (1 - sin) is about 2000 at the cutoff.  Past 1000 the speed limit,
+			// sqrt(a * junction_deviation * 1000), is above any feed rate, so the corner is
+			// left unlimited rather than risk overflowing s15.16 in the radius
+			if ( one_minus_sin > FPMULT2(sin_theta_d2, KCONSTANT_0_001) ) {
+				FPTYPE v = FPMULT2(junction_sqrt(block->acceleration),
+						   junction_sqrt(FPMULT2(junction_deviation, FPDIV(sin_theta_d2, one_minus_sin))));
+				if ( v < vmax_junction )	vmax_junction = v;
+			}
+		}
 	} else if	(block->nominal_speed <= smallest_max_speed_change) {
 		vmax_junction = block->nominal_speed;
 		// scaling remains KCONSTANT_1
@@ -1444,6 +1846,15 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 			prev_speed[i] = current_speed[i];
 	}
 
+	if ( junction_deviation != 0 ) {
+		if ( extruder_only_move )	prev_nominal_speed = 0;
+		else {
+			for ( uint8_t i = X_AXIS; i <= Z_AXIS; i ++ )
+				prev_unit_vec[i] = FPMULT2(delta_mm[i], inverse_millimeters);
+			prev_nominal_speed = block->nominal_speed;
+		}
+	}
+
 	//END OF YET ANOTHER JERK
 
 	//#ifdef DEBUG_ONSCREEN
@@ -1488,8 +1899,10 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 			block->use_advance_lead = false;
 			block->advance_lead_entry   = 0;
 			block->advance_lead_exit    = 0;
-			block->advance_lead_prime   = 0;
-			block->advance_lead_deprime = 0;
+			#ifdef JKN_ADVANCE_LEAD_DE_PRIME
+				block->advance_lead_prime   = 0;
+				block->advance_lead_deprime = 0;
+			#endif
 			block->advance_pressure_relax = 0;
 		} else {
 			block->use_advance_lead = true;
@@ -1506,16 +1919,7 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 	//	debug_onscreen2 = block->advance_pressure_relax;
 	//#endif
     
-	// Move buffer head
-	block_buffer_head = next_buffer_head;
-  
-	// Update planner_position
-	{
-		CRITICAL_SECTION_START;
-			for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
-				planner_position[i] = planner_target[i];
-		CRITICAL_SECTION_END;
-	}
+	plan_block_time(block);
 
 	//#ifdef DEBUG_ONSCREEN
 	//	#ifdef FIXED
@@ -1524,32 +1928,7 @@ void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t
 	//	#endif
 	//#endif
 
-	planner_recalculate();
-
-	#ifdef SIMULATOR
-		sblock = NULL;
-	#endif
-
-	// Detect when we are at the correct height
-	// If at the correct height, detect when axis height is being changed
-	// Stop prints and call filament change menu
-	// Check for change in Z axis
-	if( (block->steps[Z_AXIS] != 0) ) {
-		// Changing Z_AXIS
-		// Check if filament change stop is enabled and if we've reached the filament change height
-		if( (stopHeightEnabled == true) && ( (stopHeightValue * 400) <= planner_target[Z_AXIS]) ) {
-
-			// Stop enabled, condition reached, turning off enable and sleeping for a filament change
-			stopHeightEnabled = false;
-      // queue activebuild menu (in case we are on the monitor screen
-      interface::queueScreen(InterfaceBoard::ACTIVE_BUILD_SCREEN);
-      // record the start screen here
-      Motherboard::getBoard().getInterfaceBoard().RecordOnboardStartIdx();
-      interface::queueScreen(InterfaceBoard::CHANGE_FILAMENT_SCREEN);
-			host::activePauseBuild(true, command::SLEEP_TYPE_FILAMENT);
-		}
-	}
-	return;
+	return block;
 }
 
 
@@ -1575,40 +1954,96 @@ void plan_set_height_stop_enable(bool enable) {
 }
 
 
-void plan_set_position(const int32_t &x, const int32_t &y, const int32_t &z, const int32_t &a, const int32_t &b)
+// Changes the planner position of the axes first_axis to B_AXIS.  If moves are queued,
+// the stepper interrupt picks up the change when it starts the next block added.
+
+static void plan_change_position(const int32_t *position, uint8_t first_axis)
 {
+	// Only one position change too large for position_delta can be queued at a time, so
+	// with moves queued the callers hold off while plan_position_resync_busy(), as
+	// runCommandSlice() does.  This doesn't wait itself, that would stall the main loop.
+	#ifdef SIMULATOR
+		if ( plan_position_resync_busy() && movesplanned() )
+			printf("!!! plan_change_position(): called with a position resync queued !!!\n");
+	#endif
+
 	CRITICAL_SECTION_START;  // Fill variables used by the stepper in a critical section
-		planner_position[X_AXIS] = x;
-		planner_position[Y_AXIS] = y;
-		planner_position[Z_AXIS] = z;
-		planner_position[A_AXIS] = a;
-		planner_position[B_AXIS] = b;
+		bool resync = false;
+
+		for ( uint8_t i = first_axis; i < STEPPER_COUNT; i ++ ) {
+			int32_t delta = planner_position_delta[i] + position[i] - planner_position[i];
+			if ( delta > 0x7FFF || delta < -0x7FFF )	resync = true;
+			planner_position_delta[i] = delta;
+			planner_position[i] = position[i];
+		}
 
 		//If the buffer is empty, we set the stepper position to match
 		if ( movesplanned() == 0 ) {
 			st_set_position( planner_position[X_AXIS], planner_position[Y_AXIS], planner_position[Z_AXIS],
 					 planner_position[A_AXIS], planner_position[B_AXIS] );
+			resync = false;
+			plan_position_resync_state = PLAN_RESYNC_FREE;
+			for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
+				planner_position_delta[i] = 0;
 		}
 
+		//Too large for position_delta (or we've already gone that way for the next block),
+		//so send the absolute position instead
+		if ( resync || plan_position_resync_state == PLAN_RESYNC_PENDING ) {
+			for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
+				plan_position_resync[i] = planner_position[i];
+				planner_position_delta[i] = 0;
+			}
+			plan_position_resync_state = PLAN_RESYNC_PENDING;
+		}
 	CRITICAL_SECTION_END;  // Fill variables used by the stepper in a critical section
 }
 
 
 
+void plan_set_position(const int32_t &x, const int32_t &y, const int32_t &z, const int32_t &a, const int32_t &b)
+{
+	int32_t position[STEPPER_COUNT] = { x, y, z, a, b };
+
+	plan_change_position(position, X_AXIS);
+}
+
+
+
 void plan_set_e_position(const int32_t &a, const int32_t &b)
 {
-	CRITICAL_SECTION_START;  // Fill variables used by the stepper in a critical section
-		planner_position[A_AXIS] = (int32_t)a;
-		planner_position[B_AXIS] = (int32_t)b;
+	int32_t position[STEPPER_COUNT];
 
-		//If the buffer is empty, we set the stepper position to match
-		if ( movesplanned() == 0 ) {
-			st_set_e_position( planner_position[A_AXIS], planner_position[B_AXIS] );
-		}
+	position[A_AXIS] = a;
+	position[B_AXIS] = b;
+	plan_change_position(position, A_AXIS);
+}
 
-	CRITICAL_SECTION_END;  // Fill variables used by the stepper in a critical section
+
+
+#ifdef EVENT_QUEUE_SIZE
+
+void plan_add_event()
+{
+	plan_pending_events ++;
+}
+
+
+
+// Blocks the stepper interrupt has started already counted their events in plan_events_started,
+// clearing their count again does no harm.
+
+void plan_discard_events()
+{
+	CRITICAL_SECTION_START;
+		for ( uint8_t i = block_buffer_tail; i != block_buffer_head; i = next_block_index(i) )
+			block_buffer[i].events = 0;
+		plan_pending_events = 0;
+	CRITICAL_SECTION_END;
 }
 
+#endif
+
 
 
 #ifdef ACCEL_STATS
@@ -1648,3 +2083,16 @@ void accelStatsGet(float *minSpeed, float *avgSpeed, float *maxSpeed) {
 }
 
 #endif
+
+
+
+#ifdef MOTION_STATS
+
+void motionStatsReset() {
+	CRITICAL_SECTION_START;
+		memset((void *)&motion_stats, 0, sizeof(motion_stats));
+		motion_stats.occupancy_min = BLOCK_BUFFER_SIZE;
+	CRITICAL_SECTION_END;
+}
+
+#endif
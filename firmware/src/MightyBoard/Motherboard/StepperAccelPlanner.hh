@@ -30,6 +30,7 @@
 #define STEPPERACCELPLANNER_HH
 
 #include <stdio.h>
+#include <stddef.h>
 #include "avrfix.h"
 #include "Configuration.hh"
 
@@ -66,6 +67,7 @@
 	#define KCONSTANT_0_25		16384		//ftok(0.25)
 	#define KCONSTANT_0_5		32768		//ftok(0.5)
 	#define KCONSTANT_0_95		62259		//ftok(0.95)
+	#define KCONSTANT_0_999		65470		//ftok(0.999)
 	#define KCONSTANT_1		65536		//ftok(1.0)
 	#define KCONSTANT_3             196608          //ftok(3.0)
 	#define KCONSTANT_8_388608	549755		//ftok(8.388608)
@@ -126,6 +128,7 @@
 	#define KCONSTANT_0_25		0.25
 	#define KCONSTANT_0_5		0.5
 	#define KCONSTANT_0_95		0.95
+	#define KCONSTANT_0_999		0.999
 	#define KCONSTANT_1		1.0
 	#define KCONSTANT_3             3.0
 	#define KCONSTANT_8_388608	8.388608
@@ -161,6 +164,17 @@
 	#define FPCEIL(x)		(KCONSTANT_0_5 + (x))
 #endif
 
+//Square root used by initial_speed() / final_speed() when FIXED.  SQRT_TABLE selects the table
+//seeded Newton step in StepperAccelSqrt.hh, otherwise isqrt1() is used.  Build with "scons sqrt=isqrt1"
+//to select isqrt1()
+#ifndef NO_SQRT_TABLE
+	#define SQRT_TABLE
+#else
+	#ifdef SQRT_TABLE
+		#undef SQRT_TABLE
+	#endif
+#endif
+
 //Limits
 //The largest / smallest values that can be stored in FPTYPE 
 //(which is s15.16, where s is sign and 15 bits = 0x7FFF)
@@ -180,8 +194,34 @@
 
 // The number of linear motions that can be in the plan at any give time.
 // THE BLOCK_BUFFER_SIZE NEEDS TO BE A POWER OF 2, i.g. 8,16,32 because shifts and ors are used to do the ringbuffering.
-// Values less than 16 would not be wise
-#define BLOCK_BUFFER_SIZE 16 // maximize block buffer
+// Values less than 16 would not be wise.  The compaction of block_t, see the check following it,
+// is what would make 32 possible, but 32 blocks take another 1.5KB to 1.7KB of SRAM over 16 and
+// no board's SRAM use has been measured with it.  So no board defines it, and the default is 16.
+#ifndef BLOCK_BUFFER_SIZE
+	#define BLOCK_BUFFER_SIZE 16 // maximize block buffer
+#endif
+
+// Largest block_t we allow, 32 blocks of this size take 3.1KB of SRAM.
+// SCURVE and INPUT_SHAPING each add 12 bytes of precomputed ramp parameters per block.
+// EVENT_QUEUE_SIZE adds the 1 byte events count.
+#if defined(SCURVE) && defined(INPUT_SHAPING)
+	#error "SCURVE and INPUT_SHAPING can't both be defined"
+#endif
+// JKN_ADVANCE_LEAD_DE_PRIME adds the 4 bytes of the prime and deprime leads.
+#if defined(SCURVE) || defined(INPUT_SHAPING)
+	#define BLOCK_T_BASE_SIZE 110
+#else
+	#define BLOCK_T_BASE_SIZE 98
+#endif
+#ifdef JKN_ADVANCE_LEAD_DE_PRIME
+	#define BLOCK_T_MAX_SIZE (BLOCK_T_BASE_SIZE + 4)
+#else
+	#define BLOCK_T_MAX_SIZE BLOCK_T_BASE_SIZE
+#endif
+
+// Block durations and the queued time used by the slowdown are in units of 1/8192 seconds
+#define PLAN_TIME_SHIFT		13
+#define PLAN_TIME_UNITS_PER_SEC	(1L << PLAN_TIME_SHIFT)
 
 // When SAVE_SPACE is defined, the code doesn't take some optimizations which
 // which lead to additional program space usage.
@@ -189,24 +229,38 @@
 
 // This struct is used when buffering the setup for each linear movement "nominal" values are as specified in 
 // the source g-code and may never actually be reached if acceleration management is active.
+//
+// SRAM is what limits BLOCK_BUFFER_SIZE, so keep this small.  Values which can be derived from
+// other fields are computed when needed rather than stored, and flags are packed into bits.
 typedef struct {
 	// Fields used by the bresenham algorithm for tracing the line
 	int32_t		steps[STEPPER_COUNT];			// Step count along each axis
 	uint32_t	step_event_count;			// The number of step events required to complete this block
-	int32_t		starting_position[STEPPER_COUNT];
+	int16_t		position_delta[STEPPER_COUNT];		// Position change from plan_set_position() since the previous block (position_changed)
 	int32_t		accelerate_until;			// The index of the step event on which to stop acceleration
 	int32_t		decelerate_after;			// The index of the step event on which to start decelerating
-	int32_t		acceleration_rate;			// The acceleration rate used for acceleration calculation
+	int32_t		acceleration_rate;			// Change in step rate per RAMP_UPDATE_TICKS, 16.16
 	unsigned char	direction_bits;				// The direction bit set for this block (refers to *_DIRECTION_BIT in config.h)
-	unsigned char	active_extruder;			// Selects the active extruder
-	uint8_t		active_toolhead;			// The toolhead currently active.  Note this isn't the same as active extruder
 	#ifdef JKN_ADVANCE
-		bool	use_advance_lead;
 		int16_t	advance_lead_entry;
 		int16_t	advance_lead_exit;
 		int32_t	advance_pressure_relax;			//Decel phase only
-		int16_t	advance_lead_prime;
-		int16_t	advance_lead_deprime;
+		#ifdef JKN_ADVANCE_LEAD_DE_PRIME
+			int16_t	advance_lead_prime;
+			int16_t	advance_lead_deprime;
+		#endif
+	#endif
+	#ifdef SCURVE
+		uint32_t	scurve_accel_jerk;		// Jerk for the acceleration phase, see StepperAccelSCurve.hh
+		uint32_t	scurve_decel_jerk;		// Jerk for the deceleration phase
+		uint16_t	scurve_accel_updates;		// Length of the acceleration phase in SCURVE_UPDATE_TICKS
+		uint16_t	scurve_decel_updates;		// Length of the deceleration phase in SCURVE_UPDATE_TICKS
+	#endif
+	#ifdef INPUT_SHAPING
+		uint32_t	shaper_accel_rate;		// Acceleration of each box of the acceleration phase, see StepperAccelShaper.hh
+		uint32_t	shaper_decel_rate;		// Acceleration of each box of the deceleration phase
+		uint16_t	shaper_accel_box;		// Length of the boxes in RAMP_UPDATE_TICKS, 0 when not shaped
+		uint16_t	shaper_decel_box;
 	#endif
 
 	// Fields used by the motion planner to manage acceleration
@@ -215,39 +269,78 @@ typedef struct {
 	FPTYPE		max_entry_speed;			// Maximum allowable junction entry speed in mm/min
 	FPTYPE		millimeters;				// The total travel of this block in mm
 	FPTYPE		acceleration;				// acceleration mm/sec^2
-	unsigned char	recalculate_flag;			// Planner flag to recalculate trapezoids on entry junction
-	unsigned char	nominal_length_flag;			// Planner flag for nominal speed always reached
 
 	// Settings for the trapezoid generator
 	uint32_t	nominal_rate;				// The nominal step rate for this block in step_events/sec 
-	int32_t		nominal_rate_sq;			// nominal_rate * nominal_rate
 	uint32_t	initial_rate;				// The jerk-adjusted step rate at start of block  
 	uint32_t	final_rate;				// The minimal rate at exit
 	uint32_t	acceleration_st;			// acceleration steps/sec^2
-	char		use_accel;				// Use acceleration when true
-	char		speed_changed;				// Entry speed has changed
+	uint16_t	duration;				// Nominal duration of the block in PLAN_TIME_UNITS, added to plan_queued_time
+
+	// Flags.  busy is written by the stepper interrupt, so it's kept out of the bit fields
+	unsigned char	recalculate_flag	: 1;	// Planner flag to recalculate trapezoids on entry junction
+	unsigned char	nominal_length_flag	: 1;	// Planner flag for nominal speed always reached
+	unsigned char	use_accel		: 1;	// Use acceleration when true
+	unsigned char	speed_changed		: 1;	// Entry speed has changed
+	unsigned char	use_advance_lead	: 1;	// Apply JKN advance to this block
+	unsigned char	active_toolhead		: 1;	// The toolhead currently active.  Note this isn't the same as active extruder
+	unsigned char	position_changed	: 1;	// Add position_delta to the stepper position when starting this block
+	unsigned char	position_resync		: 1;	// Load the stepper position from plan_position_resync when starting this block
 	volatile char	busy;
 
+	#ifdef EVENT_QUEUE_SIZE
+		uint8_t	events;				// Count of the events from plan_add_event() which run when this block starts
+	#endif
+
+	uint8_t		dda_master_axis_index;
+	uint8_t		axesEnabled;
+
+	// Debugging fields follow axesEnabled, so they're left out of the size check below
+
+	#ifdef DEBUG_BLOCK_BY_MOVE_INDEX
+		uint32_t move_index;
+	#endif
+
 	#ifdef SIMULATOR
 		FPTYPE	feed_rate;				// Original feed rate before being modified for nomimal_speed
 		int	planned;				// Count of the number of times the block was passed to caclulate_trapezoid_for_block()
+		int	passes;				// Count of the number of times the block was visited by the reverse and forward passes
 		char	message[1024];
 	#endif
+}
+#ifdef SIMULATOR
+	// Without padding, as on the AVR, so that the size check holds for the firmware
+	__attribute__((packed))
+#endif
+block_t;
 
-	#ifdef DEBUG_BLOCK_BY_MOVE_INDEX
-		uint32_t move_index;
-	#endif
+// Compile time check that block_t hasn't outgrown BLOCK_T_MAX_SIZE.  If this fails
+// with "size of array is negative", then block_t has grown.
+typedef char block_t_size_check[(offsetof(block_t, axesEnabled) + sizeof(uint8_t) <= BLOCK_T_MAX_SIZE) ? 1 : -1];
 
-	uint8_t		dda_master_axis_index;
-	uint8_t		axesEnabled;
-} block_t;
+// States for plan_position_resync
+#define PLAN_RESYNC_FREE	0	// Not in use
+#define PLAN_RESYNC_PENDING	1	// Holds the starting position for the next block added
+#define PLAN_RESYNC_QUEUED	2	// Attached to a block which the stepper interrupt hasn't started yet
 
 // Initialize the motion plan subsystem      
 void plan_init(FPTYPE extruderAdvanceK, FPTYPE extruderAdvanceK2, bool zhold);
 
+#ifdef INPUT_SHAPING
+	// Set the input shaper applied to moves in X and Y, a ShaperType from StepperAccelShaper.hh
+	// for a resonance of frequency Hz and damping ratio damping
+	void plan_set_input_shaper(uint8_t type, float frequency, float damping);
+#endif
+
 // Add a new linear movement to the buffer.
 void plan_buffer_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t &extruder, bool use_accel, uint8_t active_toolhead);
 
+// The two phases of plan_buffer_line().  plan_prepare_line() computes the new block with
+// interrupts enabled; plan_commit_line() publishes it to the stepper interrupt.  Accelerated
+// blocks then need planner_recalculate().
+block_t *plan_prepare_line(FPTYPE feed_rate, const uint32_t &dda_rate, const uint8_t &extruder, bool use_accel, uint8_t active_toolhead);
+void plan_commit_line();
+
 // Fetch value (from the EEPROM) used to pause print so the filament can be changed midprint at a specific height and receive the enable variable
 void plan_read_height_stop_position(bool height_stop_enable);
 // Return enable variable
@@ -255,6 +348,19 @@ bool plan_get_height_stop_enable();
 // Set height stop variable
 void plan_set_height_stop_enable(bool enable);
 
+#ifdef EVENT_QUEUE_SIZE
+	// Motion synchronised events.  Commands like a temperature or fan change are run when the
+	// stepper interrupt starts the block after them, instead of draining the buffer first.
+	// plan_add_event() attaches an event to the next block added, and the stepper interrupt adds
+	// a block's events to plan_events_started (which wraps) when it starts the block.  The caller
+	// keeps the events themselves, in order, and runs them as plan_events_started counts them.
+	extern volatile uint8_t plan_events_started;
+	void plan_add_event();
+
+	// Drops the events attached to blocks not yet started, or not yet attached at all
+	void plan_discard_events();
+#endif
+
 // Set position. Used for G92 instructions.
 void plan_set_position(const int32_t &x, const int32_t &y, const int32_t &z, const int32_t &a, const int32_t &b);
 void plan_set_e_position(const int32_t &a, const int32_t &b);
@@ -276,6 +382,7 @@ extern uint32_t		p_acceleration;						// Normal acceleration mm/s^2  THIS IS THE
 extern uint32_t		p_retract_acceleration;					//  mm/s^2   filament pull-pack and push-forward  while standing still in the other axis M204 TXXXX
 extern FPTYPE		max_speed_change[STEPPER_COUNT];			//The speed between junctions in the planner, reduces blobbing
 extern FPTYPE		smallest_max_speed_change;
+extern FPTYPE		junction_deviation;					//Junction deviation in mm, 0 = use max_speed_change instead
 
 extern FPTYPE		minimumSegmentTime;
 extern uint32_t		axis_steps_per_sqr_second[STEPPER_COUNT];
@@ -286,7 +393,7 @@ extern FPTYPE		minimumPlannerSpeed;
 extern uint32_t		planner_master_steps;
 extern uint8_t		planner_master_steps_index;
 extern int32_t		planner_steps[STEPPER_COUNT];
-extern int		slowdown_limit;
+extern uint32_t		slowdown_time;
 extern int32_t		planner_position[STEPPER_COUNT];
 extern int32_t		planner_target[STEPPER_COUNT];
 extern uint32_t		axis_accel_step_cutoff[STEPPER_COUNT];
@@ -295,17 +402,45 @@ extern block_t		block_buffer[BLOCK_BUFFER_SIZE];			// A ring buffer for motion i
 
 extern volatile unsigned char	block_buffer_head;				// Index of the next block to be pushed
 extern volatile unsigned char	block_buffer_tail; 
+extern volatile unsigned char	block_buffer_planned;				// Index of the first block which may still be re-planned
+extern volatile uint32_t	plan_queued_time;				// Sum of the durations of the blocks in the buffer
+
+extern int32_t			plan_position_resync[STEPPER_COUNT];		// Starting position for the block flagged position_resync
+extern volatile uint8_t		plan_position_resync_state;
 
 #ifdef ACCEL_STATS
 	extern void accelStatsGet(float *minSpeed, float *avgSpeed, float *maxSpeed);
 #endif
 
+#ifdef MOTION_STATS
+	// Counters reported by HOST_CMD_GET_MOTION_STATS, they tell a host starved print (underruns, low
+	// occupancy) from a planner bound (recalculations) or interrupt bound (isr_max_ticks, step_loops) one
+	typedef struct {
+		uint32_t	handovers;		// Times the interrupt finished a block
+		uint32_t	occupancy_sum;		// Sum of movesplanned() after each handover
+		uint8_t		occupancy_min;		// Lowest movesplanned() after a handover
+		uint16_t	underruns;		// Handovers which found the buffer empty
+		uint32_t	recalculations;		// Calls to planner_recalculate()
+		uint16_t	isr_max_ticks;		// Longest stepper interrupt in stepper timer ticks, from the compare match
+		uint32_t	step_loops[4];		// Interrupts stepping 1, 2, 4 and 8 times
+		uint32_t	prefetched;		// Blocks started from st_prefetch_next_block()'s setup (BLOCK_PREFETCH)
+	} motion_stats_t;
+
+	extern volatile motion_stats_t motion_stats;
+
+	extern void motionStatsReset();
+#endif
+
 
 // Called when the current block is no longer needed. Discards the block and makes the memory
 // availible for new blocks.    
 FORCE_INLINE void plan_discard_current_block()  
 {
 	if (block_buffer_head != block_buffer_tail) {
+		// Don't leave the planned watermark behind the tail
+		if ( block_buffer_planned == block_buffer_tail )
+			block_buffer_planned = (block_buffer_tail + 1) & (BLOCK_BUFFER_SIZE - 1);
+		plan_queued_time -= block_buffer[block_buffer_tail].duration;
 		block_buffer_tail = (block_buffer_tail + 1) & (BLOCK_BUFFER_SIZE - 1);  
 	}
 }
@@ -337,4 +472,12 @@ FORCE_INLINE uint8_t movesplanned()
 	return (block_buffer_head-block_buffer_tail + BLOCK_BUFFER_SIZE) & (BLOCK_BUFFER_SIZE - 1);
 }
 
+// Returns true when a position change too large for position_delta is still waiting for the
+// stepper interrupt.  Only one of those can be queued at a time, so callers of plan_set_position()
+// with moves queued should hold off until this is false.
+FORCE_INLINE bool plan_position_resync_busy()
+{
+	return plan_position_resync_state == PLAN_RESYNC_QUEUED;
+}
+
 #endif
@@ -0,0 +1,59 @@
+#ifndef STEPPERACCELRAMP_HH
+#define STEPPERACCELRAMP_HH
+
+// Constant acceleration (trapezoid) velocity ramps for the stepper interrupt
+//
+// During an acceleration or deceleration phase the step rate is
+//
+//    rate(t) = rate(0) +/- a t
+//
+// Rather than multiplying the ticks since the start of the phase by a on
+// every interrupt, the rate is advanced every RAMP_UPDATE_TICKS timer ticks
+// by the block's acceleration_rate, which the planner precomputes as the
+// change in step rate per update in 16.16 (see calculate_trapezoid_for_block()).
+// The interrupt then only multiplies the number of updates due, one or two
+// at high step rates where the interval between interrupts is short, by
+// acceleration_rate, with 16 bit multiplies.
+
+#include <inttypes.h>
+
+#define RAMP_UPDATE_TICKS	256	// 128us at 2MHz
+#define RAMP_UPDATE_SHIFT	8	// log2(RAMP_UPDATE_TICKS)
+
+typedef struct {
+	uint32_t	delta;		// Change in step rate so far, 16.16
+	uint32_t	accel;		// Change in step rate per update, 16.16
+} ramp_t;
+
+static inline void ramp_start(ramp_t *r, uint32_t accel)
+{
+	r->delta	= 0;
+	r->accel	= accel;
+}
+
+// Consumes updates from *ticks and returns the change in step rate since
+// ramp_start().  An update is made once half of it has elapsed, so the ticks
+// are rounded to the nearest update rather than truncated and the rate
+// doesn't lag the exact ramp.  All the updates due are made at once, without
+// a loop.
+
+static inline uint16_t ramp_delta(ramp_t *r, int32_t *ticks)
+{
+	int32_t n = (*ticks + (RAMP_UPDATE_TICKS / 2)) >> RAMP_UPDATE_SHIFT;
+	if ( n <= 0 )	return (uint16_t)(r->delta >> 16);
+	*ticks -= n << RAMP_UPDATE_SHIFT;
+
+	// n * accel, by its whole and fractional parts so that a wrap can be seen
+	uint32_t whole = (uint32_t)n * (uint16_t)(r->accel >> 16);
+	uint32_t step  = (whole << 16) + (uint32_t)n * (uint16_t)r->accel;
+	uint32_t delta = r->delta + step;
+
+	// Saturate rather than wrap if the phase runs past 65535 steps/s of change,
+	// the caller clamps to the block's rates
+	if (( whole > 0xFFFF ) || ( step < (whole << 16) ) || ( delta < r->delta ))
+		delta = 0xFFFFFFFF;
+	r->delta = delta;
+	return (uint16_t)(r->delta >> 16);
+}
+
+#endif
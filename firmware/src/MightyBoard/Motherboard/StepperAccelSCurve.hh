@@ -0,0 +1,86 @@
+#ifndef STEPPERACCELSCURVE_HH
+#define STEPPERACCELSCURVE_HH
+
+// Jerk limited (S-curve) velocity ramps for the stepper interrupt
+//
+// An acceleration or deceleration phase which the trapezoid generator would
+// run at a constant acceleration a for T = dv / a seconds is instead split
+// into three parts of n, m, n rate updates:
+//
+//    accel ramps up 0 -> A, holds at A, ramps down A -> 0
+//
+// The rate is updated every SCURVE_UPDATE_TICKS timer ticks.  The ramp is
+// symmetric about the middle of the phase, so for the same duration T it
+// covers the same distance as the trapezoid and the step counts computed by
+// the planner remain valid.  With n = 1/4 of the updates the peak
+// acceleration is A = 4/3 a, so the planner uses 3/4 of the configured
+// acceleration for a to keep A within it.
+//
+// The planner precomputes the number of updates and the jerk for each phase
+// (see calculate_trapezoid_for_block()); the interrupt then only adds.
+
+#include <inttypes.h>
+
+#define SCURVE_UPDATE_TICKS	512	// 256us at 2MHz
+#define SCURVE_UPDATES_PER_SEC	(STEPPER_TIMER_FREQUENCY / SCURVE_UPDATE_TICKS)
+
+typedef struct {
+	uint32_t	delta;		// Change in step rate so far, 16.16
+	uint32_t	accel;		// Change in step rate per update, 16.16
+	uint32_t	jerk;		// Change in accel per update during the ramps, 16.16
+	uint16_t	update;		// Updates made so far
+	uint16_t	ramp_up_end;	// First update after the accel ramps up
+	uint16_t	ramp_down_start;// First update of the accel ramping down
+	uint16_t	updates;	// Total updates in the phase
+} scurve_t;
+
+// Number of updates for each of the two jerk ramps of a phase of updates updates
+
+static inline uint16_t scurve_ramp_updates(uint16_t updates)
+{
+	uint16_t n = updates >> 2;
+	return n ? n : 1;
+}
+
+// Total updates actually run for a phase of updates updates (at least one
+// update for each of the two ramps)
+
+static inline uint16_t scurve_total_updates(uint16_t updates)
+{
+	uint16_t n = scurve_ramp_updates(updates);
+	return (updates < 2 * n) ? 2 * n : updates;
+}
+
+static inline void scurve_start(scurve_t *s, uint32_t jerk, uint16_t updates)
+{
+	s->delta		= 0;
+	s->accel		= 0;
+	s->jerk			= jerk;
+	s->update		= 0;
+	s->ramp_up_end		= scurve_ramp_updates(updates);
+	s->updates		= scurve_total_updates(updates);
+	s->ramp_down_start	= s->updates - s->ramp_up_end;
+}
+
+// Consumes whole updates from *ticks and returns the change in step rate
+// since scurve_start()
+
+static inline uint16_t scurve_delta(scurve_t *s, int32_t *ticks)
+{
+	while ( *ticks >= SCURVE_UPDATE_TICKS ) {
+		if ( s->update >= s->updates ) {
+			*ticks = 0;
+			break;
+		}
+		*ticks -= SCURVE_UPDATE_TICKS;
+		if ( s->update < s->ramp_up_end )
+			s->accel += s->jerk;
+		else if ( s->update >= s->ramp_down_start )
+			s->accel -= s->jerk;
+		s->delta += s->accel;
+		s->update++;
+	}
+	return (uint16_t)(s->delta >> 16);
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef STEPPERACCELSHAPER_HH
+#define STEPPERACCELSHAPER_HH
+
+// Input shaped velocity ramps for the stepper interrupt
+//
+// An input shaper convolves the commanded acceleration with a train of
+// impulses, of amplitudes A_i summing to 1 at times t_i, such that the
+// ringing each impulse excites at the resonant frequency is cancelled by the
+// others.  For a resonance of damping ratio z and damped period Td, with
+// K = exp(-z pi / sqrt(1 - z^2)):
+//
+//    ZV:   t = 0, Td/2       A = 1, K        / (1 + K)
+//    ZVD:  t = 0, Td/2, Td   A = 1, 2K, K^2  / (1 + K)^2
+//
+// An acceleration or deceleration phase which the trapezoid generator would
+// run at a constant acceleration a for T seconds is instead run as the sum of
+// one box of acceleration a' per impulse, each lasting T - t_last and started
+// at t_i.  The phase keeps its duration T and its change in step rate.  The
+// undamped shapers are symmetric about the middle of the phase, so it also
+// covers the same distance as the trapezoid and the step counts computed by
+// the planner remain valid.  With damping the phase covers a little more,
+// by A_last * t_last / 2 of the change in rate at most, and the interrupt's
+// clamping to the block's rates absorbs it.  The cost is a peak
+// acceleration of a' = a T / (T - t_last), at most 2a as the shorter phases
+// aren't shaped, so the planner halves a for the blocks it may shape.
+//
+// The rate is updated every RAMP_UPDATE_TICKS, as the trapezoid's is.  The
+// planner precomputes the box length and a' for each phase of the blocks
+// which move X or Y (see calculate_trapezoid_for_block()); phases shorter
+// than the shaper, and the other blocks, run the trapezoid's ramp.  The
+// interrupt splits a' between the impulses when it starts a phase and then
+// only adds.
+
+#include <inttypes.h>
+#include "StepperAccelRamp.hh"
+
+#define RAMP_UPDATES_PER_SEC	(STEPPER_TIMER_FREQUENCY / RAMP_UPDATE_TICKS)
+
+#define SHAPER_MAX_IMPULSES	3
+
+// INPUT_SHAPER_TYPE in the EEPROM
+enum ShaperType {
+	SHAPER_NONE = 0,
+	SHAPER_ZV,
+	SHAPER_ZVD
+};
+
+typedef struct {
+	uint8_t		impulses;			// 0 when shaping is off
+	uint16_t	start[SHAPER_MAX_IMPULSES];	// Update on which each impulse starts, start[0] is 0
+	uint16_t	amplitude[SHAPER_MAX_IMPULSES];	// Amplitude of each impulse, 0.16.  The last one takes
+							// the remainder of 1 and isn't used
+} shaper_t;
+
+extern shaper_t input_shaper;
+
+typedef struct {
+	uint32_t	delta;				// Change in step rate so far, 16.16
+	uint32_t	accel;				// Change in step rate per update, 16.16
+	uint32_t	step[SHAPER_MAX_IMPULSES];	// Each impulse's share of a', 16.16
+	uint16_t	start[SHAPER_MAX_IMPULSES];	// Update on which each impulse's box starts
+	uint16_t	update;				// Updates made so far
+	uint16_t	box;				// Updates in each box
+	uint8_t		impulses;			// 0 for the trapezoid's constant acceleration
+} shaper_ramp_t;
+
+// accel * amplitude with amplitude in 0.16, using 16 x 16 bit multiplies
+
+static inline uint32_t shaper_scale(uint32_t accel, uint16_t amplitude)
+{
+	return (uint32_t)(uint16_t)(accel >> 16) * amplitude +
+	       (((uint32_t)(uint16_t)accel * amplitude) >> 16);
+}
+
+// Starts a phase with boxes of box updates at an acceleration of accel (a')
+// in 16.16 step rate per update.  A box of 0 runs the trapezoid's ramp at
+// accel instead.
+
+static inline void shaper_start(shaper_ramp_t *s, uint32_t accel, uint16_t box)
+{
+	s->delta	= 0;
+	s->update	= 0;
+	s->box		= box;
+
+	if (( box == 0 ) || ( input_shaper.impulses == 0 )) {
+		s->impulses	= 0;
+		s->accel	= accel;
+		return;
+	}
+
+	s->impulses	= input_shaper.impulses;
+	s->accel	= 0;
+
+	uint8_t last = s->impulses - 1;
+	for ( uint8_t i = 0; i < last; i ++ ) {
+		s->step[i]	= shaper_scale(accel, input_shaper.amplitude[i]);
+		s->start[i]	= input_shaper.start[i];
+		accel		-= s->step[i];
+	}
+	s->step[last]	= accel;
+	s->start[last]	= input_shaper.start[last];
+}
+
+// Consumes updates from *ticks and returns the change in step rate since
+// shaper_start().  As ramp_delta(), an update is made once half of it has
+// elapsed.
+
+static inline uint16_t shaper_delta(shaper_ramp_t *s, int32_t *ticks)
+{
+	while ( *ticks >= (RAMP_UPDATE_TICKS / 2) ) {
+		*ticks -= RAMP_UPDATE_TICKS;
+
+		for ( uint8_t i = 0; i < s->impulses; i ++ ) {
+			if	( s->update == s->start[i] )		s->accel += s->step[i];
+			else if ( s->update == s->start[i] + s->box )	s->accel -= s->step[i];
+		}
+		if ( s->update != 0xFFFF )	s->update ++;
+
+		// Saturate rather than wrap, as ramp_delta()
+		uint32_t delta = s->delta + s->accel;
+		s->delta = ( delta < s->delta ) ? 0xFFFFFFFF : delta;
+	}
+	return (uint16_t)(s->delta >> 16);
+}
+
+#endif
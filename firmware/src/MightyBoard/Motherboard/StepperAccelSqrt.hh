@@ -0,0 +1,58 @@
+#ifndef STEPPERACCELSQRT_HH
+#define STEPPERACCELSQRT_HH
+
+// Square root kernel for initial_speed() and final_speed() in StepperAccelPlanner.cc
+//
+// Those routines shift their argument left in pairs of bits until one of the
+// top three bits is set, so the kernel only has to handle 2^29 <= x < 2^31.
+// The top 6 bits of x select a seed s0 = sqrt(midpoint of the interval) which
+// is then refined with one Newton step,
+//
+//    s1 = s0 + (x - s0^2) / (2 s0)
+//
+// The division is replaced with a multiply by the tabulated 2^25 / s0, so the
+// kernel is two 16x16 multiplies and two table reads.  The result has a
+// relative error below 1.2e-4, against 1.1e-2 for isqrt1() on the top 16 bits.
+//
+// Table entries are { round(sqrt((i + 0.5) * 2^25)), round(2^25 / s0) } for
+// i = 16 .. 63.  simulator/sqrtbench checks the kernel against isqrt1(),
+// sqrtk() and sqrt().
+
+#include <inttypes.h>
+
+#ifdef SIMULATOR
+	#define SQRT_PROGMEM
+	#define sqrt_read_word(addr)	(*(addr))
+#else
+	#include <avr/pgmspace.h>
+	#define SQRT_PROGMEM		PROGMEM
+	#define sqrt_read_word(addr)	pgm_read_word_near(addr)
+#endif
+
+#define SQRT_TABLE_FIRST	16	// x >> 25 for x = 2^29
+
+const uint16_t sqrt_lookuptable[48][2] SQRT_PROGMEM = {\
+{ 23530, 1426}, { 24232, 1385}, { 24915, 1347}, { 25580, 1312}, { 26227, 1279}, { 26859, 1249},
+{ 27477, 1221}, { 28081, 1195}, { 28672, 1170}, { 29251, 1147}, { 29819, 1125}, { 30377, 1105},
+{ 30924, 1085}, { 31462, 1067}, { 31991, 1049}, { 32511, 1032}, { 33023, 1016}, { 33527, 1001},
+{ 34024, 986}, { 34514, 972}, { 34996, 959}, { 35472, 946}, { 35942, 934}, { 36406, 922},
+{ 36864, 910}, { 37316, 899}, { 37763, 889}, { 38205, 878}, { 38642, 868}, { 39073, 859},
+{ 39500, 849}, { 39923, 840}, { 40341, 832}, { 40755, 823}, { 41164, 815}, { 41570, 807},
+{ 41972, 799}, { 42369, 792}, { 42763, 785}, { 43154, 778}, { 43541, 771}, { 43925, 764},
+{ 44305, 757}, { 44682, 751}, { 45056, 745}, { 45427, 739}, { 45795, 733}, { 46160, 727}
+};
+
+// Returns sqrt(x) for 2^29 <= x < 2^31
+
+static inline uint16_t isqrt_table_newton(uint32_t x)
+{
+	const uint16_t *entry = sqrt_lookuptable[(uint8_t)(x >> 25) - SQRT_TABLE_FIRST];
+	uint16_t s0 = sqrt_read_word(entry);
+
+	// |x - s0^2| < 2^24 + s0, so the residual fits in an int16_t after dropping 10 bits
+	int16_t residual = (int16_t)((int32_t)(x - (uint32_t)s0 * s0) >> 10);
+
+	return s0 + (int16_t)(((int32_t)residual * sqrt_read_word(entry + 1)) >> 16);
+}
+
+#endif
@@ -49,16 +49,25 @@ volatile int16_t e_steps[EXTRUDERS];
 volatile uint8_t axesEnabled;			//Planner axis enabled
 volatile uint8_t axesHardwareEnabled;		//Hardware axis enabled
 
+uint8_t endstops_invert;			//Endstops with invert_endstop set
+uint8_t endstops_direction;			//The endstop each axis of the current block moves towards
+uint8_t endstops_blocked;			//Axes whose steps are blocked by an endstop
+volatile int32_t endstop_trigger_position[Z_AXIS + 1];	//dda_position at which homing on the axis finished
+
+#ifdef SIMULATOR
+uint8_t (*eeprom::simulator_eeprom_read8)(const uint16_t location) = 0;
+#endif
+
 
 
 /// Initialize a stepper axis
 void stepperAxisInit(bool hard_reset) {
-	uint8_t axes_invert = 0, endstops_invert = 0;
+	uint8_t axes_invert = 0, endstops_eeprom = 0;
 
 	if ( hard_reset ) {
 		//Load the defaults
 		axes_invert	= eeprom::getEeprom8(eeprom_offsets::AXIS_INVERSION, 0);
-		endstops_invert = eeprom::getEeprom8(eeprom_offsets::ENDSTOP_INVERSION, 0);
+		endstops_eeprom = eeprom::getEeprom8(eeprom_offsets::ENDSTOP_INVERSION, 0);
 	
     // special upgrade for version 7.0
     if (eeprom::getEeprom8(eeprom_offsets::VERSION7_UPDATE_FLAG, 0) != VERSION7_FLAG){    
@@ -72,11 +81,11 @@ void stepperAxisInit(bool hard_reset) {
 		if ( hard_reset ) {
 			//Setup axis inversion, endstop inversion and steps per mm from the values
 			//stored in eeprom
-			bool endstops_present = (endstops_invert & (1<<7)) != 0;	
+			bool endstops_present = (endstops_eeprom & (1<<7)) != 0;	
 
 			// If endstops are not present, then we consider them inverted, since they will
 			// always register as high (pulled up).
-			stepperAxis[i].invert_endstop = !endstops_present || ((endstops_invert & (1<<i)) != 0);
+			stepperAxis[i].invert_endstop = !endstops_present || ((endstops_eeprom & (1<<i)) != 0);
 			stepperAxis[i].invert_axis = (axes_invert & (1<<i)) != 0;
 
 			stepperAxis[i].steps_per_mm = (float)eeprom::getEeprom32(eeprom_offsets::AXIS_STEPS_PER_MM + i * sizeof(uint32_t),
@@ -158,6 +167,14 @@ void stepperAxisInit(bool hard_reset) {
 		axesHardwareEnabled = 0;
 	}
 
+	endstops_invert = 0;
+	for (uint8_t i = X_AXIS; i <= Z_AXIS; i ++ ) {
+		if ( stepperAxis[i].invert_endstop )	endstops_invert |= 0x03 << (i << 1);
+		endstop_trigger_position[i] = 0;
+	}
+	endstops_direction = 0;
+	endstops_blocked = 0;
+
 	for (uint8_t i = 0; i < EXTRUDERS; i ++ )
 		e_steps[i] = 0;
 }
@@ -72,8 +72,39 @@ enum AxisEnum {
 /// True if port is not defined
 #define STEPPER_IOPORT_NULL(IOPORT)		(IOPORT.port == 0)
 
+/// Port and pin mask of an axis's step pin as constants, taken from the board's
+/// *_STEPPER_STEP definition, e.g. STEP_PORT(X) from X_STEPPER_STEP
+#define STEP_PORT(AXIS)				(((struct StepperIOPort) AXIS ## _STEPPER_STEP).port)
+#define STEP_PIN_MASK(AXIS)			_BV(((struct StepperIOPort) AXIS ## _STEPPER_STEP).pin)
+
+/// Step pin bits of the axes in the axes mask which are on port PORT
+#define STEP_AXIS_BITS(axes, PORT, AXIS)	(((STEP_PORT(AXIS) == (PORT)) && ((axes) & _BV(AXIS ## _AXIS))) ? STEP_PIN_MASK(AXIS) : 0)
+#define STEP_PORT_BITS(axes, PORT)		(STEP_AXIS_BITS(axes, PORT, X) | STEP_AXIS_BITS(axes, PORT, Y) | \
+						 STEP_AXIS_BITS(axes, PORT, Z) | STEP_AXIS_BITS(axes, PORT, A) | \
+						 STEP_AXIS_BITS(axes, PORT, B))
+
+/// write the step pins of the axes in the axes mask which are on port PORT, with one write
+#define STEP_PORT_WRITE(axes, PORT, v)		do {								\
+							uint8_t bits = STEP_PORT_BITS(axes, PORT);		\
+							if (bits) {						\
+								if (v)	_SFR_MEM8(PORT) |=  bits;		\
+								else	_SFR_MEM8(PORT) &= ~bits;		\
+							}							\
+						} while(0)
+
+/// Input register and pin mask of an axis's endstop as constants, taken from the board's
+/// *_STEPPER_MIN / *_STEPPER_MAX definition, e.g. ENDSTOP_IPORT(X, MAX) from X_STEPPER_MAX
+#define ENDSTOP_IPORT(AXIS, END)		(((struct StepperIOPort) AXIS ## _STEPPER_ ## END).iport)
+#define ENDSTOP_PIN_MASK(AXIS, END)		_BV(((struct StepperIOPort) AXIS ## _STEPPER_ ## END).pin)
+
+/// BIT if the endstop's pin is high, 0 otherwise
+#define ENDSTOP_READ_BIT(AXIS, END, BIT)	((_SFR_MEM8(ENDSTOP_IPORT(AXIS, END)) & ENDSTOP_PIN_MASK(AXIS, END)) ? _BV(BIT) : 0)
+
 #else
 
+// Step and direction pin writes go to the simulator's mock register layer
+#include "SimulatorRegisters.hh"
+
 #define STEPPER_IOPORT_WRITE(IOPORT, v)
 #define STEPPER_IOPORT_READ(IOPORT) (uint8_t)0x00
 #define	STEPPER_IOPORT_SET_DIRECTION(IOPORT, v)
@@ -136,17 +167,32 @@ extern volatile bool    axis_homing[STEPPER_COUNT];
 extern volatile uint8_t axesEnabled;			//Planner axis enabled
 extern volatile uint8_t axesHardwareEnabled;		//Hardware axis enabled
 
+/// Endstops of X, Y and Z as bit masks, laid out as steppers::getEndstopStatus():
+/// | N/A | N/A | z max | z min | y max | y min | x max | x min |
+extern uint8_t endstops_invert;				//Endstops with invert_endstop set
+extern uint8_t endstops_direction;			//The endstop each axis of the current block moves towards
+extern uint8_t endstops_blocked;			//Axes whose steps are blocked by an endstop, a bit per axis
+extern volatile int32_t endstop_trigger_position[Z_AXIS + 1];	//dda_position at which homing on the axis finished
+
 
 /// Set the direction of the next step
 FORCE_INLINE void stepperAxisSetDirection(uint8_t axis, bool forward) {
+#ifndef SIMULATOR
 	STEPPER_IOPORT_WRITE(stepperAxisPorts[axis].dir, (stepperAxis[axis].invert_axis) ? (! forward) : forward);
+#else
+	simulator_direction_pin(axis, (stepperAxis[axis].invert_axis) ? (! forward) : forward);
+#endif
 }
 	
 /// Step
 
 ///***** SHOULD THIS BE REALLY false, true
 FORCE_INLINE void stepperAxisStep(uint8_t axis, bool value) {
+#ifndef SIMULATOR
 	STEPPER_IOPORT_WRITE(stepperAxisPorts[axis].step, value);
+#else
+	simulator_step_pins(_BV(axis), value);
+#endif
 }
 
 /// The A3982 steper driver chip has an inverted enable
@@ -176,6 +222,25 @@ FORCE_INLINE void stepperAxisSetEnabled(uint8_t axis, bool enabled) {
 	else		axesEnabled &= ~_BV(axis);
 }
 
+/// Writes the step pins of the axes in the axes mask.  The ports are compile time constants,
+/// so the comparisons fold away and axes which share a port are written together
+FORCE_INLINE void stepperAxisStepPins(uint8_t axes, bool value) {
+#ifndef SIMULATOR
+	STEP_PORT_WRITE(axes, STEP_PORT(X), value);
+	if ( STEP_PORT(Y) != STEP_PORT(X) )
+		STEP_PORT_WRITE(axes, STEP_PORT(Y), value);
+	if ( (STEP_PORT(Z) != STEP_PORT(X)) && (STEP_PORT(Z) != STEP_PORT(Y)) )
+		STEP_PORT_WRITE(axes, STEP_PORT(Z), value);
+	if ( (STEP_PORT(A) != STEP_PORT(X)) && (STEP_PORT(A) != STEP_PORT(Y)) && (STEP_PORT(A) != STEP_PORT(Z)) )
+		STEP_PORT_WRITE(axes, STEP_PORT(A), value);
+	if ( (STEP_PORT(B) != STEP_PORT(X)) && (STEP_PORT(B) != STEP_PORT(Y)) && (STEP_PORT(B) != STEP_PORT(Z)) &&
+	     (STEP_PORT(B) != STEP_PORT(A)) )
+		STEP_PORT_WRITE(axes, STEP_PORT(B), value);
+#else
+	simulator_step_pins(axes, value);
+#endif
+}
+
 /// Returns true if we're at a maximum endstop
 FORCE_INLINE bool stepperAxisIsAtMaximum(uint8_t axis) {
 	return (STEPPER_IOPORT_NULL(stepperAxisPorts[axis].maximum)) ? false : (STEPPER_IOPORT_READ(stepperAxisPorts[axis].maximum) ^ stepperAxis[axis].invert_endstop);
@@ -186,100 +251,179 @@ FORCE_INLINE bool stepperAxisIsAtMinimum(uint8_t axis) {
 	return (STEPPER_IOPORT_NULL(stepperAxisPorts[axis].minimum)) ? false : (STEPPER_IOPORT_READ(stepperAxisPorts[axis].minimum) ^ stepperAxis[axis].invert_endstop);
 }
 
-/// Makes a step, but checks if an endstop is triggered first, if it is, the
-/// step is abandoned and "true" is returned.
-FORCE_INLINE void stepperAxisStepWithEndstopCheck(uint8_t axis, bool direction) {
-	if (( (direction)   && (! stepperAxisIsAtMaximum(axis))) ||
-	    ( (! direction) && (! stepperAxisIsAtMinimum(axis))))
-		stepperAxisStep(axis, true);
-	else	axis_homing[axis] = false;
+/// Returns the triggered endstops of X, Y and Z, reading each pin once.  The pins are
+/// compile time constants, so this is a handful of loads and bit tests.
+FORCE_INLINE uint8_t stepperAxisReadEndstops() {
+#ifndef SIMULATOR
+	uint8_t state = ENDSTOP_READ_BIT(X, MIN, 0) | ENDSTOP_READ_BIT(X, MAX, 1) |
+			ENDSTOP_READ_BIT(Y, MIN, 2) | ENDSTOP_READ_BIT(Y, MAX, 3) |
+			ENDSTOP_READ_BIT(Z, MIN, 4) | ENDSTOP_READ_BIT(Z, MAX, 5);
+	return state ^ endstops_invert;
+#else
+	return 0;
+#endif
+}
+
+/// Sets the endstops checked for a block moving axes, in the directions of direction_bits
+/// (a set bit moves towards the minimum)
+FORCE_INLINE void stepperAxisSetEndstopDirections(uint8_t axes, uint8_t direction_bits) {
+	uint8_t direction = 0;
+	for ( uint8_t i = X_AXIS; i <= Z_AXIS; i ++ ) {
+		if ( axes & _BV(i) )
+			direction |= _BV((i << 1) + ((direction_bits & _BV(i)) ? 0 : 1));
+	}
+	endstops_direction = direction;
+	endstops_blocked   = 0;
+}
+
+/// Samples the endstops once for all the steps of a stepper interrupt, rather than
+/// on every step of every axis.  An axis moving towards a triggered endstop is added
+/// to endstops_blocked, and if it's homing, homing on it is finished and the position
+/// it triggered at is latched in endstop_trigger_position.
+FORCE_INLINE void stepperAxisSampleEndstops() {
+	if ( ! endstops_direction )	return;
+
+	uint8_t hit = stepperAxisReadEndstops() & endstops_direction;
+	if ( ! hit ) {
+		endstops_blocked = 0;
+		return;
+	}
+
+	//Fold the min / max pair of each axis down to a bit per axis
+	hit |= hit >> 1;
+	uint8_t blocked = (hit & 0x01) | ((hit >> 1) & 0x02) | ((hit >> 2) & 0x04);
+
+	uint8_t triggered = blocked & ~endstops_blocked;
+	for ( uint8_t i = X_AXIS; i <= Z_AXIS; i ++ ) {
+		if (( triggered & _BV(i) ) && ( axis_homing[i] )) {
+			axis_homing[i] = false;
+			endstop_trigger_position[i] = dda_position[i];
+		}
+	}
+	endstops_blocked = blocked;
 }
 
 /// DDA
 
 #define DDA_IND stepperAxis[ind].dda
 
-FORCE_INLINE void stepperAxis_dda_reset(uint8_t ind, bool master, int32_t master_steps, bool direction, int32_t steps)
+/// Sets up a dda for a block, see stepperAxis_dda_reset().  The eAxis flag is left as it is.
+FORCE_INLINE void stepperAxis_dda_prepare(struct dda &dda, bool master, int32_t master_steps, bool direction, int32_t steps)
 {
-	DDA_IND.enabled		      = (steps != 0 );
+	dda.enabled		      = (steps != 0 );
 
-	if ( ! DDA_IND.enabled ) return;	//If we're not enabled, we don't calculate the rest.
+	if ( ! dda.enabled ) return;	//If we're not enabled, we don't calculate the rest.
 
-	DDA_IND.counter  = master_steps >> 1;
+	dda.counter  = master_steps >> 1;
 
 #ifdef OVERSAMPLED_DDA
-        DDA_IND.counter  = - (DDA_IND.counter << OVERSAMPLED_DDA);
+        dda.counter  = - (dda.counter << OVERSAMPLED_DDA);
 #else
-        DDA_IND.counter  = - DDA_IND.counter;
+        dda.counter  = - dda.counter;
 #endif
 
-        DDA_IND.master                = master;
+        dda.master                = master;
 #ifdef OVERSAMPLED_DDA
-        DDA_IND.master_steps          = master_steps << OVERSAMPLED_DDA;
+        dda.master_steps          = master_steps << OVERSAMPLED_DDA;
 #else
-        DDA_IND.master_steps          = master_steps;
+        dda.master_steps          = master_steps;
 #endif
-        DDA_IND.steps         = steps;
-        DDA_IND.direction     = (direction) ? -1 : 1;
-        DDA_IND.stepperDir    = (direction) ? false : true;
+        dda.steps         = steps;
+        dda.direction     = (direction) ? -1 : 1;
+        dda.stepperDir    = (direction) ? false : true;
 
-        DDA_IND.steps_completed = 0;
+        dda.steps_completed = 0;
 }
 
+FORCE_INLINE void stepperAxis_dda_reset(uint8_t ind, bool master, int32_t master_steps, bool direction, int32_t steps)
+{
+	stepperAxis_dda_prepare(DDA_IND, master, master_steps, direction, steps);
+}
+
+/// Shifts the phase of an axis's dda by phase per step event.  With OVERSAMPLED_DDA the counter
+/// is scaled by (1 << OVERSAMPLED_DDA), and the stepper interrupt shifts it on each of the
+/// (1 << OVERSAMPLED_DDA) dda ticks of a step event, so the phase is added as it is.
 FORCE_INLINE void stepperAxis_dda_shift_phase16(uint8_t ind, int16_t phase)
 {
-#ifdef OVERSAMPLED_DDA
-        DDA_IND.counter += phase << OVERSAMPLED_DDA;
-#else
         DDA_IND.counter += phase;
-#endif
 }
 
 FORCE_INLINE void stepperAxis_dda_shift_phase32(uint8_t ind, int32_t phase)
 {
-#ifdef OVERSAMPLED_DDA
-        DDA_IND.counter += phase << OVERSAMPLED_DDA;
-#else
         DDA_IND.counter += phase;
-#endif
 }
 
-FORCE_INLINE void stepperAxis_dda_step(uint8_t ind)
+/// Advances the dda of an axis and returns _BV(ind) if it steps.  If the step needs a
+/// pulse on the step pin, _BV(ind) is also added to pulses, the pulse itself is left to
+/// stepperAxis_dda_step_axes().  The dda must be enabled.
+FORCE_INLINE uint8_t stepperAxis_dda_step(uint8_t ind, uint8_t &pulses)
 {
-	if ( ! DDA_IND.enabled )	return;
-
 	DDA_IND.counter += DDA_IND.steps;
-	if (( DDA_IND.counter > 0 ) && ( DDA_IND.steps_completed < DDA_IND.steps ))
-	{
-		DDA_IND.counter -= DDA_IND.master_steps;
+	if (( DDA_IND.counter <= 0 ) || ( DDA_IND.steps_completed >= DDA_IND.steps ))	return 0;
+
+	DDA_IND.counter -= DDA_IND.master_steps;
 
 #ifdef JKN_ADVANCE
-               	if ( DDA_IND.eAxis ) {
+	if ( DDA_IND.eAxis ) {
 #ifndef SIMULATOR
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Warray-bounds"
 #endif
-			//This generates a warning: array subscript is below array bounds [-Warray-bounds]
-			//However we override this warning because anything below A_AXIS can never be
-			//an eAxis, and to test would require extra cycles and we don't need to
-			e_steps[ind-A_AXIS] += DDA_IND.direction;
+		//This generates a warning: array subscript is below array bounds [-Warray-bounds]
+		//However we override this warning because anything below A_AXIS can never be
+		//an eAxis, and to test would require extra cycles and we don't need to
+		e_steps[ind-A_AXIS] += DDA_IND.direction;
 #ifndef SIMULATOR
 #pragma GCC diagnostic pop
 #endif
-		}
-		else
-		{
-#endif
-			stepperAxisSetDirection(ind, DDA_IND.stepperDir );
-			stepperAxisStepWithEndstopCheck(ind, DDA_IND.stepperDir);
-			stepperAxisStep(ind, false);
-#ifdef JKN_ADVANCE
-		}
+		return _BV(ind);
+	}
 #endif
 
-		dda_position[ind] += DDA_IND.direction;
-		DDA_IND.steps_completed ++;
-	}
+	stepperAxisSetDirection(ind, DDA_IND.stepperDir );
+	if ( ! (endstops_blocked & _BV(ind)) )	pulses |= _BV(ind);
+
+	return _BV(ind);
+}
+
+/// Accounts for a step returned by stepperAxis_dda_step()
+FORCE_INLINE void stepperAxis_dda_stepped(uint8_t ind)
+{
+	dda_position[ind] += DDA_IND.direction;
+	DDA_IND.steps_completed ++;
+}
+
+/// True if axis is in both the compile time mask AXES and the run time mask axes
+#define DDA_AXIS_ACTIVE(AXES, axes, axis)	(((AXES) & _BV(axis)) && ((axes) & _BV(axis)))
+
+/// Steps the ddas of the axes in axes, the enabled ddas.  AXES is a compile time mask of the
+/// axes which may be in axes, passing axes == AXES removes the tests for the idle axes altogether.
+/// The step pins of the axes stepping go high together and the ddas are then accounted for,
+/// which holds the pins high for well over the 1us (16 cycles) the stepper drivers need,
+/// before the pins go low together.
+template <uint8_t AXES>
+FORCE_INLINE void stepperAxis_dda_step_axes(uint8_t axes)
+{
+	uint8_t pulses = 0;
+	uint8_t stepped = 0;
+
+	if ( DDA_AXIS_ACTIVE(AXES, axes, X_AXIS) )	stepped |= stepperAxis_dda_step(X_AXIS, pulses);
+	if ( DDA_AXIS_ACTIVE(AXES, axes, Y_AXIS) )	stepped |= stepperAxis_dda_step(Y_AXIS, pulses);
+	if ( DDA_AXIS_ACTIVE(AXES, axes, Z_AXIS) )	stepped |= stepperAxis_dda_step(Z_AXIS, pulses);
+	if ( DDA_AXIS_ACTIVE(AXES, axes, A_AXIS) )	stepped |= stepperAxis_dda_step(A_AXIS, pulses);
+	if ( DDA_AXIS_ACTIVE(AXES, axes, B_AXIS) )	stepped |= stepperAxis_dda_step(B_AXIS, pulses);
+
+	if ( ! stepped )	return;
+
+	stepperAxisStepPins(pulses, true);
+
+	if ( DDA_AXIS_ACTIVE(AXES, stepped, X_AXIS) )	stepperAxis_dda_stepped(X_AXIS);
+	if ( DDA_AXIS_ACTIVE(AXES, stepped, Y_AXIS) )	stepperAxis_dda_stepped(Y_AXIS);
+	if ( DDA_AXIS_ACTIVE(AXES, stepped, Z_AXIS) )	stepperAxis_dda_stepped(Z_AXIS);
+	if ( DDA_AXIS_ACTIVE(AXES, stepped, A_AXIS) )	stepperAxis_dda_stepped(A_AXIS);
+	if ( DDA_AXIS_ACTIVE(AXES, stepped, B_AXIS) )	stepperAxis_dda_stepped(B_AXIS);
+
+	stepperAxisStepPins(pulses, false);
 }
 
 /// Clips an axis to the minimum step limit.  It returns target if it doesn't require clipping,
@@ -20,6 +20,7 @@
 #ifndef SIMULATOR
 
 #define __STDC_LIMIT_MACROS
+#include <math.h>
 #include "Steppers.hh"
 #include "StepperAxis.hh"
 #include <stdint.h>
@@ -30,6 +31,7 @@
 
 #else
 
+#include <math.h>
 #include "Steppers.hh"
 #include "StepperAxis.hh"
 #include <stdint.h>
@@ -46,10 +48,6 @@
 #endif
 #define labs(x) abs(x)
 
-#define st_init()
-#define st_interrupt() false
-#define st_extruder_interrupt()
-#define quickStop()
 #define DEBUG_TIMER_TCTIMER_USI 0
 #define DEBUG_TIMER_START
 #define DEBUG_TIMER_FINISH
@@ -114,11 +112,74 @@ bool holdZ = false;
 bool z_homing = false;
 uint8_t z_homed = 0;
 
+#ifdef HOMING_TWO_STAGE
+
+//Homing approaches the endstops at HOMING_APPROACH_SPEEDUP times the speed asked for, backs off
+//HOMING_BACKOFF_MM from where they triggered, and then retouches them at the speed asked for.
+//The endstops are sampled once per stepper interrupt, so at speed an axis can overrun its endstop
+//by the steps of one interrupt; the retouch is slow enough to take a step per interrupt.
+#ifndef HOMING_APPROACH_SPEEDUP
+	#define HOMING_APPROACH_SPEEDUP		3
+#endif
+
+#ifndef HOMING_BACKOFF_MM
+	#define HOMING_BACKOFF_MM		2.0
+#endif
+
+enum HomingStage {
+	HOMING_IDLE = 0,
+	HOMING_APPROACH,
+	HOMING_BACKOFF_PENDING,		//The approach has finished, runSteppersSlice() plans the back off
+	HOMING_BACKOFF,
+	HOMING_RETOUCH
+};
+
+static volatile uint8_t	homing_stage = HOMING_IDLE;
+static bool		homing_maximums;
+static uint8_t		homing_axes;
+static uint32_t		homing_us_per_step;
+
+#endif
+
 Point tolerance_offset_T0;
 Point tolerance_offset_T1;
 Point *tool_offsets;
 uint8_t toolIndex = 0;
 
+#ifdef COALESCE_SEGMENTS
+
+//Short segments from setTargetNewExt are held back and merged with the segments which follow
+//them, so long as the direction, feed rate and extrusion rate stay the same.  The merged segment
+//is planned when a segment arrives that can't be merged, or on flushSegment().
+//The held segment runs from planner_position to coalesce_target.
+//The direction is compared as the distance of the new end point from the line through the held
+//segment, rather than as an angle, as the step rounding of very short segments makes their
+//angles unreliable.
+
+//Longest segment in mm which is held back, and the longest segment merging can build
+#ifndef COALESCE_MAX_LENGTH
+	#define COALESCE_MAX_LENGTH		1.0
+#endif
+
+//Largest distance in mm of the end of a merged segment from the line through the held segment
+#ifndef COALESCE_MAX_DEVIATION
+	#define COALESCE_MAX_DEVIATION		0.02
+#endif
+
+//Largest change in extrusion per mm, relative to the held segment's, of a segment merged into it.
+//One step of extrusion either way is also allowed for rounding.
+#ifndef COALESCE_EXTRUSION_TOLERANCE
+	#define COALESCE_EXTRUSION_TOLERANCE	0.0625
+#endif
+
+static bool	coalesce_pending = false;		//True when a segment is held back
+static int32_t	coalesce_target[STEPPER_COUNT];		//Target of the held segment, includes the tool offsets
+static float	coalesce_distance;			//Length of the held segment in mm
+static int32_t	coalesce_dda_rate;			//dda steps per second for the master axis of the held segment
+static int16_t	coalesce_feedrate;			//feedrateMult64 of the held segment
+
+#endif
+
 //Also requires DEBUG_ONSCREEN to be defined in StepperAccel.h
 //#define TIME_STEPPER_INTERRUPT
 
@@ -128,6 +189,9 @@ uint16_t debugTimer = 0;
 
 
 bool isRunning() {
+#ifdef HOMING_TWO_STAGE
+	if ( homing_stage != HOMING_IDLE )	return true;
+#endif
 	return is_running || is_homing;
 }
 
@@ -163,9 +227,13 @@ void reset() {
 	changeToolIndex(0);
 
 	// If acceleration has not been initialized before (i.e. last time we ran we were an earlier firmware),
-	// then we initialize the acceleration eeprom settings here
+	// then we initialize the acceleration eeprom settings here.  If it was, but before the settings that
+	// were added since, only those are initialized
 	uint8_t accelerationStatus = eeprom::getEeprom8(eeprom_offsets::ACCELERATION_SETTINGS + acceleration_eeprom_offsets::DEFAULTS_FLAG, 0xFF);
-	if (accelerationStatus !=  _BV(ACCELERATION_INIT_BIT)) {
+	if (accelerationStatus == _BV(ACCELERATION_INIT_BIT)) {
+		eeprom::setDefaultsAccelerationAdded();
+	}
+	else if (accelerationStatus != (_BV(ACCELERATION_INIT_BIT) | ACCELERATION_SETTINGS_VERSION)) {
 		eeprom::setDefaultsAcceleration();
 	}
 
@@ -235,6 +303,10 @@ void reset() {
 	//Number of steps when priming or deprime the extruder
 	extruder_deprime_steps[0]    = (int16_t)eeprom::getEeprom16(AC2(EXTRUDER_DEPRIME_STEPS,0), DEFAULT_EXTRUDER_DEPRIME_STEPS_A);
 	extruder_deprime_steps[1]    = (int16_t)eeprom::getEeprom16(AC2(EXTRUDER_DEPRIME_STEPS,1), DEFAULT_EXTRUDER_DEPRIME_STEPS_B);
+	for ( uint8_t e = 0; e < EXTRUDERS; e ++ ) {
+		if	( extruder_deprime_steps[e] >   E_STEPS_DEPRIME_MAX )	extruder_deprime_steps[e] =   E_STEPS_DEPRIME_MAX;
+		else if ( extruder_deprime_steps[e] < - E_STEPS_DEPRIME_MAX )	extruder_deprime_steps[e] = - E_STEPS_DEPRIME_MAX;
+	}
 
 	//Maximum speed change
 	max_speed_change[X_AXIS]  = FTOFP((float)eeprom::getEeprom16(AC1(MAX_SPEED_CHANGE,0), DEFAULT_MAX_SPEED_CHANGE_X));
@@ -251,6 +323,16 @@ void reset() {
 	max_speed_change[B_AXIS]  = FTOFP((float)1);
 #endif
 
+	//Junction deviation in microns, 0 uses max_speed_change for cornering
+	junction_deviation = FTOFP((float)eeprom::getEeprom16(NAC2(JUNCTION_DEVIATION), DEFAULT_JUNCTION_DEVIATION) / 1000.0);
+
+#ifdef INPUT_SHAPING
+	//Input shaper for X and Y, frequency in 0.1Hz and damping ratio multiplied by 1000
+	plan_set_input_shaper(eeprom::getEeprom8(NAC2(INPUT_SHAPER_TYPE), DEFAULT_INPUT_SHAPER_TYPE),
+			      (float)eeprom::getEeprom16(NAC2(INPUT_SHAPER_FREQUENCY), DEFAULT_INPUT_SHAPER_FREQUENCY) / 10.0,
+			      (float)eeprom::getEeprom16(NAC2(INPUT_SHAPER_DAMPING), DEFAULT_INPUT_SHAPER_DAMPING) / 1000.0);
+#endif
+
 #ifdef FIXED
 	smallest_max_speed_change = max_speed_change[Z_AXIS];
 	for (uint8_t i = 0; i < STEPPER_COUNT; i++) {
@@ -270,12 +352,16 @@ void reset() {
 	minimumPlannerSpeed = FTOFP((float)ACCELERATION_MIN_PLANNER_SPEED);
 
 	if ( eeprom::getEeprom8(NAC2(SLOWDOWN_FLAG), DEFAULT_SLOWDOWN_FLAG) ) {
-    // we have different slowdown limits depending on whether we're printing from sd card or USB
-		slowdown_limit = (int)ACCELERATION_SLOWDOWN_LIMIT;
-    if (!sdcard::isPlaying()) { slowdown_limit *= 2; }
-		if ( slowdown_limit > (BLOCK_BUFFER_SIZE / 2))  { slowdown_limit = BLOCK_BUFFER_SIZE / 2; }
+		// we have different slowdown times depending on whether we're printing from sd card or USB
+		uint32_t slowdown_ms = eeprom::getEeprom16(NAC2(SLOWDOWN_TIME), DEFAULT_SLOWDOWN_TIME);
+#ifndef SIMULATOR
+		if (!sdcard::isPlaying()) { slowdown_ms *= 2; }
+#endif
+		slowdown_time = (slowdown_ms << PLAN_TIME_SHIFT) / 1000;
+		// The planner scales by slowdown_time as an FPTYPE
+		if ( slowdown_time > FPTYPE_MAX )  { slowdown_time = FPTYPE_MAX; }
 	}
-	else	slowdown_limit = 0;	
+	else	slowdown_time = 0;	
 
 	//Clockwise extruder
 	extrude_when_negative[0] = ACCELERATION_EXTRUDE_WHEN_NEGATIVE_A;
@@ -321,8 +407,15 @@ void abort() {
 	//after stopping
 	quickStop();
 
+#ifdef COALESCE_SEGMENTS
+	coalesce_pending = false;
+#endif
+
   is_running = false;
   is_homing = false;
+#ifdef HOMING_TWO_STAGE
+	homing_stage = HOMING_IDLE;
+#endif
 	
 	stepperAxisInit(false);
 
@@ -334,6 +427,8 @@ void abort() {
 void definePosition(const Point& position_in) {
 	Point position_offset = position_in;
 
+	flushSegment();
+
 	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
 		stepperAxis[i].hasDefinePosition = true;
 
@@ -350,6 +445,8 @@ void definePosition(const Point& position_in) {
 void defineHomePosition(const Point& position_in) {
 	Point position_offset = position_in;
 
+	flushSegment();
+
 	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
 		stepperAxis[i].hasDefinePosition = true;
 	}
@@ -365,9 +462,16 @@ void defineHomePosition(const Point& position_in) {
 const Point getPlannerPosition() {
 	Point p;
 
+#ifdef COALESCE_SEGMENTS
+	//The held segment will be planned, so it's where the planner will be
+	const int32_t *position = ( coalesce_pending ) ? coalesce_target : planner_position;
+#else
+	const int32_t *position = planner_position;
+#endif
+
 	ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
-		p = Point(planner_position[X_AXIS], planner_position[Y_AXIS], planner_position[Z_AXIS],
-			  planner_position[A_AXIS], planner_position[B_AXIS] );
+		p = Point(position[X_AXIS], position[Y_AXIS], position[Z_AXIS],
+			  position[A_AXIS], position[B_AXIS] );
 
   //Subtract out the toolhead offset
 	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
@@ -421,7 +525,23 @@ void setHoldZ(bool holdZ_in) {
 }
 
 
+//Sets is_running when the planner buffer is too full to take another move command.
+//A held segment is planned along with the next move it can't be merged with, so it
+//counts as a block.  With nothing planned it can't overflow the buffer, and nothing
+//would clear is_running, so then it doesn't count.
+
+static void updateIsRunning() {
+	uint8_t moves = movesplanned();
+#ifdef COALESCE_SEGMENTS
+	if (( coalesce_pending ) && ( moves ))	moves ++;
+#endif
+	is_running = ( moves >= plannerMaxBufferSize );
+}
+
+
 void setTarget(const Point& target, int32_t dda_interval) {
+	flushSegment();
+
 	//Add on the tool offsets
 	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
 		planner_target[i] = target[i] + (*tool_offsets)[i];
@@ -458,12 +578,13 @@ void setTarget(const Point& target, int32_t dda_interval) {
 
 	plan_buffer_line(0, dda_rate, toolIndex, false, toolIndex);
 
-	if ( movesplanned() >=  plannerMaxBufferSize) is_running = true;
-	else                                          is_running = false;
+	updateIsRunning();
 }
 
 
 void setTargetNew(const Point& target, int32_t us, uint8_t relative) {
+	flushSegment();
+
 	//Add on the tool offsets and convert relative moves into absolute moves
 	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
 		if ((relative & (1 << i)) != 0) {
@@ -507,28 +628,14 @@ void setTargetNew(const Point& target, int32_t us, uint8_t relative) {
 
 	plan_buffer_line(0, dda_rate, toolIndex, false, toolIndex);
 
-	if ( movesplanned() >=  plannerMaxBufferSize)      is_running = true;
-	else                                               is_running = false;
+	updateIsRunning();
 }
 
 
+//Plan a move from planner_position to planner_target
 //Dda_rate is the number of dda steps per second for the master axis
 
-void setTargetNewExt(const Point& target, int32_t dda_rate, uint8_t relative, float distance, int16_t feedrateMult64) {
-	//Add on the tool offsets and convert relative moves into absolute moves
-	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
-		if ((relative & (1 << i)) != 0) {
-			planner_target[i] = planner_position[i] + target[i];
-		}else{
-      planner_target[i] = target[i] + (*tool_offsets)[i];
-    }
-	}
-
-	//Clip the Z axis so that it can't move outside the build area.
-	//Addresses a specific issue with old start.gcode for the replicator.
-	//It has a G1 Z155 command that was slamming the platform into the floor.  
-	planner_target[Z_AXIS] = stepperAxis_clip_to_max(Z_AXIS, planner_target[Z_AXIS]);
-
+static void planTargetNewExt(int32_t dda_rate, float distance, int16_t feedrateMult64) {
         //Calculate the maximum steps of any axis and store in planner_master_steps
         //Also calculate the step deltas (planner_steps[i]) at the same time.
         int32_t max_delta = 0;
@@ -578,8 +685,162 @@ void setTargetNewExt(const Point& target, int32_t dda_rate, uint8_t relative, fl
 
 	plan_buffer_line(feedrate, dda_rate, toolIndex, acceleration && segmentAccelState, toolIndex);
 
-	if ( movesplanned() >=  plannerMaxBufferSize)      is_running = true;
-	else                                               is_running = false;
+	updateIsRunning();
+}
+
+
+#ifdef COALESCE_SEGMENTS
+
+//Merge the move to planner_target into the held segment, or hold it back
+//Returns false if the move can't be held back, any held segment has then been planned
+//and planner_target is left unchanged
+
+static bool coalesceSegment(int32_t dda_rate, float distance, int16_t feedrateMult64) {
+	int32_t target[STEPPER_COUNT];
+	float   delta[STEPPER_COUNT];	//The move in mm
+	int32_t master_steps = 0;
+
+	const int32_t *position = ( coalesce_pending ) ? coalesce_target : planner_position;
+
+	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
+		target[i] = planner_target[i];
+		int32_t steps = target[i] - position[i];
+		delta[i] = (float)steps * FPTOF(axis_steps_per_unit_inverse[i]);
+		steps = labs(steps);
+		if ( steps > master_steps )	master_steps = steps;
+	}
+
+	//Zero length moves are dropped, as planTargetNewExt would
+	if (( master_steps == 0 ) || ( distance == 0.0 ))	return true;
+
+	//Only short accelerated moves with some XYZ movement are held back
+	bool mergeable = acceleration && segmentAccelState && ( dda_rate > 0 ) &&
+			 ( distance < COALESCE_MAX_LENGTH ) &&
+			 (( delta[X_AXIS] != 0.0 ) || ( delta[Y_AXIS] != 0.0 ) || ( delta[Z_AXIS] != 0.0 ));
+
+	if ( coalesce_pending ) {
+		if (( mergeable ) && ( feedrateMult64 == coalesce_feedrate )) {
+			float held[STEPPER_COUNT];	//The held segment in mm
+			int32_t held_steps = 0, merged_steps = 0;
+
+			for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
+				int32_t steps = coalesce_target[i] - planner_position[i];
+				held[i] = (float)steps * FPTOF(axis_steps_per_unit_inverse[i]);
+				steps = labs(steps);
+				if ( steps > held_steps )	held_steps = steps;
+				steps = labs(target[i] - planner_position[i]);
+				if ( steps > merged_steps )	merged_steps = steps;
+			}
+
+			float dot = held[X_AXIS] * delta[X_AXIS] + held[Y_AXIS] * delta[Y_AXIS] + held[Z_AXIS] * delta[Z_AXIS];
+
+			//|held x delta| / |held| is the distance of the end of the move from the held segment's line
+			float cx = held[Y_AXIS] * delta[Z_AXIS] - held[Z_AXIS] * delta[Y_AXIS];
+			float cy = held[Z_AXIS] * delta[X_AXIS] - held[X_AXIS] * delta[Z_AXIS];
+			float cz = held[X_AXIS] * delta[Y_AXIS] - held[Y_AXIS] * delta[X_AXIS];
+			float max_cross = COALESCE_MAX_DEVIATION * coalesce_distance;
+
+			float mx = held[X_AXIS] + delta[X_AXIS];
+			float my = held[Y_AXIS] + delta[Y_AXIS];
+			float mz = held[Z_AXIS] + delta[Z_AXIS];
+			float merged_distance = sqrt(mx * mx + my * my + mz * mz);
+
+			//Extrusion per mm of the move within tolerance of the held segment's
+			bool extrusion_matches = true;
+			for ( uint8_t i = A_AXIS; i < STEPPER_COUNT; i ++ ) {
+				float held_e = held[i] * distance;
+				if ((( held[i] == 0.0 ) != ( delta[i] == 0.0 )) ||
+				    ( fabs(delta[i] * coalesce_distance - held_e) >
+				      COALESCE_EXTRUSION_TOLERANCE * fabs(held_e) + FPTOF(axis_steps_per_unit_inverse[i]) * coalesce_distance ))
+					extrusion_matches = false;
+			}
+
+			if (( merged_distance < COALESCE_MAX_LENGTH ) && ( extrusion_matches ) && ( dot > 0.0 ) &&
+			    ( cx * cx + cy * cy + cz * cz <= max_cross * max_cross )) {
+				//Keep the duration of the two moves
+				float time = (float)held_steps / (float)coalesce_dda_rate + (float)master_steps / (float)dda_rate;
+
+				for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
+					coalesce_target[i] = target[i];
+				coalesce_distance = merged_distance;
+				coalesce_dda_rate = (int32_t)((float)merged_steps / time);
+				SIMULATOR_RECORD(RECORD_COALESCE_MERGED, 1);
+				return true;
+			}
+		}
+
+		flushSegment();
+
+		for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
+			planner_target[i] = target[i];
+	}
+
+	if ( ! mergeable )	return false;
+
+	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
+		coalesce_target[i] = target[i];
+	coalesce_distance = distance;
+	coalesce_dda_rate = dda_rate;
+	coalesce_feedrate = feedrateMult64;
+	coalesce_pending = true;
+	updateIsRunning();
+
+	return true;
+}
+
+#endif
+
+
+void setTargetNewExt(const Point& target, int32_t dda_rate, uint8_t relative, float distance, int16_t feedrateMult64) {
+#ifdef COALESCE_SEGMENTS
+	//Relative moves continue from the end of the held segment
+	const int32_t *position = ( coalesce_pending ) ? coalesce_target : planner_position;
+#else
+	const int32_t *position = planner_position;
+#endif
+
+	//Add on the tool offsets and convert relative moves into absolute moves
+	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ ) {
+		if ((relative & (1 << i)) != 0) {
+			planner_target[i] = position[i] + target[i];
+		}else{
+      planner_target[i] = target[i] + (*tool_offsets)[i];
+    }
+	}
+
+	//Clip the Z axis so that it can't move outside the build area.
+	//Addresses a specific issue with old start.gcode for the replicator.
+	//It has a G1 Z155 command that was slamming the platform into the floor.  
+	planner_target[Z_AXIS] = stepperAxis_clip_to_max(Z_AXIS, planner_target[Z_AXIS]);
+
+#ifdef COALESCE_SEGMENTS
+	SIMULATOR_RECORD(RECORD_COALESCE_MOVES, 1);
+	if ( coalesceSegment(dda_rate, distance, feedrateMult64) )	return;
+#endif
+
+	planTargetNewExt(dda_rate, distance, feedrateMult64);
+}
+
+
+void flushSegment() {
+#ifdef COALESCE_SEGMENTS
+	if ( ! coalesce_pending )	return;
+	coalesce_pending = false;
+
+	for ( uint8_t i = 0; i < STEPPER_COUNT; i ++ )
+		planner_target[i] = coalesce_target[i];
+
+	planTargetNewExt(coalesce_dda_rate, coalesce_distance, coalesce_feedrate);
+#endif
+}
+
+
+bool segmentPending() {
+#ifdef COALESCE_SEGMENTS
+	return coalesce_pending;
+#else
+	return false;
+#endif
 }
 
 
@@ -588,11 +849,9 @@ void setTargetNewExt(const Point& target, int32_t dda_rate, uint8_t relative, fl
 #define POSITIVE_HOME_POSITION ((INT32_MAX - 1) >> 1)
 #define NEGATIVE_HOME_POSITION ((INT32_MIN + 1) >> 1)
 
-/// Start homing
-
-void startHoming(const bool maximums, const uint8_t axes_enabled, const uint32_t us_per_step) {
-	setSegmentAccelState(false);
+/// Move the axes in axes_enabled towards their endstops until they trigger
 
+static void homeAxes(const bool maximums, const uint8_t axes_enabled, const uint32_t us_per_step) {
 	Point target = getStepperPosition();
 
     for (uint8_t i = 0; i < STEPPER_COUNT; i++) {
@@ -612,6 +871,50 @@ void startHoming(const bool maximums, const uint8_t axes_enabled, const uint32_t
 }
 
 
+/// Start homing
+
+void startHoming(const bool maximums, const uint8_t axes_enabled, const uint32_t us_per_step) {
+	setSegmentAccelState(false);
+
+#ifdef HOMING_TWO_STAGE
+	homing_maximums	   = maximums;
+	homing_axes	   = axes_enabled;
+	homing_us_per_step = us_per_step;
+	homing_stage	   = HOMING_APPROACH;
+
+	homeAxes(maximums, axes_enabled, us_per_step / HOMING_APPROACH_SPEEDUP);
+#else
+	homeAxes(maximums, axes_enabled, us_per_step);
+#endif
+}
+
+
+#ifdef HOMING_TWO_STAGE
+
+/// Back the homed axes off HOMING_BACKOFF_MM from where their endstops triggered
+
+static void homingBackoff() {
+	Point target = getStepperPosition();
+
+	for ( uint8_t i = X_AXIS; i <= Z_AXIS; i ++ ) {
+		if (( homing_axes & _BV(i) ) == 0 )	continue;
+
+		//The axis stopped up to an interrupt's worth of steps past the trigger
+		int32_t overrun;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			overrun = dda_position[i] - endstop_trigger_position[i];
+		}
+
+		int32_t backoff = (int32_t)(HOMING_BACKOFF_MM * stepperAxis[i].steps_per_mm);
+		target[i] -= overrun + ((homing_maximums) ? backoff : - backoff);
+	}
+
+	setTarget(target, homing_us_per_step / HOMING_APPROACH_SPEEDUP);
+}
+
+#endif
+
+
 /// Enable/disable the given axis.
 void enableAxis(uint8_t index, bool enable) {
         if (index < STEPPER_COUNT) {
@@ -656,11 +959,14 @@ void resetAxisPot(uint8_t index) {
 /// Toggle segment acceleration on or off
 /// Note this is also off if acceleration variable is not set
 void setSegmentAccelState(bool state) {
+     flushSegment();
      segmentAccelState = state;
 }
 
 
 void changeToolIndex(uint8_t tool) {
+	flushSegment();
+
 	toolIndex = tool;
 
 	//Just in case as toolIndex is used to index into arrays
@@ -675,16 +981,7 @@ void changeToolIndex(uint8_t tool) {
 // endstop status bits: (7-0) : | N/A | N/A | z max | z min | y max | y min | x max | x min |
 
 uint8_t getEndstopStatus() {
-	uint8_t status = 0;
-
-	status |= stepperAxisIsAtMaximum(Z_AXIS) << 5;
-	status |= stepperAxisIsAtMinimum(Z_AXIS) << 4;
-	status |= stepperAxisIsAtMaximum(Y_AXIS) << 3;
-	status |= stepperAxisIsAtMinimum(Y_AXIS) << 2;
-	status |= stepperAxisIsAtMaximum(X_AXIS) << 1;
-	status |= stepperAxisIsAtMinimum(X_AXIS) << 0;
-
-	return status;
+	return stepperAxisReadEndstops();
 }
 
 
@@ -697,6 +994,21 @@ void deprimeEnable(bool enable) {
 
 
 void runSteppersSlice() {
+#ifdef HOMING_TWO_STAGE
+	//The homing stages after the approach are planned here rather than in the stepper interrupt
+	if ( homing_stage == HOMING_BACKOFF_PENDING ) {
+		homing_stage = HOMING_BACKOFF;
+		homingBackoff();
+	} else if (( homing_stage == HOMING_BACKOFF ) && ( movesplanned() == 0 )) {
+		homing_stage = HOMING_RETOUCH;
+		homeAxes(homing_maximums, homing_axes, homing_us_per_step);
+	}
+#endif
+
+#ifdef BLOCK_PREFETCH
+	st_prefetch_next_block();
+#endif
+
 #if 0
 #ifdef DEBUG_VALUE
 	uint8_t bufferUsed = movesplanned();
@@ -744,12 +1056,24 @@ void doStepperInterrupt() {
 			//Delete all blocks (should only be 1 homing block) and sync
 			//planner position to stepper position
 			quickStop();
-      if(z_homing) {
-        z_homed++;
-        z_homing = false;
-      }
 
-			setSegmentAccelState(acceleration);
+			bool homed = true;
+#ifdef HOMING_TWO_STAGE
+			//After the approach, runSteppersSlice() backs off and retouches
+			if ( homing_stage == HOMING_APPROACH ) {
+				homing_stage = HOMING_BACKOFF_PENDING;
+				homed = false;
+			} else	homing_stage = HOMING_IDLE;
+#endif
+
+			if ( homed ) {
+        if(z_homing) {
+          z_homed++;
+          z_homing = false;
+        }
+
+				setSegmentAccelState(acceleration);
+			}
 		}
 	}
 
@@ -757,13 +1081,16 @@ void doStepperInterrupt() {
         DEBUG_TIMER_FINISH;
         debugTimer = DEBUG_TIMER_TCTIMER_USI;
 #endif
-}
-
 
-void doExtruderInterrupt() {
-	st_extruder_interrupt();
+#ifdef MOTION_STATS
+	//Timer 5 restarts from 0 on the compare match which raised this interrupt, so
+	//TCNT5 is the time taken so far including the interrupt latency
+	uint16_t ticks = TCNT5;
+	if ( ticks > motion_stats.isr_max_ticks )	motion_stats.isr_max_ticks = ticks;
+#endif
 }
 
+
 uint8_t isZHomed(){
   return z_homed;
 }
@@ -111,6 +111,13 @@ namespace steppers {
     /// \param[in] feedrate of the move in mm's per second multiplied by 64
     void setTargetNewExt(const Point& target, int32_t dda_rate, uint8_t relative, float distance, int16_t feedrateMult64);
 
+    /// With COALESCE_SEGMENTS, short moves from setTargetNewExt are held back to be merged
+    /// with the collinear moves which follow them.  Plan the held move, if any.
+    void flushSegment();
+
+    /// Returns true if a move is held back waiting to be merged
+    bool segmentPending();
+
     /// Home one or more axes
     /// \param[in] maximums If true, home in the positive direction
     /// \param[in] axes_enabled Bitfield specifiying which axes to
@@ -166,9 +173,6 @@ namespace steppers {
     /// Handle the interrupt for the steppers (X/Y/Z/A/B axis)
     void doStepperInterrupt();
 
-    /// Handle the interrupt to extrude material
-    void doExtruderInterrupt();
-
     /// check is z axis has homed
     uint8_t isZHomed();
 
@@ -253,13 +253,32 @@
 //which would lead to stack corruption.
 //#define STACK_PAINT
  
+//If defined, the stepper interrupt and planner keep counters of the buffer occupancy, buffer
+//underruns, planner recalculations, the longest stepper interrupt and the steps per interrupt,
+//which the host can read with HOST_CMD_GET_MOTION_STATS.
+#define MOTION_STATS
+ 
+//If defined, the main loop sets up the block after the current one ahead of time, so when the
+//stepper interrupt reaches the end of a block it only has to copy the next one in.  Costs
+//around 120 bytes of RAM.
+#define BLOCK_PREFETCH
+ 
 //Oversample the dda to provide less jitter.
 //To switch off oversampling, comment out
 //2 is the number of bits, as in a bit shift.  So << 2 = multiply by 4
 //= 4 times oversampling
 //Obviously because of this oversampling is always a power of 2.
 //Don't make it too large, as it will kill performance and can overflow int32_t
+//"scons oversample=N" sets it for a build, and "make ddabench" in firmware/simulator
+//runs the stepper interrupt with 0 to 3 to show the step timing error against the
+//interrupt rate for each.
+#ifndef OVERSAMPLED_DDA
 //#define OVERSAMPLED_DDA 2
+#endif
+
+//Above this interrupt rate the stepper interrupt ticks the oversampled dda more than
+//once per interrupt rather than interrupting more often, in Hz.
+//#define OVERSAMPLED_DDA_MAX_FREQUENCY 20000
  
 //Keep the dda "phase" between line segments
 //If false, each new line segment is started as if it was a new line segment, i.e. no prior history
@@ -270,6 +289,45 @@
 
 #define JKN_ADVANCE
  
+//Jerk limited (S-curve) acceleration.  Each acceleration and deceleration phase keeps
+//its duration and distance but the acceleration ramps up and down instead of stepping.
+//Moves are planned at 3/4 of the configured acceleration so that the 4/3 peak of the ramp
+//stays within it.  Adds 12 bytes to each planner block.
+//#define SCURVE
+ 
+//Input shaping (ZV or ZVD) of the acceleration of moves in X and Y, to cancel the ringing of a
+//resonance set by INPUT_SHAPER_TYPE, FREQUENCY and DAMPING in the EEPROM (off by default).
+//While shaping, moves in X and Y are planned at half of the configured acceleration so that
+//the peak of the shaped acceleration stays within it.  Can't be used with SCURVE.  Adds 12
+//bytes to each planner block.
+//#define INPUT_SHAPING
+ 
+//Home in two stages: approach the endstops at HOMING_APPROACH_SPEEDUP (3) times the homing speed
+//asked for, back off HOMING_BACKOFF_MM (2mm) and retouch them at the speed asked for.
+//#define HOMING_TWO_STAGE
+ 
+//Merge runs of short, nearly collinear moves (up to 1mm) into single planner blocks.  A held
+//back move is planned when a command arrives that it can't be merged with, or after
+//COALESCE_TIMEOUT microseconds without a command.
+#define COALESCE_SEGMENTS
+#define COALESCE_TIMEOUT 50000
+ 
+//If defined, HOST_CMD_QUEUE_POINT_NEW_EXT and _DELTA moves are decoded out of the command buffer as soon as
+//they are complete, into a queue of MOVE_QUEUE_SIZE (a power of 2) moves, and the planner takes
+//as many of them as it has room for in one command slice.  Costs 31 bytes of RAM per move.
+#define MOVE_QUEUE_SIZE 4
+ 
+//If defined, tool (temperature, fan), RGB LED, beep, song and build percentage commands don't
+//wait for the planner to empty.  They're queued as events, up to EVENT_QUEUE_SIZE (a power of 2),
+//and run when the stepper interrupt starts the move after them.  Costs 5 bytes of RAM per event,
+//and 1 per block.
+#define EVENT_QUEUE_SIZE 8
+ 
+//If defined, the host may send HOST_CMD_QUEUE_BATCH packets with payloads of up to
+//BATCH_PACKET_PAYLOAD bytes (at most 255), carrying several commands for the command buffer at
+//once and acknowledged once.  Costs BATCH_PACKET_PAYLOAD - 32 bytes of RAM.
+#define BATCH_PACKET_PAYLOAD 128
+ 
 //Minimum time in seconds that a movement needs to take if the planning pipeline command buffer is
 //emptied. Increase this number if you see blobs while printing high speed & high detail. It will
 //slowdown on the detailed stuff.
@@ -281,23 +339,14 @@
 //2mm/sec is the recommended value.
 #define ACCELERATION_MIN_PLANNER_SPEED 2
  
-//Slowdown limit specifies what to do when the pipeline command buffer starts to empty.
-//The pipeline command buffer is 16 commands in length, and Slowdown Limit can be set 
-//between 0 - 8 (half the buffer size).
+//Slowdown specifies what to do when the pipeline command buffer starts to empty.
 //
-//When Commands Left <= Slowdown Limit, the feed rate is progressively slowed down as the buffer 
-//becomes more empty.
+//When the commands left in the buffer would take less than the slowdown time (EEPROM SLOWDOWN_TIME,
+//in milliseconds, doubled when printing over USB) to execute, the feed rate is progressively slowed
+//down as the buffer becomes more empty.  The slowdown is switched on and off with SLOWDOWN_FLAG.
 //
 //By slowing down the feed rate, you reduce the possibility of running out of commands, and creating 
 //a blob due to the stopped movement.
-//
-//Possible values are:
-//
-//0 - Disabled - Never Slowdown
-//1 - DON'T USE
-//2 - DON'T USE
-//3,4,5,6,7,8 - The higher the number, the earlier the start of the slowdown
-#define ACCELERATION_SLOWDOWN_LIMIT 4
  
 //ACCELERATION_EXTRUDER_WHEN_NEGATIVE specifies the direction of extruder.
 //If negative steps cause an extruder to extrude material, then set this to true.
@@ -23,25 +23,95 @@
 
 typedef uint16_t BufSizeType;
 
+/// The storage of a CircularBufferTempl of SIZE elements, SIZE must be a power
+/// of 2 so that indices wrap with a mask.  The AVR has no divide instruction,
+/// so a 16 bit modulo is a library call.
+template<typename T, BufSizeType SIZE>
+class CircularBufferStorage {
+	// Compile time check that SIZE is a power of 2.  If this fails with
+	// "size of array is negative", then it isn't.
+	typedef char size_check[(SIZE && !(SIZE & (SIZE - 1))) ? 1 : -1];
+protected:
+	T data[SIZE]; /// Buffer data
+
+	static inline BufSizeType capacity() {
+		return SIZE;
+	}
+	static inline BufSizeType wrap(BufSizeType index) {
+		return index & (SIZE - 1);
+	}
+};
+
+/// The storage of a CircularBufferTempl sized at run time, in data_in
+/// supplied by the caller.  Indices wrap with a modulo.
+template<typename T>
+class CircularBufferStorage<T, 0> {
+protected:
+	const BufSizeType size; /// Size of this buffer
+	T* const data; /// Pointer to buffer data
+
+	CircularBufferStorage(BufSizeType size_in, T* data_in) :
+		size(size_in), data(data_in) {
+	}
+
+	inline BufSizeType capacity() const {
+		return size;
+	}
+	inline BufSizeType wrap(BufSizeType index) const {
+		return index % size;
+	}
+};
+
 /// A simple, reliable circular buffer implementation.
 /// This implementation does not offer any protection from
 /// interrupts and code writing over each other!  You must
 /// disable interrupts before all accesses and writes to
 /// a circular buffer that is updated in an interrupt.
-template<typename T>
-class CircularBufferTempl {
+///
+/// CircularBufferTempl<T> is sized at run time, see DEFINE_BUFFER.
+/// CircularBufferTempl<T, SIZE> holds SIZE elements itself, and SIZE
+/// must be a power of 2, which makes every access cheaper.
+template<typename T, BufSizeType SIZE = 0>
+class CircularBufferTempl : private CircularBufferStorage<T, SIZE> {
 public:
 	typedef T BufDataType;
 private:
-	const BufSizeType size; /// Size of this buffer
+	typedef CircularBufferStorage<T, SIZE> Storage;
+	using Storage::data;
+	using Storage::capacity;
+	using Storage::wrap;
+
 	volatile BufSizeType length; /// Current length of valid buffer data
 	volatile BufSizeType start; /// Current start point of valid bufffer data
-	BufDataType* const data; /// Pointer to buffer data
 	volatile bool overflow; /// Overflow indicator
 	volatile bool underflow; /// Underflow indicator
+
+	/// Copy sz elements from index onwards to dst, in at most two runs
+	/// either side of the wrap.  sz must be no more than the length.
+	inline void copyOut(BufSizeType index, BufDataType* dst, BufSizeType sz) {
+		BufSizeType first = wrap(start + index);
+		BufSizeType run = capacity() - first;
+		if (run > sz) {
+			run = sz;
+		}
+		const BufDataType* src = &data[first];
+		for (BufSizeType i = 0; i < run; i++) {
+			*dst++ = *src++;
+		}
+		src = &data[0];
+		for (sz -= run; sz > 0; sz--) {
+			*dst++ = *src++;
+		}
+	}
 public:
+	/// A buffer of SIZE elements
+	CircularBufferTempl() :
+		length(0), start(0), overflow(false), underflow(false) {
+	}
+
+	/// A buffer of size_in elements in data_in, for SIZE 0
 	CircularBufferTempl(BufSizeType size_in, BufDataType* data_in) :
-		size(size_in), length(0), start(0), data(data_in), overflow(false),
+		Storage(size_in, data_in), length(0), start(0), overflow(false),
 				underflow(false) {
 	}
 
@@ -55,7 +125,7 @@ public:
 	}
 	/// Append a byte to the tail of the buffer
 	inline void push(BufDataType b) {
-		if (length < size) {
+		if (length < capacity()) {
 			operator[](length) = b;
 			length++;
 		} else {
@@ -69,7 +139,7 @@ public:
 			return BufDataType();
 		}
 		const BufDataType& popped_byte = operator[](0);
-		start = (start + 1) % size;
+		start = wrap(start + 1);
 		length--;
 		return popped_byte;
 	}
@@ -82,10 +152,35 @@ public:
 			underflow = true;
 			sz = length;
 		}
-		start = (start + sz) % size;
+		start = wrap(start + sz);
 		length -= sz;
 	}
 
+	/// Copy up to sz bytes from the head of the buffer to dst, without
+	/// popping them.
+	/// \return The number of bytes copied, less than sz if the buffer is shorter
+	inline BufSizeType peek(BufSizeType sz, BufDataType* dst) {
+		if (length < sz) {
+			sz = length;
+		}
+		copyOut(0, dst, sz);
+		return sz;
+	}
+
+	/// Pop sz bytes off the head of the buffer into dst.  If there are
+	/// not enough bytes, pop what we can, fill the rest of dst as pop()
+	/// would and set the underflow flag.
+	inline void popInto(BufDataType* dst, BufSizeType sz) {
+		BufSizeType got = peek(sz, dst);
+		pop(got);
+		if (got < sz) {
+			underflow = true;
+			for (dst += got; got < sz; got++) {
+				*dst++ = BufDataType();
+			}
+		}
+	}
+
 	/// Get the length of the buffer
 	inline const BufSizeType getLength() const {
 		return length;
@@ -93,7 +188,7 @@ public:
 
 	/// Get the remaining capacity of this buffer
 	inline const BufSizeType getRemainingCapacity() const {
-		return size - length;
+		return capacity() - length;
 	}
 
 	/// Check if the buffer is empty
@@ -102,7 +197,7 @@ public:
 	}
 	/// Read the buffer directly
 	inline BufDataType& operator[](BufSizeType index) {
-		const BufSizeType actual_index = (index + start) % size;
+		const BufSizeType actual_index = wrap(index + start);
 		return data[actual_index];
 	}
 	/// Check the overflow flag
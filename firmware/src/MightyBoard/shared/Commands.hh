@@ -80,6 +80,8 @@
 #define HOST_CMD_BOARD_STATUS	     23
 #define HOST_CMD_GET_BUILD_STATS   24
 #define HOST_CMD_ADVANCED_VERSION  27
+// Retrieve the planner and stepper interrupt counters (MOTION_STATS)
+#define HOST_CMD_GET_MOTION_STATS  28
 
 // These are our bufferable commands from the host
 
@@ -115,6 +117,26 @@
 #define HOST_CMD_QUEUE_POINT_NEW_EXT 155
 #define HOST_CMD_SET_ACCELERATION_TOGGLE 156
 #define HOST_CMD_STREAM_VERSION    157
+// Arc in the XY plane (G2/G3) expanded into segments on board, see Arc.hh
+#define HOST_CMD_QUEUE_ARC         158
+// Compact HOST_CMD_QUEUE_POINT_NEW_EXT.  After the command code, the number of bytes that follow,
+// then a flags byte.  Bits 0-4 flag the axes X-B that have a change, each then follows as a
+// zig-zag varint (7 bits a byte, low first, bit 7 set on all but the last).  For an absolute
+// axis it's the change from that axis's last absolute target, for a relative axis it's the
+// move.  Then, as flagged, the relative mask (uint8), the feedrate*64 (int16), and together
+// the distance (float) and dda rate (unsigned varint).  The mask and feed rate are otherwise
+// those of the last HOST_CMD_QUEUE_POINT_NEW_EXT or delta, and the distance and dda rate are
+// worked out from the move.  The last absolute targets are those of the moves and arcs before,
+// or the position of a HOST_CMD_SET_POSITION_EXT; homing and HOST_CMD_RECALL_HOME_POSITION
+// don't change them.  A delta whose fields need more bytes than its length is dropped.
+#define HOST_CMD_QUEUE_POINT_DELTA 159
+#define DELTA_FLAG_RELATIVE        0x20
+#define DELTA_FLAG_FEEDRATE        0x40
+#define DELTA_FLAG_DISTANCE        0x80
+// Commands to append to the command buffer as they are, all or none, in a packet of up to
+// BATCH_PACKET_PAYLOAD bytes.  Not itself buffered; the reply is the response code and the
+// command buffer's remaining capacity (uint32).
+#define HOST_CMD_QUEUE_BATCH       160
 #define HOST_CMD_DEBUG_ECHO        0x70
 
 // These are our query commands from the host
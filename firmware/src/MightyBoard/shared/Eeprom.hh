@@ -32,15 +32,22 @@ void setEepromInt64(const uint16_t location, const int64_t value);
 
 #ifdef SIMULATOR
 
-uint8_t getEeprom8(const uint16_t location, const uint8_t default_value) { return default_value; }
-uint16_t getEeprom16(const uint16_t location, const uint16_t default_value) { return default_value; }
-uint32_t getEeprom32(const uint16_t location, const uint32_t default_value) { return default_value; }
-float getEepromFixed16(const uint16_t location, const float default_value) { return default_value; }
-void setEepromFixed16(const uint16_t location, const float new_value) { }
-int64_t getEepromInt64(const uint16_t location, const int64_t default_value) { return default_value; }
-void setEepromInt64(const uint16_t location, const int64_t value) { }
-void storeToolheadToleranceDefaults() { }
-void setDefaultsAcceleration() { }
+/// Host tests may set this to supply EEPROM bytes; unset, every byte reads as erased (0xff)
+extern uint8_t (*simulator_eeprom_read8)(const uint16_t location);
+inline uint8_t getEeprom8(const uint16_t location, const uint8_t default_value) {
+	uint8_t data = simulator_eeprom_read8 ? simulator_eeprom_read8(location) : 0xff;
+	return (data == 0xff) ? default_value : data;
+}
+inline uint16_t getEeprom16(const uint16_t location, const uint16_t default_value) { return default_value; }
+inline uint32_t getEeprom32(const uint16_t location, const uint32_t default_value) { return default_value; }
+inline float getEepromFixed16(const uint16_t location, const float default_value) { return default_value; }
+inline void setEepromFixed16(const uint16_t location, const float new_value) { }
+inline int64_t getEepromInt64(const uint16_t location, const int64_t default_value) { return default_value; }
+inline void setEepromInt64(const uint16_t location, const int64_t value) { }
+inline void storeToolheadToleranceDefaults() { }
+inline void setDefaultsAcceleration() { }
+inline void setDefaultsAccelerationAdded() { }
+inline void eepromResetv7() { }
 #endif
 
 }
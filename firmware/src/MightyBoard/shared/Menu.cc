@@ -1240,7 +1240,7 @@ bool MessageScreen::screenWaiting(void){
   return (timeout.isActive() || incomplete || waiting_for_user);
 }
 
-void MessageScreen::addMessage(CircularBuffer& buf) {
+void MessageScreen::addMessage(command::CommandBuffer& buf) {
   char c = buf.pop();
   while (c != '\0' && cursor < BUF_SIZE && buf.getLength() > 0) {
     message[cursor++] = c;
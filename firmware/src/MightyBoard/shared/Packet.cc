@@ -20,7 +20,7 @@
 
 /// Append a byte and update the CRC
 void Packet::appendByte(uint8_t data) {
-	if (length < MAX_PACKET_PAYLOAD) {
+	if (length < max_length) {
 		crc = _crc_ibutton_update(crc, data);
 		payload[length] = data;
 		length++;
@@ -31,7 +31,7 @@ void Packet::reset() {
 	crc = 0;
 	length = 0;
 #ifdef PARANOID
-	for (uint8_t i = 0; i < MAX_PACKET_PAYLOAD; i++) {
+	for (uint8_t i = 0; i < max_length; i++) {
 		payload[i] = 0;
 	}
 #endif // PARANOID
@@ -39,7 +39,7 @@ void Packet::reset() {
 	state = PS_START;
 }
 
-InPacket::InPacket() {
+InPacket::InPacket() : Packet(in_payload, MAX_IN_PACKET_PAYLOAD) {
 	reset();
 }
 
@@ -57,7 +57,7 @@ void InPacket::processByte(uint8_t b) {
 			error(PacketError::NOISE_BYTE);
 		}
 	} else if (state == PS_LEN) {
-		if (b <= MAX_PACKET_PAYLOAD) {
+		if (b <= max_length) {
 			expected_length = b;
 			state = (expected_length == 0) ? PS_CRC : PS_PAYLOAD;
 		} else {
@@ -100,7 +100,7 @@ uint32_t Packet::read32(uint8_t index) const {
 	return shared.a;
 }
 
-OutPacket::OutPacket() {
+OutPacket::OutPacket() : Packet(out_payload, MAX_PACKET_PAYLOAD) {
 	reset();
 }
 
@@ -19,10 +19,18 @@
 #define SHARED_PACKET_HH_
 
 #include <stdint.h>
+#include "Configuration.hh"
 
 #define START_BYTE 0xD5
 #define MAX_PACKET_PAYLOAD 32
 
+/// Host packets may be longer than replies, to carry a HOST_CMD_QUEUE_BATCH
+#ifdef BATCH_PACKET_PAYLOAD
+#define MAX_IN_PACKET_PAYLOAD BATCH_PACKET_PAYLOAD
+#else
+#define MAX_IN_PACKET_PAYLOAD MAX_PACKET_PAYLOAD
+#endif
+
 #define SLAVE_ID_BROADCAST 127
 
 namespace PacketError {
@@ -75,10 +83,14 @@ protected:
 
     volatile uint8_t length; /// The current length of the payload (data[0] if raw packets)
     volatile uint8_t crc; /// The CRC of the current contents of the payload (data[-1] of raw packets)
-    volatile uint8_t payload[MAX_PACKET_PAYLOAD]; /// Data payload (starts at data[2] of raw packet)
+    volatile uint8_t* const payload; /// Data payload (starts at data[2] of raw packet), held by the subclass
+    const uint8_t max_length; /// Size of the payload
 	volatile uint8_t error_code; // Have any errors cropped up during processing?
 	volatile PacketState state;
 
+	Packet(volatile uint8_t* payload_in, uint8_t max_length_in) :
+		payload(payload_in), max_length(max_length_in) {}
+
 
 	/// Append a byte and update the CRC
 	void appendByte(uint8_t data);
@@ -112,6 +124,7 @@ public:
 class InPacket: public Packet {
 private:
 	volatile uint8_t expected_length;
+	volatile uint8_t in_payload[MAX_IN_PACKET_PAYLOAD];
 public:
 	InPacket();
 
@@ -141,6 +154,7 @@ public:
 class OutPacket: public Packet {
 private:
 	uint8_t send_payload_index;
+	volatile uint8_t out_payload[MAX_PACKET_PAYLOAD];
 public:
 	OutPacket();
 
@@ -1,7 +1,11 @@
 #include <gtest/gtest.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include "CircularBuffer.hh"
 
 const BufSizeType buffer_size = 29;
+const BufSizeType masked_size = 32;
 
 TEST(CircularBufferTest, WalkAround) {
     DEFINE_BUFFER(cb,uint8_t,buffer_size);
@@ -98,3 +102,140 @@ TEST(CircularBufferTest,UnderflowCheck) {
         ASSERT_FALSE(cb.hasUnderflow());
     }
 }
+
+TEST(CircularBufferTest, MaskedWalkAround) {
+    CircularBufferTempl<uint8_t,masked_size> cb;
+    for (int offset = 0; offset < masked_size*3; offset++) {
+        ASSERT_EQ(cb.getLength(),0);
+        cb.push(offset);
+        ASSERT_EQ(cb.getLength(),1);
+        ASSERT_EQ(cb[0],offset);
+        ASSERT_EQ(cb.pop(),offset);
+    }
+    ASSERT_EQ(cb.getRemainingCapacity(),masked_size);
+    ASSERT_FALSE(cb.hasOverflow());
+    ASSERT_FALSE(cb.hasUnderflow());
+}
+
+TEST(CircularBufferTest, MaskedOverflowCheck) {
+    CircularBufferTempl<uint8_t,masked_size> cb;
+    for (int fill_count = 0; fill_count < masked_size; fill_count++) {
+        cb.push(fill_count);
+        ASSERT_FALSE(cb.hasOverflow());
+    }
+    ASSERT_EQ(cb.getRemainingCapacity(),0);
+    cb.push(1);
+    ASSERT_TRUE(cb.hasOverflow());
+    ASSERT_EQ(cb.getLength(),masked_size);
+}
+
+// Peek and pop runs of every length from every start point, so the runs
+// cross the wrap at every position
+template<typename Buffer>
+void bulkExerciser(Buffer& cb, BufSizeType size) {
+    uint8_t out[64];
+    for (int offset = 0; offset < size; offset++) {
+        for (BufSizeType run = 1; run <= size; run++) {
+            cb.reset();
+            for (int i = 0; i < offset; i++) {
+                cb.push(0xff);
+            }
+            cb.pop(offset);
+            for (BufSizeType i = 0; i < run; i++) {
+                cb.push(i + offset);
+            }
+            memset(out, 0, sizeof(out));
+            ASSERT_EQ(cb.peek(run,out),run);
+            ASSERT_EQ(cb.getLength(),run);
+            for (BufSizeType i = 0; i < run; i++) {
+                ASSERT_EQ(out[i],i + offset);
+            }
+            memset(out, 0, sizeof(out));
+            cb.popInto(out,run);
+            ASSERT_EQ(cb.getLength(),0);
+            for (BufSizeType i = 0; i < run; i++) {
+                ASSERT_EQ(out[i],i + offset);
+            }
+            ASSERT_FALSE(cb.hasOverflow());
+            ASSERT_FALSE(cb.hasUnderflow());
+        }
+    }
+}
+
+TEST(CircularBufferTest, BulkExerciser) {
+    DEFINE_BUFFER(cb,uint8_t,buffer_size);
+    bulkExerciser(cb, buffer_size);
+}
+
+TEST(CircularBufferTest, MaskedBulkExerciser) {
+    CircularBufferTempl<uint8_t,masked_size> cb;
+    bulkExerciser(cb, masked_size);
+}
+
+TEST(CircularBufferTest, BulkUnderflowCheck) {
+    CircularBufferTempl<uint8_t,masked_size> cb;
+    uint8_t out[4] = { 0xff, 0xff, 0xff, 0xff };
+    cb.push(1);
+    cb.push(2);
+    ASSERT_EQ(cb.peek(4,out),2);
+    ASSERT_FALSE(cb.hasUnderflow());
+    cb.popInto(out,4);
+    ASSERT_TRUE(cb.hasUnderflow());
+    ASSERT_EQ(cb.getLength(),0);
+    ASSERT_EQ(out[0],1);
+    ASSERT_EQ(out[1],2);
+    ASSERT_EQ(out[2],0);
+    ASSERT_EQ(out[3],0);
+}
+
+// Throughput of decoding 32 bit fields, as Command.cc's pop32() does for the
+// nine fields of a move: four pop()s against one popInto(), in a buffer
+// sized at run time and a masked one.  Reports nanoseconds per byte.
+const int bench_fields = 1000000;
+
+template<typename Buffer>
+double benchPop(Buffer& cb, bool bulk, uint32_t& sum) {
+    clock_t t0 = clock();
+    for (int field = 0; field < bench_fields; field++) {
+        for (int i = 0; i < 4; i++) {
+            cb.push(field >> (i * 8));
+        }
+        union {
+            uint32_t a;
+            uint8_t data[4];
+        } shared;
+        if (bulk) {
+            cb.popInto(shared.data,4);
+        } else {
+            shared.data[0] = cb.pop();
+            shared.data[1] = cb.pop();
+            shared.data[2] = cb.pop();
+            shared.data[3] = cb.pop();
+        }
+        sum += shared.a;
+    }
+    return 1.0e9 * (double)(clock() - t0) / CLOCKS_PER_SEC / (4.0 * bench_fields);
+}
+
+TEST(CircularBufferTest, ThroughputBenchmark) {
+    uint8_t modulo_data[512];
+    CircularBufferTempl<uint8_t> modulo(sizeof(modulo_data), modulo_data);
+    CircularBufferTempl<uint8_t,512> masked;
+    uint32_t sum = 0;
+
+    // Leave the buffers part full, as the command buffer usually is
+    for (int i = 0; i < 123; i++) {
+        modulo.push(i);
+        masked.push(i);
+    }
+
+    printf("pop() x 4, modulo:  %.2f ns/byte\n", benchPop(modulo, false, sum));
+    printf("pop() x 4, masked:  %.2f ns/byte\n", benchPop(masked, false, sum));
+    printf("popInto(), modulo:  %.2f ns/byte\n", benchPop(modulo, true, sum));
+    printf("popInto(), masked:  %.2f ns/byte\n", benchPop(masked, true, sum));
+
+    ASSERT_EQ(modulo.getLength(),123);
+    ASSERT_EQ(masked.getLength(),123);
+    ASSERT_FALSE(modulo.hasUnderflow() || masked.hasUnderflow());
+    ASSERT_NE(sum,0u);
+}
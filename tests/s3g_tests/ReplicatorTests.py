@@ -533,6 +533,54 @@ class s3gFunctionTests(unittest.TestCase):
     time.sleep(5) # we need to sleep after sending any reset functions
     self.assertEqual(bufferSize, self.r.get_available_buffer_size())
 
+  def BatchPacket(self, count):
+    """
+    Helper method to generate a Queue Batch (160) packet of count one millisecond delays,
+    5 bytes each.  It's built here as it's longer than the s3g module's packets.
+    """
+    payload = bytearray()
+    payload.append(160)
+    for i in range(count):
+      payload.append(s3g.host_action_command_dict['DELAY'])
+      payload.extend(s3g.Encoder.encode_uint32(1))
+    packet = bytearray()
+    packet.append(s3g.header)
+    packet.append(len(payload))
+    packet.extend(payload)
+    packet.append(s3g.Encoder.CalculateCRC(payload))
+    return packet
+
+  def StallBuffer(self):
+    """
+    Helper method to hold the command buffer behind a platform wait, as test_ClearBuffer does
+    """
+    self.r.set_platform_temperature(0, 100)
+    self.r.wait_for_platform_ready(0, 0, 0xFFFF)
+    time.sleep(1)
+
+  def test_QueueBatch(self):
+    batchCount = 20
+    self.StallBuffer()
+    available = self.r.get_available_buffer_size()
+    response = self.r.writer.send_packet(self.BatchPacket(batchCount))
+    capacity = struct.unpack('<I', str(response[1:5]))[0]
+    self.assertEqual(available - 5*batchCount, capacity)
+    self.assertEqual(capacity, self.r.get_available_buffer_size())
+    self.r.clear_buffer()
+    time.sleep(5)
+
+  def test_QueueBatchOverflow(self):
+    batchCount = 20
+    self.StallBuffer()
+    # Leave less room than the batch needs, the batch is queued whole or not at all
+    while self.r.get_available_buffer_size() >= 5*batchCount:
+      self.r.find_axes_minimums(['z'], 500, 5)
+    available = self.r.get_available_buffer_size()
+    self.assertRaises(s3g.TransmissionError, self.r.writer.send_packet, self.BatchPacket(batchCount))
+    self.assertEqual(available, self.r.get_available_buffer_size())
+    self.r.clear_buffer()
+    time.sleep(5)
+
   def test_PauseandBuildStats(self):
     stats = self.r.get_build_stats()
     build_paused_state = 3